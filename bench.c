@@ -0,0 +1,259 @@
+/*
+ * Microbenchmarks for cgiserver's request parsing.
+ *
+ * Builds the server without its main() and times the pieces of
+ * handleRequest that don't touch the network: request line and
+ * header splitting, URL decoding, path checks, extension and MIME
+ * lookup, and directory listings.
+ *
+ *     make bench && ./bench
+ *
+ * Each benchmark reports nanoseconds per operation and heap calls
+ * (malloc, calloc, realloc, free, counted by the same hooks the
+ * status page uses) per operation.
+ */
+
+#define NO_MAIN 1
+#include "cgiserver.c"
+
+#define BENCH_TIME    0.5    /* Seconds to run each benchmark for */
+#define BENCH_ENTRIES 10000  /* Files in the listing benchmark's directory */
+
+/*
+ * A request as sent by a desktop browser.
+ */
+static const char browser_request[] =
+	"GET /docs/guide/index.html?ref=nav HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Referer: https://www.example.com/docs/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+	"Cookie: session=5f2b7c9e1a4d8f3b6e0c2a7d9f1b4e8c; theme=dark; _ga=GA1.2.1234567890.1697000000; _gid=GA1.2.987654321.1697000000\r\n"
+	"If-None-Match: \"5f2b-1697000000\"\r\n"
+	"If-Modified-Since: Wed, 11 Oct 2023 07:28:00 GMT\r\n";
+
+static char long_query_request[4096];
+static char cookie_request[8192];
+static char encoded_path[1024];
+static char plain_path[1024];
+
+static const char * file_names[] = {
+	"/index.html", "/style/site.css", "/img/logo.png", "/img/photo.2023.jpg",
+	"/anim.gif", "/papers/report.pdf", "/app.manifest", "/README",
+	"/.hidden", "/archive.tar.gz", "/scripts/search.cgi", "/fonts/body.woff2",
+};
+
+static char listing_dir[PATH_MAX];
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Parse a whole request the way handleRequest does: store each line
+ * in the arena, then parse the request line and split each header.
+ * The strchr to the next line stands in for fgets.
+ */
+static void parse_request(const char * request, struct arena * a) {
+	const char * in = request;
+	int first = 1;
+	while (*in) {
+		char * line = store_line(a, in);
+		if (!line) {
+			abort();
+		}
+		if (first) {
+			int request_type;
+			char * filename = NULL, * querystring = NULL, * http_version = NULL;
+			if (parse_request_line(line, &request_type, &filename, &querystring, &http_version) || !request_type) {
+				abort();
+			}
+			first = 0;
+		} else if (!split_header(line)) {
+			abort();
+		}
+		in = strchr(in, '\n') + 1;
+	}
+}
+
+static void bench_browser_headers(struct arena * a) {
+	parse_request(browser_request, a);
+}
+
+static void bench_long_query(struct arena * a) {
+	parse_request(long_query_request, a);
+}
+
+static void bench_large_cookies(struct arena * a) {
+	parse_request(cookie_request, a);
+}
+
+static void bench_url_decode(struct arena * a) {
+	if (url_decode(a, encoded_path) == encoded_path) {
+		abort();
+	}
+}
+
+static void bench_url_decode_plain(struct arena * a) {
+	if (url_decode(a, plain_path) != plain_path) {
+		abort();
+	}
+}
+
+static void bench_path_check(struct arena * a) {
+	(void)a;
+	if (path_escapes(plain_path)) {
+		abort();
+	}
+}
+
+static void bench_mime(struct arena * a) {
+	(void)a;
+	size_t i, len, total = 0;
+	for (i = 0; i < sizeof(file_names) / sizeof(*file_names); ++i) {
+		mime_header(file_extension((char *)file_names[i]), &len);
+		total += len;
+	}
+	if (!total) {
+		abort();
+	}
+}
+
+static void bench_listing(struct arena * a) {
+	size_t len;
+	render_listing(a, listing_dir, &len);
+	if (len < BENCH_ENTRIES * 20) {
+		abort();
+	}
+}
+
+/*
+ * Run fn in doubling batches until BENCH_TIME has passed. The arena
+ * is reset between operations, as it is between requests.
+ */
+static void bench(const char * name, void (*fn)(struct arena *), unsigned long ops_per_call) {
+	struct arena a = { NULL, NULL };
+	unsigned long batch = 1, calls = 0, k;
+	fn(&a);
+	arena_reset(&a);
+	unsigned long heap_calls = thread_heap_calls;
+	double start = bench_now(), elapsed;
+	do {
+		for (k = 0; k < batch; ++k) {
+			fn(&a);
+			arena_reset(&a);
+		}
+		calls += batch;
+		batch *= 2;
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_TIME);
+	double ops = (double)calls * ops_per_call;
+	printf("%-22s %12.1f ns/op %10.2f allocs/op %12lu ops\n", name,
+			elapsed * 1e9 / ops, (thread_heap_calls - heap_calls) / ops, (unsigned long)ops);
+	arena_trim(&a, 0);
+}
+
+static void make_corpora(void) {
+	/*
+	 * A search form submission with a long query string.
+	 */
+	size_t len = sprintf(long_query_request, "GET /search.cgi?q=");
+	while (len < 2048) {
+		len += sprintf(long_query_request + len, "performance+tuning%%20guide%%3A+part+%lu&", len);
+	}
+	sprintf(long_query_request + len, "page=2 HTTP/1.1\r\nHost: www.example.com\r\nAccept: */*\r\n");
+
+	/*
+	 * An application page with a few kilobytes of tracking cookies.
+	 */
+	len = sprintf(cookie_request, "GET /app/dashboard HTTP/1.1\r\n"
+			"Host: www.example.com\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+			"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+			"Cookie: ");
+	int c;
+	for (c = 0; c < 60; ++c) {
+		len += sprintf(cookie_request + len, "tracker_%02d=5f2b7c9e1a4d8f3b6e0c2a7d9f1b4e8c5f2b7c9e; ", c);
+	}
+	sprintf(cookie_request + len, "end=1\r\nAccept-Language: en-US,en;q=0.9\r\n");
+
+	/*
+	 * Paths with and without escapes.
+	 */
+	strcpy(encoded_path, PAGES_DIRECTORY);
+	strcpy(plain_path, PAGES_DIRECTORY);
+	while (strlen(encoded_path) < 400) {
+		strcat(encoded_path, "/My%20Documents/caf%C3%A9+menu%202023");
+		strcat(plain_path, "/shared/documents/archive-2023/menus");
+	}
+	strcat(encoded_path, "/index.html");
+	strcat(plain_path, "/index.html");
+
+	/*
+	 * A directory with BENCH_ENTRIES files and a few subdirectories.
+	 */
+	strcpy(listing_dir, "/tmp/cgiserver-bench-XXXXXX");
+	if (!mkdtemp(listing_dir)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	int i;
+	char name[PATH_MAX + 64];
+	for (i = 0; i < BENCH_ENTRIES; ++i) {
+		sprintf(name, "%s/photo-%05d.jpg", listing_dir, i);
+		int fd = open(name, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0) {
+			perror(name);
+			exit(1);
+		}
+		close(fd);
+	}
+	for (i = 0; i < 16; ++i) {
+		sprintf(name, "%s/album-%02d", listing_dir, i);
+		mkdir(name, 0755);
+	}
+}
+
+static void remove_corpora(void) {
+	int i;
+	char name[PATH_MAX + 64];
+	for (i = 0; i < BENCH_ENTRIES; ++i) {
+		sprintf(name, "%s/photo-%05d.jpg", listing_dir, i);
+		unlink(name);
+	}
+	for (i = 0; i < 16; ++i) {
+		sprintf(name, "%s/album-%02d", listing_dir, i);
+		rmdir(name);
+	}
+	rmdir(listing_dir);
+}
+
+int main(int argc, char ** argv) {
+	(void)argc;
+	(void)argv;
+	make_corpora();
+	bench("parse browser request", bench_browser_headers, 1);
+	bench("parse long query", bench_long_query, 1);
+	bench("parse large cookies", bench_large_cookies, 1);
+	bench("url decode (escaped)", bench_url_decode, 1);
+	bench("url decode (plain)", bench_url_decode_plain, 1);
+	bench("path check", bench_path_check, 1);
+	bench("extension + mime", bench_mime, sizeof(file_names) / sizeof(*file_names));
+	bench("listing 10k entries", bench_listing, 1);
+	remove_corpora();
+	return 0;
+}
@@ -36,7 +36,9 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -54,12 +56,33 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+#endif
 
 #define PORT          80     /* Server port */
 #define HEADER_SIZE   10240L /* Maximum size of a request header line */
 #define CGI_POST      10240L /* Buffer size for reading POST data to CGI */
 #define CGI_BUFFER    10240L /* Buffer size for reading CGI output */
 #define FLAT_BUFFER   10240L /* Buffer size for reading flat files */
+#define HEADER_BLOCK  4096   /* Buffer size for assembling response headers */
+#define IO_BUFFER     10240L /* Size of pooled I/O buffers (all of the above fit) */
+#define ARENA_CHUNK   16384  /* Per-connection arena growth step */
+#define ARENA_KEEP    65536  /* Arena kept by an idle pooled connection */
+#define SENDFILE_MIN  32768  /* Smaller files are copied into the output queue instead */
+#define OUTPUT_LIMIT  262144 /* Response bytes queued per connection before we wait on the client */
+#define NOTSENT_LOWAT 16384  /* Unsent bytes the kernel holds for a client (TCP_NOTSENT_LOWAT) */
+#define PARK_TIMEOUT  60     /* Seconds a client can go without taking any output */
 
 /*
  * Standard extensions
@@ -68,9 +91,161 @@
 #ifdef  ENABLE_EXTENSIONS
 #define ENABLE_CGI      1    /* Whether or not to enable CGI (also POST and HEAD) */
 #define ENABLE_DEFAULTS 1    /* Whether or not to enable default index files (.php, .pl, .html) */
+#define ENABLE_HTTP2    1    /* Whether or not to speak HTTP/2 over cleartext (h2c) */
+#define ENABLE_STATUS   1    /* Whether or not to answer STATUS_PATH for local clients */
+#define ENABLE_ADMIT    1    /* Whether or not to limit connections and requests per client */
+#define ENABLE_MICROCACHE 1  /* Whether or not to cache CGI responses that ask for it */
+#define ENABLE_PROXY    1    /* Whether or not to forward prefixes to upstream servers (-x) */
+#define ENABLE_TIMING   1    /* Whether or not to time request phases (-t, -l, USDT probes) */
+#define ENABLE_XSENDFILE 1   /* Whether or not CGI scripts may hand back files with X-Sendfile */
+#define ENABLE_IMAGE    1    /* Whether or not to serve from a packed docroot image (-i) */
+#define ENABLE_MODULES  1    /* Whether or not to load handler modules (-m) */
+#define ENABLE_CAPTURE  1    /* Whether or not to record requests for replay (-R) */
+#define ENABLE_UNIX     1    /* Whether or not to listen on a Unix domain socket (-U) */
+#define ENABLE_PROXY_PROTOCOL 1 /* Whether or not to take client addresses from PROXY headers (-P) */
+#define ENABLE_PEERS    1    /* Whether or not to share cached CGI responses with other servers (-C) */
+#define ENABLE_SCHED    1    /* Whether or not to give each kind of request its own limits */
 #else
 #define ENABLE_CGI      0
 #define ENABLE_DEFAULTS 0
+#define ENABLE_HTTP2    0
+#define ENABLE_STATUS   0
+#define ENABLE_ADMIT    0
+#define ENABLE_MICROCACHE 0
+#define ENABLE_PROXY    0
+#define ENABLE_TIMING   0
+#define ENABLE_XSENDFILE 0
+#define ENABLE_IMAGE    0
+#define ENABLE_MODULES  0
+#define ENABLE_CAPTURE  0
+#define ENABLE_UNIX     0
+#define ENABLE_PROXY_PROTOCOL 0
+#define ENABLE_PEERS    0
+#define ENABLE_SCHED    0
+#endif
+
+/*
+ * Peers are reached with the reverse proxy's upstream connections
+ * and share the CGI cache.
+ */
+#if ENABLE_PEERS && !(ENABLE_MICROCACHE && ENABLE_PROXY)
+#undef ENABLE_PEERS
+#define ENABLE_PEERS    0
+#endif
+
+/*
+ * Platform extensions
+ */
+#ifdef __linux__
+#define ENABLE_IO_URING 1    /* Whether or not to offer the io_uring backend (-u) */
+#else
+#define ENABLE_IO_URING 0
+#endif
+
+#ifdef __linux__
+#define ENABLE_SENDFILE 1    /* Whether or not to send file ranges with sendfile */
+#else
+#define ENABLE_SENDFILE 0
+#endif
+
+#ifdef __linux__
+#define ENABLE_GETDENTS 1    /* Whether or not to read directories with getdents64 */
+#else
+#define ENABLE_GETDENTS 0
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ENABLE_SIMD     1    /* Whether or not to scan requests with SSE2/AVX2 */
+#else
+#define ENABLE_SIMD     0
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && ENABLE_STATUS
+#define ENABLE_PROFILER 1    /* Whether or not to offer the sampling profiler (-p) */
+#else
+#define ENABLE_PROFILER 0
+#endif
+
+#ifndef ENABLE_TLS
+#define ENABLE_TLS      0    /* Whether or not to offer HTTPS (-s), set by the Makefile */
+#endif
+
+#if ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#if ENABLE_SIMD
+#include <immintrin.h>
+#include <stdint.h>
+#endif
+
+#if ENABLE_IMAGE
+#include <sys/mman.h>
+#include <stdint.h>
+#endif
+
+#if ENABLE_MODULES
+#include <dlfcn.h>
+#include "module.h"
+#endif
+
+#if ENABLE_CAPTURE
+#include <stdint.h>
+#endif
+
+#if ENABLE_PROFILER
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <stdint.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+#if ENABLE_PEERS
+#include <stdint.h>
+#endif
+
+#if ENABLE_SCHED
+#include <sys/resource.h>
+#endif
+
+#if ENABLE_UNIX
+#include <sys/un.h>
+#include <stddef.h>
+#endif
+
+/*
+ * Static tracing probes, if systemtap's header is around.
+ * Without a tracer attached each one is a single nop.
+ */
+#if ENABLE_TIMING && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a)       STAP_PROBE1(cgiserver, name, a)
+#define PROBE2(name, a, b)    STAP_PROBE2(cgiserver, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(cgiserver, name, a, b, c)
+#endif
+#endif
+#ifndef PROBE2
+#define PROBE1(name, a)       do { } while (0)
+#define PROBE2(name, a, b)    do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#if ENABLE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#if ENABLE_IO_URING
+#include <sys/mman.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define URING_ENTRIES   64   /* Submission queue size for each ring */
+#define URING_POOL      64   /* Idle per-connection rings kept for reuse */
 #endif
 
 /*
@@ -79,11 +254,249 @@
 #define INDEX_DEFAULTS  {"index.php", "index.pl", "index.py", "index.htm", "index.html", 0}
 #define INDEX_EXECUTES  {          1,          1,          1,           0,            0, -1}
 
+/*
+ * Listening sockets.
+ * -L name=value[,name=value...] overrides these at startup; a 0
+ * leaves that option at the kernel's default.
+ */
+#define LISTEN_BACKLOG    1024 /* Pending connections per TCP listener (backlog=) */
+#define LISTEN_DEFER      1    /* Seconds the kernel holds a connection until its request arrives (defer=) */
+#define LISTEN_FASTOPEN   256  /* Pending TCP Fast Open requests (fastopen=) */
+#define LISTEN_NODELAY    1    /* Whether to send responses without waiting on ACKs (nodelay=) */
+#define LISTEN_SNDBUF     0    /* Socket send buffer, in bytes (sndbuf=) */
+#define LISTEN_RCVBUF     0    /* Socket receive buffer, in bytes (rcvbuf=) */
+#define ACCEPT_BATCH      32   /* Connections taken per wakeup (batch=) */
+
 /*
  * Directory to serve out of.
  */
 #define PAGES_DIRECTORY "pages"
 #define VERSION_STRING  "klange/0.5"
+#define STATUS_PATH     "/server-status"
+
+/*
+ * Per-client limits (ENABLE_ADMIT), off until -A turns them on.
+ * Clients are tracked by IPv4 address in ADMIT_SHARDS independently
+ * locked tables. A client idle for ADMIT_IDLE seconds may be evicted.
+ * The first three are defaults for -A name=value[,name=value...].
+ */
+#define ADMIT_CONNECTIONS 64   /* Concurrent connections per client (connections=) */
+#define ADMIT_RATE        100  /* Requests per second per client, sustained (rate=) */
+#define ADMIT_BURST       200  /* Requests per client, in a burst (burst=) */
+#define ADMIT_SHARDS      64   /* Lock stripes */
+#define ADMIT_SLOTS       256  /* Clients tracked per stripe */
+#define ADMIT_PROBE       16   /* Slots searched for a client */
+#define ADMIT_IDLE        10   /* Seconds before an idle client may be forgotten */
+
+/*
+ * Directory listings.
+ * Directories with more than LISTING_BATCH files are streamed in
+ * the order the filesystem has them rather than sorted. Paged
+ * listings (?offset=&limit=) come from a sorted index kept for the
+ * last LISTING_CACHE directories.
+ */
+#define LISTING_BATCH     4096  /* Files sorted before we stream instead */
+#define LISTING_BUFFER    32768 /* Directory read buffer */
+#define LISTING_PAGE      1000  /* Default and largest page */
+#define LISTING_CACHE     16    /* Sorted directory indexes kept */
+
+/*
+ * CGI concurrency.
+ * Requests beyond either cap wait in line for up to CGI_QUEUE_WAIT
+ * seconds; if the line is full or the wait runs out, they get a 503.
+ */
+#define CGI_MAX_CHILDREN  32   /* Running CGI processes, in total */
+#define CGI_MAX_SCRIPT    8    /* Running CGI processes, per script */
+#define CGI_QUEUE         64   /* Requests allowed to wait for a slot */
+#define CGI_QUEUE_WAIT    5    /* Seconds a request may wait for a slot */
+#define CGI_SCRIPTS       128  /* Scripts tracked for the per-script cap */
+
+/*
+ * Scheduling classes (ENABLE_SCHED).
+ * Requests are classed as static files, listings, CGI, modules or
+ * proxied once we know which they are. Each class has a cap on
+ * requests in progress; past it (or past SCHED_WORKERS), requests
+ * wait up to SCHED_WAIT seconds and then get a 503. SCHED_RESERVED
+ * of the workers are only for static files, which also go first
+ * when a worker frees up. The status page shows each class's counts
+ * and latency.
+ */
+#define SCHED_WORKERS     512  /* Requests in progress, over all classes */
+#define SCHED_RESERVED    128  /* ...of which only static files may use */
+#define SCHED_LIMITS      { SCHED_WORKERS, 64, CGI_MAX_CHILDREN + CGI_QUEUE, 128, 128 }
+#define SCHED_WAIT        5    /* Seconds a request may wait for its class */
+#define SCHED_BUCKETS     32   /* Latency histogram buckets, powers of two in microseconds */
+#define SCHED_CGI_NICE    5    /* Added to CGI processes' nice value, so they yield the CPU to us */
+
+/*
+ * Request bodies.
+ * A body over the limit for its path is refused with a 413 before
+ * any of it is read; -b sets limits for path prefixes.
+ */
+#define BODY_MAX          (16 * 1024 * 1024) /* Default limit, in bytes */
+#define BODY_LIMITS       8    /* Prefixes (-b) */
+
+/*
+ * CGI response cache (ENABLE_MICROCACHE).
+ */
+#define CACHE_MEMORY      (16 * 1024 * 1024) /* Total size of cached responses */
+#define CACHE_MAX_ENTRY   (1024 * 1024)      /* Largest response we will cache */
+#define CACHE_BUCKETS     1024 /* Hash buckets */
+#define CACHE_WAIT        10   /* Seconds to wait on someone else's fill */
+
+/*
+ * Reverse proxy (ENABLE_PROXY).
+ */
+#define PROXY_ROUTES      8    /* Prefixes (-x) */
+#define PROXY_UPSTREAMS   8    /* Upstreams per prefix */
+#define PROXY_IDLE        16   /* Idle keep-alive connections kept per upstream */
+#define PROXY_BUFFER      4096 /* Read buffer per upstream connection */
+#define PROXY_TIMEOUT     30   /* Seconds to wait on an upstream */
+#define PROXY_HEALTH_INTERVAL 2 /* Seconds between health checks */
+#define PROXY_HEALTH_PATH "/"  /* What health checks ask for */
+
+/*
+ * Cluster cache (ENABLE_PEERS).
+ */
+#define PEER_NODES        16   /* Servers in the cluster (-C), ourselves included */
+#define PEER_HEADER       "X-Cgiserver-Peer" /* Marks a request from another server */
+#define PEER_REPLICA_TTL  5    /* Longest we keep a copy of a key another server owns */
+#define PEER_REPLICA_MEMORY (4 * 1024 * 1024) /* Most of CACHE_MEMORY spent on such copies */
+
+/*
+ * Files handed back by CGI scripts (ENABLE_XSENDFILE).
+ */
+#define SENDFILE_ROOTS    8    /* Directories besides the document root (-X) */
+
+/*
+ * Connections from a fronting proxy (ENABLE_UNIX, ENABLE_PROXY_PROTOCOL).
+ */
+#define UNIX_BACKLOG      512  /* Pending connections on the Unix socket */
+#define PROXY_HEADER_WAIT 5    /* Seconds the proxy gets to send its PROXY header */
+
+/*
+ * Sampling profiler (ENABLE_PROFILER).
+ */
+#define PROFILE_PATH      "/server-profile"
+#define PROFILE_THREADS   64   /* Handler threads sampled in one profile */
+#define PROFILE_SAMPLES   1024 /* Samples kept per thread */
+#define PROFILE_DEPTH     32   /* Frames kept per sample */
+#define PROFILE_SECONDS   10   /* How long a profile runs, by default (?seconds=) */
+#define PROFILE_MAX_SECONDS 120
+#define PROFILE_HZ        99   /* Samples per second of CPU time, by default (?hz=) */
+#define PROFILE_MAX_HZ    1000
+#define PROFILE_SYMBOLS   4096 /* Addresses remembered while naming frames */
+
+/*
+ * Request capture (ENABLE_CAPTURE); see replay.c.
+ */
+#define CAPTURE_MAGIC     "CGICAP02"
+#define CAPTURE_REDACTED  "redacted" /* Logged in place of cookies and credentials */
+
+/*
+ * Handler modules (ENABLE_MODULES); see module.h.
+ */
+#define MODULE_MOUNTS     16   /* Prefixes (-m file lines) */
+
+/*
+ * Packed docroot images (ENABLE_IMAGE); see mkimage.c.
+ */
+#define IMAGE_MAGIC       "CGIIMG01"
+#define IMAGE_ALIGN       4096 /* Bodies start on a page */
+
+/*
+ * Graceful upgrades (SIGUSR2/SIGHUP).
+ */
+#define UPGRADE_ENV       "CGISERVER_LISTENERS" /* Inherited listening sockets */
+#define UPGRADE_READY_ENV "CGISERVER_READY"     /* Pipe to tell the old process we are accepting */
+#define UPGRADE_READY     10   /* Seconds the new process gets to start accepting */
+#define DRAIN_DEADLINE    30   /* Seconds old connections get to finish */
+#define DRAIN_IDLE        1    /* Seconds a keep-alive connection must be quiet to be closed */
+
+/*
+ * Allocation accounting.
+ * Every malloc/calloc/realloc/free below goes through these
+ * (see the macros that follow), so the status page can show
+ * how many heap calls request handling still makes.
+ */
+unsigned long stat_heap_calls = 0;
+__thread unsigned long thread_heap_calls = 0;
+
+static void count_heap_call(void) {
+	thread_heap_calls++;
+	__atomic_add_fetch(&stat_heap_calls, 1, __ATOMIC_RELAXED);
+}
+
+void * counted_malloc(size_t size) {
+	count_heap_call();
+	return malloc(size);
+}
+
+void * counted_calloc(size_t count, size_t size) {
+	count_heap_call();
+	return calloc(count, size);
+}
+
+void * counted_realloc(void * ptr, size_t size) {
+	count_heap_call();
+	return realloc(ptr, size);
+}
+
+void counted_free(void * ptr) {
+	if (ptr) {
+		count_heap_call();
+	}
+	free(ptr);
+}
+
+#define malloc(size)       counted_malloc(size)
+#define calloc(count,size) counted_calloc(count, size)
+#define realloc(ptr,size)  counted_realloc(ptr, size)
+#define free(ptr)          counted_free(ptr)
+
+/*
+ * Per-connection arena.
+ * Everything a request needs (header lines, paths, listings) is
+ * bump-allocated from here and dropped all at once by arena_reset
+ * before the next request on the connection; the chunks themselves
+ * are kept, so a warmed-up connection stops touching the heap.
+ */
+struct arena_chunk {
+	struct arena_chunk * next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk * head;
+	struct arena_chunk * current;
+};
+
+/*
+ * Listening sockets
+ */
+struct listener {
+	int                fd;       /* Listening socket */
+	int                port;     /* Port it is bound to */
+	int                tls;      /* Whether connections speak TLS */
+	int                proxy;    /* Whether connections start with a PROXY header */
+	const char *       path;     /* Unix socket path (port is -1), or NULL */
+};
+
+#define MAX_LISTENERS 4
+
+/*
+ * Per-connection output queue, see outq_flush.
+ */
+struct out_block;
+struct outq {
+	struct out_block * head;
+	struct out_block * tail;
+	size_t             len;      /* Bytes queued */
+	size_t             files;    /* ...of which are file ranges */
+	int                failed;   /* The client went away (or stalled) */
+};
 
 /*
  * Incoming request socket data
@@ -92,9 +505,51 @@ struct socket_request {
 	int                fd;       /* Socket itself */
 	socklen_t          addr_len; /* Length of the address type */
 	struct sockaddr_in address;  /* Remote address */
+	char               peer[INET6_ADDRSTRLEN]; /* Client address as text (REMOTE_ADDR) */
 	pthread_t          thread;   /* Handler thread */
+	struct listener *  listener; /* Where the connection came in */
+	int                internal; /* Fed by another handler (an HTTP/2 stream) */
+#if ENABLE_TLS
+	SSL *              ssl;      /* TLS session, if offloaded to the kernel */
+#endif
+#if ENABLE_IO_URING
+	struct uring *     ring;     /* File I/O ring, if using io_uring */
+#endif
+	struct arena       arena;    /* Request-lifetime allocations */
+#if ENABLE_MICROCACHE
+	struct cache_entry * revalidate; /* Cache placeholder to fill (internal refresh) */
+#endif
+	struct socket_request * next_free; /* Request pool (or parking) link */
+	struct socket_request * active_prev; /* Live connections, for draining */
+	struct socket_request * active_next;
+#if ENABLE_HTTP2
+	struct h2_conn *   h2;       /* HTTP/2 connection on it, under active_lock */
+#endif
+	volatile int       idle;     /* Waiting for the next request */
+	time_t             idle_since; /* ...since when (monotonic) */
+	struct outq        out;      /* Response bytes the client hasn't taken yet */
+	FILE *             parked;   /* Stream of a parked connection */
+	char *             parked_buf; /* ...its stdio buffer */
+	int                parked_close; /* ...close it once the queue is empty */
+	int                parked_last;  /* ...response_close when it was parked */
+	time_t             parked_since; /* ...last time the client took anything */
+#if ENABLE_CAPTURE
+	unsigned long      capture_id;   /* Connection number in the capture log, once it has one */
+	char *             capture;      /* Record of the current request, until it is logged */
+	size_t             capture_len;
+#endif
 };
 
+/*
+ * Handler threads are also started internally.
+ */
+void *handleRequest(void *socket);
+
+/*
+ * Guards the list of live connections; see active_add.
+ */
+extern pthread_mutex_t active_lock;
+
 /*
  * CGI process data
  */
@@ -102,6 +557,7 @@ struct cgi_wait {
 	int                fd;       /* Read */
 	int                fd2;      /* Write */
 	int                pid;      /* Process ID */
+	struct cgi_script * script;  /* Slot to give back when it exits */
 };
 
 /*
@@ -114,12 +570,61 @@ int serversock;
  */
 int port;
 
+/*
+ * All of our listening sockets; the first is serversock.
+ */
+struct listener listeners[MAX_LISTENERS];
+int listener_count = 0;
+
+/*
+ * Listener options, from the LISTEN_* defaults and -L.
+ */
+struct listen_options {
+	int                backlog;
+	int                defer;
+	int                fastopen;
+	int                nodelay;
+	int                sndbuf;
+	int                rcvbuf;
+	int                batch;
+} listen_options = {
+	LISTEN_BACKLOG, LISTEN_DEFER, LISTEN_FASTOPEN, LISTEN_NODELAY,
+	LISTEN_SNDBUF, LISTEN_RCVBUF, ACCEPT_BATCH
+};
+
 /*
  * Last unaccepted socket pointer
  * so we can free it.
  */
 void * _last_unaccepted;
 
+/*
+ * Server statistics, shown on STATUS_PATH.
+ */
+struct server_stats {
+	unsigned long connections;  /* Connections handled */
+	unsigned long accept_wakeups; /* Times the accept loop found a listener ready */
+	unsigned long requests;     /* Requests answered */
+	unsigned long request_heap; /* Heap calls made while answering them */
+	unsigned long refused;      /* Connections over a client's limit */
+	unsigned long limited;      /* Requests over a client's rate */
+	unsigned long too_large;    /* Requests whose bodies were over the limit */
+	unsigned long cgi_queued;   /* CGI requests that had to wait */
+	unsigned long cgi_shed;     /* CGI requests turned away with a 503 */
+	unsigned long cgi_timeouts; /* ...of which waited CGI_QUEUE_WAIT first */
+	unsigned long cache_hits;      /* CGI responses served from the cache */
+	unsigned long cache_stale;     /* ...of which stale, with a refresh started */
+	unsigned long cache_misses;    /* Cacheable lookups that ran the script */
+	unsigned long cache_coalesced; /* Lookups that waited on another fill */
+	unsigned long cache_evictions; /* Entries dropped for memory */
+	unsigned long peer_fetches;    /* Misses answered by the key's owner */
+	unsigned long peer_fallbacks;  /* ...that ran the script here when it couldn't */
+	unsigned long peer_served;     /* Requests other servers sent us */
+} server_stats;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&server_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field)    __atomic_load_n(&server_stats.field, __ATOMIC_RELAXED)
+
 /*
  * Better safe than sorry,
  * shutdown the socket and exit.
@@ -128,10 +633,13 @@ void handleShutdown(int sig) {
 	printf("\n[info] Shutting down.\n");
 
 	/*
-	 * Shutdown the socket.
+	 * Shutdown the sockets.
 	 */
-	shutdown(serversock, SHUT_RDWR);
-	close(serversock);
+	int l;
+	for (l = 0; l < listener_count; ++l) {
+		shutdown(listeners[l].fd, SHUT_RDWR);
+		close(listeners[l].fd);
+	}
 
 	/*
 	 * Free the thread data block
@@ -152,15 +660,239 @@ typedef struct {
 	void ** buffer;
 	unsigned int size;
 	unsigned int alloc_size;
+	struct arena * arena; /* Owner of buffer and items, if any */
 } vector_t;
 
 #define INIT_VEC_SIZE 1024
+#define ARENA_VEC_SIZE 32
+
+/*
+ * Arena allocation.
+ * Allocations are pointer-aligned. A request larger than a chunk
+ * gets a chunk of its own, which is kept like any other.
+ */
+void * arena_alloc(struct arena * a, size_t size) {
+	size = (size + 7) & ~(size_t)7;
+	struct arena_chunk * c = a->current;
+	while (c && c->used + size > c->size) {
+		c = c->next;
+	}
+	if (!c) {
+		size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		c = malloc(sizeof(struct arena_chunk) + chunk);
+		c->next = NULL;
+		c->size = chunk;
+		c->used = 0;
+		if (!a->head) {
+			a->head = c;
+		} else {
+			struct arena_chunk * tail = a->current ? a->current : a->head;
+			while (tail->next) {
+				tail = tail->next;
+			}
+			tail->next = c;
+		}
+	}
+	a->current = c;
+	void * out = c->data + c->used;
+	c->used += size;
+	return out;
+}
+
+/*
+ * Grow the most recent allocation in place if it fits,
+ * otherwise move it.
+ */
+void * arena_grow(struct arena * a, void * ptr, size_t old_size, size_t new_size) {
+	struct arena_chunk * c = a->current;
+	size_t old_aligned = (old_size + 7) & ~(size_t)7;
+	size_t new_aligned = (new_size + 7) & ~(size_t)7;
+	if (c && (char *)ptr + old_aligned == c->data + c->used &&
+		c->used - old_aligned + new_aligned <= c->size) {
+		c->used = c->used - old_aligned + new_aligned;
+		return ptr;
+	}
+	void * out = arena_alloc(a, new_size);
+	memcpy(out, ptr, old_size);
+	return out;
+}
+
+char * arena_strdup(struct arena * a, const char * str) {
+	size_t len = strlen(str) + 1;
+	char * out = arena_alloc(a, len);
+	memcpy(out, str, len);
+	return out;
+}
+
+/*
+ * Forget everything, keep the chunks.
+ */
+void arena_reset(struct arena * a) {
+	struct arena_chunk * c;
+	for (c = a->head; c; c = c->next) {
+		c->used = 0;
+	}
+	a->current = a->head;
+}
+
+/*
+ * Give back chunks beyond the first `keep` bytes.
+ */
+void arena_trim(struct arena * a, size_t keep) {
+	struct arena_chunk ** c = &a->head;
+	size_t total = 0;
+	while (*c) {
+		total += (*c)->size;
+		if (total > keep) {
+			struct arena_chunk * dead = *c;
+			*c = dead->next;
+			free(dead);
+		} else {
+			c = &(*c)->next;
+		}
+	}
+	a->current = a->head;
+}
+
+/*
+ * An arena-backed vector; its items are arena memory too,
+ * so deleting it is a no-op and arena_reset reclaims it.
+ */
+vector_t * arena_vector(struct arena * a) {
+	vector_t * v = arena_alloc(a, sizeof(vector_t));
+	v->buffer = arena_alloc(a, ARENA_VEC_SIZE * sizeof(void *));
+	v->size = 0;
+	v->alloc_size = ARENA_VEC_SIZE;
+	v->arena = a;
+	return v;
+}
+
+/*
+ * Pooled I/O buffers.
+ * Each thread keeps a few IO_BUFFER-sized buffers to itself and
+ * falls back to a shared free list; whatever a thread still holds
+ * when it exits goes back on the shared list.
+ */
+#define IO_POOL_CACHE 4      /* Buffers cached per thread */
+#define IO_POOL_IDLE  1024   /* Buffers kept on the shared list */
+
+char * io_pool = NULL;
+int io_pool_count = 0;
+pthread_mutex_t io_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t io_cache_key;
+pthread_once_t io_cache_once = PTHREAD_ONCE_INIT;
+__thread char * io_cache[IO_POOL_CACHE];
+__thread int io_cache_count = 0;
+
+static void io_pool_push(char * buffer) {
+	pthread_mutex_lock(&io_pool_lock);
+	if (io_pool_count < IO_POOL_IDLE) {
+		*(char **)buffer = io_pool;
+		io_pool = buffer;
+		io_pool_count++;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&io_pool_lock);
+	free(buffer);
+}
+
+static void io_cache_flush(void * unused) {
+	(void)unused;
+	while (io_cache_count) {
+		io_pool_push(io_cache[--io_cache_count]);
+	}
+}
+
+static void io_cache_key_init(void) {
+	pthread_key_create(&io_cache_key, io_cache_flush);
+}
+
+char * io_buffer_get(void) {
+	if (io_cache_count) {
+		return io_cache[--io_cache_count];
+	}
+	pthread_mutex_lock(&io_pool_lock);
+	char * buffer = io_pool;
+	if (buffer) {
+		io_pool = *(char **)buffer;
+		io_pool_count--;
+	}
+	pthread_mutex_unlock(&io_pool_lock);
+	if (!buffer) {
+		buffer = malloc(IO_BUFFER);
+	}
+	return buffer;
+}
+
+void io_buffer_put(char * buffer) {
+	if (!buffer) {
+		return;
+	}
+	if (io_cache_count < IO_POOL_CACHE) {
+		if (!io_cache_count) {
+			/*
+			 * Make sure we get a chance to hand these back.
+			 */
+			pthread_once(&io_cache_once, io_cache_key_init);
+			pthread_setspecific(io_cache_key, io_cache);
+		}
+		io_cache[io_cache_count++] = buffer;
+		return;
+	}
+	io_pool_push(buffer);
+}
+
+/*
+ * Pooled connection blocks.
+ * Recycled along with their arenas, so a new connection
+ * usually starts with warm chunks and no allocations.
+ */
+#define REQUEST_POOL 256     /* Idle connection blocks kept */
+
+struct socket_request * request_pool = NULL;
+int request_pool_count = 0;
+pthread_mutex_t request_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct socket_request * request_get(void) {
+	pthread_mutex_lock(&request_pool_lock);
+	struct socket_request * request = request_pool;
+	if (request) {
+		request_pool = request->next_free;
+		request_pool_count--;
+	}
+	pthread_mutex_unlock(&request_pool_lock);
+	if (!request) {
+		return calloc(sizeof(struct socket_request), 1);
+	}
+	struct arena arena = request->arena;
+	memset(request, 0, sizeof(struct socket_request));
+	request->arena = arena;
+	return request;
+}
+
+void request_put(struct socket_request * request) {
+	arena_trim(&request->arena, ARENA_KEEP);
+	arena_reset(&request->arena);
+	pthread_mutex_lock(&request_pool_lock);
+	if (request_pool_count < REQUEST_POOL) {
+		request->next_free = request_pool;
+		request_pool = request;
+		request_pool_count++;
+		request = NULL;
+	}
+	pthread_mutex_unlock(&request_pool_lock);
+	if (request) {
+		arena_trim(&request->arena, 0);
+		free(request);
+	}
+}
 
 vector_t * alloc_vector(void) {
 	vector_t* v = (vector_t *) malloc(sizeof(vector_t));
 	v->buffer = (void **) malloc(INIT_VEC_SIZE * sizeof(void *));
 	v->size = 0;
 	v->alloc_size = INIT_VEC_SIZE;
+	v->arena = NULL;
 
 	return v;
 }
@@ -173,7 +905,11 @@ void free_vector(vector_t* v) {
 void vector_append(vector_t * v, void * item) {
 	if(v->size == v->alloc_size) {
 		v->alloc_size = v->alloc_size * 2;
-		v->buffer = (void **) realloc(v->buffer, v->alloc_size * sizeof(void *));
+		if (v->arena) {
+			v->buffer = (void **) arena_grow(v->arena, v->buffer, v->size * sizeof(void *), v->alloc_size * sizeof(void *));
+		} else {
+			v->buffer = (void **) realloc(v->buffer, v->alloc_size * sizeof(void *));
+		}
 	}
 
 	v->buffer[v->size] = item;
@@ -189,6 +925,9 @@ void * vector_at(vector_t * v, unsigned int idx) {
  * Free its contents and then it.
  */
 void delete_vector(vector_t * vector) {
+	if (vector->arena) {
+		return;
+	}
 	unsigned int i = 0;
 	for (i = 0; i < vector->size; ++i) {
 		free(vector_at(vector, i));
@@ -197,81 +936,7569 @@ void delete_vector(vector_t * vector) {
 }
 
 /*
- * Convert a character from two hex digits
- * to the raw character. (URL decode)
+ * Value of one hex digit, or -1 if it isn't one. (URL decode)
  */
-char from_hex(char ch) {
-	return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+int from_hex(char ch) {
+	if (ch >= '0' && ch <= '9') {
+		return ch - '0';
+	}
+	ch |= 0x20;
+	if (ch >= 'a' && ch <= 'f') {
+		return ch - 'a' + 10;
+	}
+	return -1;
 }
 
 /*
- * Generic text-only response with a particular status.
- * Used for bad requests mostly.
+ * Delimiter scanning.
+ * scan3(s, a, b, c) returns the first byte of s that is a, b or c,
+ * or its terminating NUL. The parser uses it to find CR/LF, colons,
+ * escapes and the like in one pass instead of a strstr per
+ * delimiter. On x86-64 it compares 32 bytes at a time with AVX2 if
+ * the CPU has it, otherwise 16 at a time with SSE2 (which every
+ * x86-64 CPU has). Loads are aligned, so they never cross into a
+ * page the string doesn't reach.
  */
-void generic_response(FILE * socket_stream, char * status, char * message) {
-	fprintf(socket_stream,
-			"HTTP/1.1 %s\r\n"
-			"Server: " VERSION_STRING "\r\n"
-			"Content-Type: text/plain\r\n"
-			"Content-Length: %zu\r\n"
-			"\r\n"
-			"%s\r\n", status, strlen(message), message);
+static const char * scan3_scalar(const char * s, char a, char b, char c) {
+	while (*s && *s != a && *s != b && *s != c) {
+		s++;
+	}
+	return s;
+}
+
+#if ENABLE_SIMD
+static const char * scan3_sse2(const char * s, char a, char b, char c) {
+	uintptr_t off = (uintptr_t)s & 15;
+	const __m128i * p = (const __m128i *)(s - off);
+	__m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+	__m128i zero = _mm_setzero_si128();
+	unsigned int mask = 0xFFFFu << off;
+	while (1) {
+		__m128i v = _mm_load_si128(p);
+		__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, zero)));
+		unsigned int found = (unsigned int)_mm_movemask_epi8(hit) & mask;
+		if (found) {
+			return (const char *)p + __builtin_ctz(found);
+		}
+		mask = 0xFFFFu;
+		p++;
+	}
+}
+
+__attribute__((target("avx2")))
+static const char * scan3_avx2(const char * s, char a, char b, char c) {
+	uintptr_t off = (uintptr_t)s & 31;
+	const __m256i * p = (const __m256i *)(s - off);
+	__m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), vc = _mm256_set1_epi8(c);
+	__m256i zero = _mm256_setzero_si256();
+	uint32_t mask = 0xFFFFFFFFu << off;
+	while (1) {
+		__m256i v = _mm256_load_si256(p);
+		__m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, zero)));
+		uint32_t found = (uint32_t)_mm256_movemask_epi8(hit) & mask;
+		if (found) {
+			return (const char *)p + __builtin_ctz(found);
+		}
+		mask = 0xFFFFFFFFu;
+		p++;
+	}
 }
+#endif
 
 /*
- * Wait for a CGI thread to finish and
- * close its pipe.
+ * The first call picks the kernel for this CPU.
  */
-void *wait_pid(void * onwhat) {
-	struct cgi_wait * cgi_w = (struct cgi_wait*)onwhat;
-	int status;
+static const char * scan3_resolve(const char * s, char a, char b, char c);
+const char * (*scan3)(const char *, char, char, char) = scan3_resolve;
 
-	/*
-	 * Wait for the process to finish
-	 */
-	waitpid(cgi_w->pid, &status, 0);
+static const char * scan3_resolve(const char * s, char a, char b, char c) {
+	const char * (*kernel)(const char *, char, char, char) = scan3_scalar;
+#if ENABLE_SIMD
+	__builtin_cpu_init();
+	kernel = __builtin_cpu_supports("avx2") ? scan3_avx2 : scan3_sse2;
+#endif
+	__atomic_store_n(&scan3, kernel, __ATOMIC_RELAXED);
+	return kernel(s, a, b, c);
+}
+
+/*
+ * Precomputed header fragments.
+ * STATUS_LINE builds the status line and our Server header in one
+ * literal so the pair can be copied out with a single memcpy.
+ */
+#define STATUS_LINE(status) "HTTP/1.1 " status "\r\n" "Server: " VERSION_STRING "\r\n"
+#define FRAGMENT(str)       str, (sizeof(str) - 1)
+
+/*
+ * Shared Date: header.
+ * The clock thread formats the next value into the spare slot
+ * and then flips http_date_current, so readers never see a
+ * half-written string and never have to call strftime themselves.
+ */
+#define HTTP_DATE_SIZE 64
+char http_date[2][HTTP_DATE_SIZE];
+size_t http_date_len[2];
+volatile int http_date_current = 0;
+
+/*
+ * Set by a handler thread while answering a request that should be
+ * its connection's last (we are draining for an upgrade).
+ */
+__thread int response_close = 0;
+
+#if ENABLE_TIMING
+/*
+ * Request phase timing.
+ * handleRequest marks the end of each phase; the time since the
+ * previous mark is added to that phase. With -t the phases done by
+ * the time the headers go out are sent in a Server-Timing header,
+ * and with -l every request gets an access log line with all of
+ * them. Each mark is also a USDT probe, cgiserver:phase(fd, name),
+ * and requests start and finish with cgiserver:request__start(fd)
+ * and cgiserver:request__done(fd, status, bytes), so a tracer can
+ * take its own timestamps even when -t and -l are off.
+ */
+enum {
+	PHASE_READ,   /* Request headers (and any POST body) */
+	PHASE_FS,     /* Parsing, path decoding and stat */
+	PHASE_INDEX,  /* Probing for default index files */
+	PHASE_QUEUE,  /* Waiting for a CGI slot */
+	PHASE_FORK,   /* Pipes, fork and the reaper thread */
+	PHASE_CGI,    /* Until the script's headers are in */
+	PHASE_SEND,   /* Writing the response */
+	PHASES
+};
+
+static const char * phase_names[PHASES] = {
+	"read", "fs", "index", "queue", "fork", "cgi", "send"
+};
+
+struct request_timing {
+	int                active;       /* Between timing_start and timing_finish */
+	int                fd;           /* Connection, for the probes */
+	struct timespec    start;        /* Request line arrived */
+	struct timespec    last;         /* Previous mark */
+	unsigned long      ns[PHASES];   /* Time spent in each phase */
+	int                status;       /* Response status */
+	unsigned long      bytes;        /* Bytes written to the client */
+	const char *       line;         /* Request line, until it is parsed */
+	const char *       method;
+	const char *       path;
+	const char *       query;
+	const char *       version;
+};
+
+int server_timing = 0;         /* -t: send Server-Timing headers */
+FILE * access_log = NULL;      /* -l: where access log lines go */
+__thread struct request_timing timing;
+
+static unsigned long timing_elapsed(struct timespec * from, struct timespec * to) {
+	return (to->tv_sec - from->tv_sec) * 1000000000UL + to->tv_nsec - from->tv_nsec;
+}
+
+void timing_start(int fd) {
+	memset(&timing, 0, sizeof(timing));
+	timing.active = 1;
+	timing.fd = fd;
+	if (server_timing || access_log) {
+		clock_gettime(CLOCK_MONOTONIC, &timing.start);
+		timing.last = timing.start;
+	}
+	PROBE1(request__start, fd);
+}
+
+void timing_mark(int phase) {
+	PROBE2(phase, timing.fd, phase_names[phase]);
+	if (!timing.active || !(server_timing || access_log)) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timing.ns[phase] += timing_elapsed(&timing.last, &now);
+	timing.last = now;
+}
+
+void timing_status(const char * status) {
+	timing.status = atoi(status);
+}
+
+/*
+ * Server-Timing: read;dur=0.012, fs;dur=0.004, ...
+ * Durations are in milliseconds; phases that took no time are left out.
+ */
+size_t timing_header(char * out, size_t max) {
+	size_t len = 0;
+	int p;
+	if (!server_timing || !timing.active || max < 64) {
+		return 0;
+	}
+	len += sprintf(out, "Server-Timing: ");
+	for (p = 0; p < PHASES; ++p) {
+		if (timing.ns[p] && len + 40 < max) {
+			len += sprintf(out + len, "%s%s;dur=%.3f", len > 15 ? ", " : "", phase_names[p], timing.ns[p] / 1e6);
+		}
+	}
+	if (len == 15) {
+		return 0;
+	}
+	out[len++] = '\r';
+	out[len++] = '\n';
+	return len;
+}
+
+/*
+ * Finish off a request: the rest of the time was spent sending, and
+ * it goes in the access log as a Common Log Format line followed by
+ * the total and per-phase times in milliseconds.
+ */
+void timing_finish(const char * client) {
+	if (!timing.active) {
+		return;
+	}
+	timing_mark(PHASE_SEND);
+	timing.active = 0;
+	PROBE3(request__done, timing.fd, timing.status, timing.bytes);
+	if (!access_log || !timing.status) {
+		return;
+	}
+	char line[1024 + 256];
+	char when[32];
+	struct tm tm;
+	time_t now = time(NULL);
+	gmtime_r(&now, &tm);
+	strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+	if (!client || !*client) {
+		client = "-";
+	}
+	int len;
+	if (timing.path) {
+		len = snprintf(line, 1024, "%.64s - - [%s] \"%.16s %.512s%s%.256s %.16s\" %d %lu %.3f",
+				client, when, timing.method, timing.path, timing.query ? "?" : "", timing.query ? timing.query : "",
+				timing.version ? timing.version : "-", timing.status, timing.bytes,
+				timing_elapsed(&timing.start, &timing.last) / 1e6);
+	} else {
+		/*
+		 * Answered before (or while) the request line was parsed.
+		 */
+		len = snprintf(line, 1024, "%.64s - - [%s] \"%.800s\" %d %lu %.3f",
+				client, when, timing.line ? timing.line : "-", timing.status, timing.bytes,
+				timing_elapsed(&timing.start, &timing.last) / 1e6);
+	}
+	/*
+	 * Whatever didn't fit is cut off, leaving room for the newline.
+	 */
+	if (len < 0) {
+		len = 0;
+	} else if (len > 1023) {
+		len = 1023;
+	}
+	int p;
+	for (p = 0; p < PHASES; ++p) {
+		if (timing.ns[p]) {
+			len += snprintf(line + len, sizeof(line) - len, " %s=%.3f", phase_names[p], timing.ns[p] / 1e6);
+			if (len > (int)sizeof(line) - 2) {
+				len = sizeof(line) - 2;
+			}
+		}
+	}
+	line[len++] = '\n';
+	fwrite(line, 1, len, access_log);
+}
+#endif
+
+void update_http_date(void) {
+	int next = !http_date_current;
+	time_t now = time(NULL);
+	struct tm tm;
+	gmtime_r(&now, &tm);
+	http_date_len[next] = strftime(http_date[next], HTTP_DATE_SIZE, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+	http_date_current = next;
+}
+
+/*
+ * Clock tick: reformat the Date header once a second.
+ */
+void *clock_tick(void * unused) {
+	(void)unused;
+	while (1) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		struct timespec wait = { 0, 1000000000L - now.tv_nsec };
+		nanosleep(&wait, NULL);
+		update_http_date();
+#if ENABLE_TIMING
+		if (access_log) {
+			/*
+			 * The access log is written in full buffers
+			 * and flushed from here once a second.
+			 */
+			fflush(access_log);
+		}
+#endif
+	}
+	return NULL;
+}
+
+/*
+ * Integer to ascii, decimal and hexadecimal.
+ * Returns the number of characters written (no terminator).
+ */
+size_t fast_utoa(char * out, unsigned long value) {
+	char tmp[24];
+	size_t len = 0;
+	do {
+		tmp[len++] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		out[i] = tmp[len - i - 1];
+	}
+	return len;
+}
+
+size_t fast_utox(char * out, unsigned long value) {
+	static const char digits[] = "0123456789ABCDEF";
+	char tmp[24];
+	size_t len = 0;
+	do {
+		tmp[len++] = digits[value & 0xF];
+		value >>= 4;
+	} while (value);
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		out[i] = tmp[len - i - 1];
+	}
+	return len;
+}
+
+/*
+ * Response header block.
+ * Headers are assembled here from fragments and then sent
+ * along with the body (or the start of it) in one writev.
+ */
+typedef struct {
+	char   data[HEADER_BLOCK];
+	size_t len;
+} header_block_t;
+
+int header_add(header_block_t * hb, const char * str, size_t len) {
+	if (hb->len + len > HEADER_BLOCK) {
+		return -1;
+	}
+	memcpy(hb->data + hb->len, str, len);
+	hb->len += len;
+	return 0;
+}
+
+/*
+ * Start a header block with a status line (from STATUS_LINE)
+ * and the current Date header.
+ */
+void header_begin(header_block_t * hb, const char * status, size_t len) {
+	int current = http_date_current;
+	hb->len = 0;
+	header_add(hb, status, len);
+	header_add(hb, http_date[current], http_date_len[current]);
+#if ENABLE_TIMING
+	timing_status(status + 9);
+#endif
+	if (response_close) {
+		header_add(hb, FRAGMENT("Connection: close\r\n"));
+	}
+}
+
+void header_content_length(header_block_t * hb, unsigned long length) {
+	char line[48] = "Content-Length: ";
+	size_t len = sizeof("Content-Length: ") - 1;
+	len += fast_utoa(line + len, length);
+	line[len++] = '\r';
+	line[len++] = '\n';
+	header_add(hb, line, len);
+}
+
+void header_end(header_block_t * hb) {
+#if ENABLE_TIMING
+	hb->len += timing_header(hb->data + hb->len, HEADER_BLOCK - hb->len);
+#endif
+	header_add(hb, FRAGMENT("\r\n"));
+}
+
+/*
+ * Write out a set of buffers to a client in as few syscalls as we can.
+ * Anything still sitting in the stdio buffer goes out first. Streams
+ * without a descriptor fall back to plain stdio writes.
+ */
+int stream_writev(FILE * stream, struct iovec * iov, int count) {
+	int i;
+#if ENABLE_TIMING
+	for (i = 0; i < count; ++i) {
+		timing.bytes += iov[i].iov_len;
+	}
+#endif
+	fflush(stream);
+	int fd = fileno(stream);
+	if (fd < 0) {
+		for (i = 0; i < count; ++i) {
+			if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, stream) != iov[i].iov_len) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		/*
+		 * Skip past whatever was written and go again
+		 * for the remainder of a short write.
+		 */
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+int stream_write(FILE * stream, const void * data, size_t len) {
+	struct iovec iov = { (void *)data, len };
+	return stream_writev(stream, &iov, 1);
+}
+
+/*
+ * Send a header block followed by a body.
+ */
+int send_response(FILE * stream, header_block_t * hb, const void * body, size_t len) {
+	struct iovec iov[2] = {
+		{ hb->data, hb->len },
+		{ (void *)body, len }
+	};
+	return stream_writev(stream, iov, len ? 2 : 1);
+}
+
+/*
+ * Append to a header block that may outgrow HEADER_BLOCK
+ * (CGI output); send what we have so far when it fills up.
+ */
+void header_add_flush(FILE * stream, header_block_t * hb, const char * str, size_t len) {
+	if (header_add(hb, str, len) == 0) {
+		return;
+	}
+	stream_write(stream, hb->data, hb->len);
+	hb->len = 0;
+	if (header_add(hb, str, len) < 0) {
+		stream_write(stream, str, len);
+	}
+}
+
+/*
+ * Send a piece of a CGI response body, chunk-framed unless
+ * raw is set. Pending headers in hb go out with it; a zero
+ * length chunk ends the body.
+ */
+int send_chunk(FILE * stream, header_block_t * hb, int raw, const void * data, size_t len) {
+	char size_line[24];
+	size_t size_len = 0;
+	struct iovec iov[4];
+	int count = 0;
+	if (hb->len) {
+		iov[count].iov_base = hb->data;
+		iov[count].iov_len  = hb->len;
+		count++;
+		hb->len = 0;
+	}
+	if (!raw) {
+		size_len = fast_utox(size_line, len);
+		size_line[size_len++] = '\r';
+		size_line[size_len++] = '\n';
+		if (!len) {
+			size_line[size_len++] = '\r';
+			size_line[size_len++] = '\n';
+		}
+		iov[count].iov_base = size_line;
+		iov[count].iov_len  = size_len;
+		count++;
+	}
+	if (len) {
+		iov[count].iov_base = (void *)data;
+		iov[count].iov_len  = len;
+		count++;
+		if (!raw) {
+			iov[count].iov_base = "\r\n";
+			iov[count].iov_len  = 2;
+			count++;
+		}
+	}
+	return stream_writev(stream, iov, count);
+}
+
+/*
+ * Connection output queue.
+ * Response bodies are queued here and written without blocking,
+ * so a slow client holds up to OUTPUT_LIMIT bytes of our memory
+ * rather than a thread, an open file and a CGI process. The queue
+ * is a chain of pooled I/O buffers with a small header in front.
+ * A block can also stand for a range of an open file, which is
+ * sent with sendfile and doesn't count against the limit.
+ */
+struct out_block {
+	struct out_block * next;
+	size_t             start;    /* First byte not yet sent */
+	size_t             end;      /* End of queued data */
+	int                file;     /* File to send start..end of, or -1 */
+	char               data[];
+};
+
+#define OUT_BLOCK_DATA (IO_BUFFER - sizeof(struct out_block))
+#define OUT_IOV        16     /* Blocks sent per sendmsg */
+
+static struct out_block * outq_block(struct outq * q) {
+	struct out_block * block = (struct out_block *)io_buffer_get();
+	block->next  = NULL;
+	block->start = 0;
+	block->end   = 0;
+	block->file  = -1;
+	if (q->tail) {
+		q->tail->next = block;
+	} else {
+		q->head = block;
+	}
+	q->tail = block;
+	return block;
+}
+
+/*
+ * Room at the end of the queue, for reading straight into.
+ */
+char * outq_space(struct outq * q, size_t * space) {
+	if (!q->tail || q->tail->file >= 0 || q->tail->end == OUT_BLOCK_DATA) {
+		outq_block(q);
+	}
+	*space = OUT_BLOCK_DATA - q->tail->end;
+	return q->tail->data + q->tail->end;
+}
+
+void outq_commit(struct outq * q, size_t len) {
+	q->tail->end += len;
+	q->len += len;
+#if ENABLE_TIMING
+	timing.bytes += len;
+#endif
+}
+
+void outq_append(struct outq * q, const void * data, size_t len) {
+	const char * in = data;
+	if (q->failed) {
+		return;
+	}
+	while (len) {
+		size_t space;
+		char * out = outq_space(q, &space);
+		if (space > len) {
+			space = len;
+		}
+		memcpy(out, in, space);
+		outq_commit(q, space);
+		in  += space;
+		len -= space;
+	}
+}
+
+/*
+ * Queue len bytes of file from offset. The queue owns the
+ * descriptor from here on.
+ */
+void outq_file(struct outq * q, int file, size_t offset, size_t len) {
+	if (q->failed || !len) {
+		close(file);
+		return;
+	}
+	struct out_block * block = outq_block(q);
+	block->file  = file;
+	block->start = offset;
+	block->end   = offset + len;
+	q->len   += len;
+	q->files += len;
+#if ENABLE_TIMING
+	timing.bytes += len;
+#endif
+}
+
+static void outq_pop(struct outq * q) {
+	struct out_block * block = q->head;
+	q->head = block->next;
+	if (!q->head) {
+		q->tail = NULL;
+	}
+	if (block->file >= 0) {
+		close(block->file);
+	}
+	io_buffer_put((char *)block);
+}
+
+void outq_clear(struct outq * q) {
+	while (q->head) {
+		outq_pop(q);
+	}
+	q->len = 0;
+	q->files = 0;
+}
+
+/*
+ * Queue a piece of a CGI response body, framed as send_chunk would.
+ */
+void outq_chunk(struct outq * q, header_block_t * hb, int raw, const void * data, size_t len) {
+	if (hb->len) {
+		outq_append(q, hb->data, hb->len);
+		hb->len = 0;
+	}
+	if (!raw) {
+		char size_line[24];
+		size_t size_len = fast_utox(size_line, len);
+		size_line[size_len++] = '\r';
+		size_line[size_len++] = '\n';
+		outq_append(q, size_line, size_len);
+	}
+	outq_append(q, data, len);
+	if (!raw) {
+		outq_append(q, "\r\n", 2);
+	}
+}
+
+/*
+ * Send as much of the queue as the socket takes right now.
+ * File ranges need the socket to be non-blocking.
+ * Returns -1, and drops the queue, if the client is gone.
+ */
+int outq_send(struct outq * q, int fd) {
+	while (q->len) {
+		struct out_block * block = q->head;
+		ssize_t sent;
+		if (block->file >= 0) {
+#if ENABLE_SENDFILE
+			off_t offset = block->start;
+			sent = sendfile(fd, block->file, &offset, block->end - block->start);
+#else
+			char chunk[NOTSENT_LOWAT];
+			size_t want = block->end - block->start > sizeof(chunk) ? sizeof(chunk) : block->end - block->start;
+			sent = pread(block->file, chunk, want, block->start);
+			if (sent > 0) {
+				sent = send(fd, chunk, sent, MSG_DONTWAIT);
+			}
+#endif
+			if (sent > 0) {
+				block->start += sent;
+				q->len   -= sent;
+				q->files -= sent;
+				if (block->start == block->end) {
+					outq_pop(q);
+				}
+				continue;
+			}
+			if (sent == 0) {
+				/*
+				 * The file got shorter under us; the
+				 * response can't be finished.
+				 */
+				errno = EIO;
+			}
+		} else {
+			struct iovec iov[OUT_IOV];
+			int count = 0;
+			for (; block && block->file < 0 && count < OUT_IOV; block = block->next) {
+				if (block->end > block->start) {
+					iov[count].iov_base = block->data + block->start;
+					iov[count].iov_len  = block->end - block->start;
+					count++;
+				}
+			}
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			sent = sendmsg(fd, &msg, MSG_DONTWAIT);
+			if (sent >= 0) {
+				q->len -= sent;
+				while (q->head && q->head->file < 0) {
+					block = q->head;
+					size_t take = block->end - block->start;
+					if (take > (size_t)sent) {
+						take = sent;
+					}
+					block->start += take;
+					sent -= take;
+					if (block->start < block->end) {
+						break;
+					}
+					outq_pop(q);
+				}
+				continue;
+			}
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		q->failed = 1;
+		outq_clear(q);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write the whole queue through stdio, for streams without a descriptor.
+ */
+static int outq_write(struct outq * q, FILE * stream) {
+	char * buffer = NULL;
+	while (q->head && !q->failed) {
+		struct out_block * block = q->head;
+		if (block->file < 0) {
+			if (fwrite(block->data + block->start, 1, block->end - block->start, stream) != block->end - block->start) {
+				q->failed = 1;
+			}
+			block->start = block->end;
+		}
+		while (block->start < block->end && !q->failed) {
+			if (!buffer) {
+				buffer = io_buffer_get();
+			}
+			size_t want = block->end - block->start > IO_BUFFER ? IO_BUFFER : block->end - block->start;
+			ssize_t r = pread(block->file, buffer, want, block->start);
+			if (r <= 0 || fwrite(buffer, 1, r, stream) != (size_t)r) {
+				q->failed = 1;
+				break;
+			}
+			block->start += r;
+		}
+		outq_pop(q);
+	}
+	io_buffer_put(buffer);
+	outq_clear(q);
+	fflush(stream);
+	return q->failed ? -1 : 0;
+}
+
+/*
+ * Send what the client will take without waiting, then wait for
+ * it until no more than limit bytes of memory are left queued (or
+ * nothing at all, for a limit of 0). A client that takes nothing
+ * for PARK_TIMEOUT seconds is given up on. Streams without a
+ * descriptor (TLS in userspace) are written out in full with stdio.
+ */
+int outq_flush(struct outq * q, FILE * stream, size_t limit) {
+	if (q->failed) {
+		return -1;
+	}
+	if (!q->len) {
+		return 0;
+	}
+	fflush(stream);
+	int fd = fileno(stream);
+	if (fd < 0) {
+		return outq_write(q, stream);
+	}
+	int flags = -1;
+	if (q->files) {
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	}
+	int result = 0;
+	while (1) {
+		if (outq_send(q, fd) < 0) {
+			result = -1;
+			break;
+		}
+		if (limit ? q->len - q->files <= limit : !q->len) {
+			break;
+		}
+		struct pollfd waiting = { fd, POLLOUT, 0 };
+		if (poll(&waiting, 1, PARK_TIMEOUT * 1000) == 0) {
+			q->failed = 1;
+			outq_clear(q);
+			result = -1;
+			break;
+		}
+	}
+	if (flags != -1) {
+		fcntl(fd, F_SETFL, flags);
+	}
+	return result;
+}
+
+/*
+ * What a request says about the file it wants.
+ */
+struct file_request {
+	const char * range;             /* Range */
+	const char * if_range;          /* If-Range */
+	const char * if_none_match;     /* If-None-Match */
+	const char * if_modified_since; /* If-Modified-Since */
+};
+
+/*
+ * Parse a Range header against a file of size bytes. We only do
+ * single ranges: 1 with the range filled in, 0 to ignore the header
+ * (malformed, or several ranges), -1 if it can't be satisfied.
+ */
+int parse_range(const char * value, size_t size, size_t * offset, size_t * length) {
+	if (strncmp(value, "bytes=", 6) || strchr(value, ',')) {
+		return 0;
+	}
+	value += 6;
+	char * end;
+	size_t first, last = size ? size - 1 : 0;
+	if (*value == '-') {
+		/*
+		 * The last N bytes.
+		 */
+		if (!isdigit((unsigned char)value[1])) {
+			return 0;
+		}
+		size_t suffix = strtoull(value + 1, &end, 10);
+		if (*end) {
+			return 0;
+		}
+		if (!suffix || !size) {
+			return -1;
+		}
+		first = suffix > size ? 0 : size - suffix;
+	} else {
+		if (!isdigit((unsigned char)*value)) {
+			return 0;
+		}
+		first = strtoull(value, &end, 10);
+		if (*end != '-') {
+			return 0;
+		}
+		if (end[1]) {
+			if (!isdigit((unsigned char)end[1])) {
+				return 0;
+			}
+			last = strtoull(end + 1, &end, 10);
+			if (*end || last < first) {
+				return 0;
+			}
+			if (last >= size) {
+				last = size - 1;
+			}
+		}
+		if (first >= size) {
+			return -1;
+		}
+	}
+	*offset = first;
+	*length = last - first + 1;
+	return 1;
+}
+
+/*
+ * A response body with its validators: a range of an open file,
+ * and the same bytes in memory if we have them mapped.
+ */
+struct entity {
+	int          file;         /* Descriptor the body is read or sent from */
+	size_t       offset;       /* Where the body starts in it */
+	size_t       size;
+	const char * data;         /* The body in memory, or NULL */
+	const char * etag;         /* Quoted ETag, or NULL for no validators */
+	size_t       etag_len;
+	const char * modified;     /* Last-Modified */
+	size_t       modified_len;
+};
+
+/*
+ * Send an entity as the response: 304 for a conditional request
+ * that matches, 206 (or 416) for a byte range, otherwise the whole
+ * body with the given status. headers carries Content-Type and
+ * anything else the response needs. A NULL fr (error pages) skips
+ * validators, conditionals and ranges.
+ *
+ * Bodies of SENDFILE_MIN bytes and up go into the output queue as a
+ * file range and leave with sendfile; smaller ones are copied in.
+ * The descriptor stays the caller's.
+ */
+void send_entity(struct outq * q, FILE * socket_stream, const struct entity * e,
+		const char * status, size_t status_len, const char * headers, size_t headers_len,
+		struct file_request * fr, int head) {
+	header_block_t hb;
+	char line[96];
+	size_t len;
+	size_t size = e->size, offset = 0, length = size;
+	int partial = 0;
+
+	if (fr && e->etag) {
+		/*
+		 * If-None-Match wins over If-Modified-Since, which
+		 * has to be our Last-Modified exactly.
+		 */
+		if (fr->if_none_match ? (!strcmp(fr->if_none_match, "*") || strstr(fr->if_none_match, e->etag)) :
+				(fr->if_modified_since && !strcmp(fr->if_modified_since, e->modified))) {
+			header_begin(&hb, FRAGMENT(STATUS_LINE("304 Not Modified")));
+			header_add(&hb, FRAGMENT("ETag: "));
+			header_add(&hb, e->etag, e->etag_len);
+			header_add(&hb, FRAGMENT("\r\nLast-Modified: "));
+			header_add(&hb, e->modified, e->modified_len);
+			header_add(&hb, FRAGMENT("\r\n"));
+			header_end(&hb);
+			send_response(socket_stream, &hb, NULL, 0);
+			return;
+		}
+
+		if (fr->range && (!fr->if_range || !strcmp(fr->if_range, e->etag) || !strcmp(fr->if_range, e->modified))) {
+			partial = parse_range(fr->range, size, &offset, &length);
+			if (partial < 0) {
+				header_begin(&hb, FRAGMENT(STATUS_LINE("416 Range Not Satisfiable")));
+				len = sprintf(line, "Content-Range: bytes */%zu\r\n", size);
+				header_add(&hb, line, len);
+				header_content_length(&hb, 0);
+				header_end(&hb);
+				send_response(socket_stream, &hb, NULL, 0);
+				return;
+			}
+		}
+	}
+
+	if (partial) {
+		header_begin(&hb, FRAGMENT(STATUS_LINE("206 Partial Content")));
+		len = sprintf(line, "Content-Range: bytes %zu-%zu/%zu\r\n", offset, offset + length - 1, size);
+		header_add(&hb, line, len);
+	} else {
+		header_begin(&hb, status, status_len);
+	}
+	if (header_add(&hb, headers, headers_len) < 0) {
+		fprintf(stderr, "[warn] Headers for a file response did not fit.\n");
+	}
+	if (fr && e->etag) {
+		header_add(&hb, FRAGMENT("Accept-Ranges: bytes\r\nETag: "));
+		header_add(&hb, e->etag, e->etag_len);
+		header_add(&hb, FRAGMENT("\r\nLast-Modified: "));
+		header_add(&hb, e->modified, e->modified_len);
+		header_add(&hb, FRAGMENT("\r\n"));
+	}
+	header_content_length(&hb, length);
+	header_end(&hb);
+
+	if (head) {
+		/*
+		 * On a HEAD request, stop here,
+		 * we only needed the headers.
+		 */
+		send_response(socket_stream, &hb, NULL, 0);
+		return;
+	}
+
+	outq_append(q, hb.data, hb.len);
+	if (length >= SENDFILE_MIN) {
+		int file = dup(e->file);
+		if (file >= 0) {
+			outq_file(q, file, e->offset + offset, length);
+			return;
+		}
+	}
+	if (e->data) {
+		outq_append(q, e->data + offset, length);
+		return;
+	}
+	offset += e->offset;
+	while (length) {
+		size_t space;
+		char * tail = outq_space(q, &space);
+		ssize_t r = pread(e->file, tail, space < length ? space : length, offset);
+		if (r <= 0) {
+			/*
+			 * The file got shorter under us; the
+			 * response can't be finished.
+			 */
+			q->failed = 1;
+			outq_clear(q);
+			break;
+		}
+		outq_commit(q, r);
+		offset += r;
+		length -= r;
+	}
+}
+
+/*
+ * Validators for a file on disk: its size and modification time.
+ */
+void file_validators(const struct stat * st, char * etag, size_t * etag_len, char * modified, size_t * modified_len) {
+	size_t len = 0;
+	etag[len++] = '"';
+	len += fast_utox(etag + len, st->st_size);
+	etag[len++] = '-';
+	len += fast_utox(etag + len, st->st_mtime);
+	etag[len++] = '"';
+	etag[len] = '\0';
+	*etag_len = len;
+	struct tm tm;
+	gmtime_r(&st->st_mtime, &tm);
+	*modified_len = strftime(modified, 48, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * Send an open file as the response; see send_entity. The
+ * descriptor is ours to close.
+ */
+void send_file(struct outq * q, FILE * socket_stream, int file, const struct stat * st,
+		const char * status, size_t status_len, const char * headers, size_t headers_len,
+		struct file_request * fr, int head) {
+	char etag[48];
+	char modified[48];
+	struct entity e = { file, 0, st->st_size, NULL, NULL, 0, modified, 0 };
+	if (fr) {
+		file_validators(st, etag, &e.etag_len, modified, &e.modified_len);
+		e.etag = etag;
+	}
+	send_entity(q, socket_stream, &e, status, status_len, headers, headers_len, fr, head);
+	close(file);
+}
+
+#if ENABLE_IMAGE
+/*
+ * Packed docroot image.
+ * mkimage packs a docroot into one file: a header, a table of
+ * entries sorted by request path, the strings they point to, and
+ * page-aligned bodies. The whole thing is mapped at startup, so a
+ * request for a packed file is a binary search and a response made
+ * of bytes that are already in memory (or, for large ones, a
+ * sendfile from the image). CGI scripts, listings and anything not
+ * in the image are served from PAGES_DIRECTORY as usual.
+ *
+ * Offsets are from the start of the image and values are in host
+ * byte order; an image is built on the machine that serves it.
+ */
+struct image_header {
+	char     magic[8];          /* IMAGE_MAGIC */
+	uint32_t count;             /* Entries */
+	uint32_t entry_size;        /* sizeof(struct image_entry), as a version check */
+	uint64_t entries;           /* Offset of the entry table */
+};
+
+struct image_entry {
+	uint64_t path;              /* Request path under the docroot, NUL-terminated */
+	uint64_t headers;           /* Content-Type and anything else fixed */
+	uint64_t modified;          /* Last-Modified */
+	uint64_t etag[2];           /* ETags: as is, gzipped */
+	uint64_t body[2];
+	uint64_t size[2];
+	uint32_t headers_len;
+	uint32_t modified_len;
+	uint32_t etag_len[2];       /* etag_len[1] is 0 without a gzipped copy */
+};
+
+const char * image_map = NULL;
+size_t image_size = 0;
+int image_fd = -1;
+const struct image_entry * image_entries = NULL;
+uint32_t image_count = 0;
+
+static int image_range_ok(uint64_t offset, uint64_t len) {
+	return offset <= image_size && len <= image_size - offset;
+}
+
+/*
+ * Map an image and check that everything in it points inside it.
+ */
+int image_load(const char * path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	image_size = st.st_size;
+	const struct image_header * header = NULL;
+	if (image_size >= sizeof(struct image_header)) {
+		image_map = mmap(NULL, image_size, PROT_READ, MAP_SHARED, fd, 0);
+		header = image_map == MAP_FAILED ? NULL : (const struct image_header *)image_map;
+	}
+	if (!header || memcmp(header->magic, IMAGE_MAGIC, 8) || header->entry_size != sizeof(struct image_entry) ||
+			header->entries % sizeof(uint64_t) ||
+			!image_range_ok(header->entries, (uint64_t)header->count * sizeof(struct image_entry))) {
+		goto _bad;
+	}
+	const struct image_entry * entries = (const struct image_entry *)(image_map + header->entries);
+	uint32_t i;
+	int v;
+	for (i = 0; i < header->count; ++i) {
+		const struct image_entry * e = &entries[i];
+		if (!image_range_ok(e->headers, e->headers_len) || e->headers_len > HEADER_BLOCK / 2 ||
+				!image_range_ok(e->modified, e->modified_len + 1) ||
+				e->path >= image_size || !memchr(image_map + e->path, '\0', image_size - e->path) ||
+				(i && strcmp(image_map + entries[i - 1].path, image_map + e->path) >= 0)) {
+			goto _bad;
+		}
+		for (v = 0; v < 2; ++v) {
+			if (!image_range_ok(e->etag[v], e->etag_len[v] + 1) || !image_range_ok(e->body[v], e->size[v])) {
+				goto _bad;
+			}
+		}
+	}
+	/*
+	 * Start reading it all in now, rather than on first request.
+	 */
+	madvise((void *)image_map, image_size, MADV_WILLNEED);
+	image_fd = fd;
+	image_entries = entries;
+	image_count = header->count;
+	fprintf(stderr, "[info] Serving %u files from %s.\n", image_count, path);
+	return 0;
+
+_bad:
+	fprintf(stderr, "%s is not a docroot image built by this version of mkimage.\n", path);
+	if (header) {
+		munmap((void *)image_map, image_size);
+	}
+	image_map = NULL;
+	close(fd);
+	return -1;
+}
+
+const struct image_entry * image_find(const char * path) {
+	uint32_t low = 0, high = image_count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		int cmp = strcmp(path, image_map + image_entries[mid].path);
+		if (!cmp) {
+			return &image_entries[mid];
+		} else if (cmp < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Whether an Accept-Encoding value takes gzip (and not at q=0).
+ */
+static int accepts_gzip(const char * accept) {
+	const char * gzip = accept ? strstr(accept, "gzip") : NULL;
+	if (!gzip) {
+		return 0;
+	}
+	gzip += 4;
+	while (*gzip == ' ') {
+		gzip++;
+	}
+	if (strncmp(gzip, ";q=", 3) && strncmp(gzip, "; q=", 4)) {
+		return 1;
+	}
+	return strtod(strchr(gzip, '=') + 1, NULL) > 0;
+}
+
+/*
+ * Serve path (under the docroot) from the image. Returns -1 if
+ * it isn't there.
+ */
+int image_serve(struct outq * q, FILE * socket_stream, const char * path, const char * accept_encoding,
+		struct file_request * fr, int head) {
+	const struct image_entry * found = image_find(path);
+	if (!found) {
+		return -1;
+	}
+	int v = found->etag_len[1] && accepts_gzip(accept_encoding);
+	struct entity e = {
+		image_fd, found->body[v], found->size[v], image_map + found->body[v],
+		image_map + found->etag[v], found->etag_len[v],
+		image_map + found->modified, found->modified_len
+	};
+	static const char gzipped[] = "Content-Encoding: gzip\r\n";
+	char headers[HEADER_BLOCK];
+	size_t headers_len = found->headers_len;
+	memcpy(headers, image_map + found->headers, headers_len);
+	if (v) {
+		memcpy(headers + headers_len, gzipped, sizeof(gzipped) - 1);
+		headers_len += sizeof(gzipped) - 1;
+	}
+	send_entity(q, socket_stream, &e, FRAGMENT(STATUS_LINE("200 OK")), headers, headers_len, fr, head);
+	return 0;
+}
+#endif
+
+/*
+ * Generic text-only response with a particular status.
+ * Used for bad requests mostly.
+ */
+void generic_response(FILE * socket_stream, char * status, char * message) {
+	header_block_t hb;
+	size_t status_len = strlen(status);
+	size_t message_len = strlen(message);
+	hb.len = 0;
+	header_add(&hb, FRAGMENT("HTTP/1.1 "));
+	header_add(&hb, status, status_len);
+	header_add(&hb, FRAGMENT("\r\nServer: " VERSION_STRING "\r\n"));
+	header_add(&hb, http_date[http_date_current], http_date_len[http_date_current]);
+	if (response_close) {
+		header_add(&hb, FRAGMENT("Connection: close\r\n"));
+	}
+#if ENABLE_TIMING
+	timing_status(status);
+#endif
+	header_add(&hb, FRAGMENT("Content-Type: text/plain\r\n"));
+	header_content_length(&hb, message_len + 2);
+	header_end(&hb);
+	struct iovec iov[3] = {
+		{ hb.data, hb.len },
+		{ message, message_len },
+		{ "\r\n", 2 }
+	};
+	stream_writev(socket_stream, iov, 3);
+}
+
+/*
+ * MIME type header for a file extension.
+ */
+const char * mime_header(const char * ext, size_t * len) {
+	const char * type = "Content-Type: text/unknown\r\n";
+	if (ext) {
+		if (!strcmp(ext,".htm") || !strcmp(ext,".html")) {
+			type = "Content-Type: text/html\r\n";
+		} else if (!strcmp(ext,".css")) {
+			type = "Content-Type: text/css\r\n";
+		} else if (!strcmp(ext,".png")) {
+			type = "Content-Type: image/png\r\n";
+		} else if (!strcmp(ext,".jpg")) {
+			type = "Content-Type: image/jpeg\r\n";
+		} else if (!strcmp(ext,".gif")) {
+			type = "Content-Type: image/gif\r\n";
+		} else if (!strcmp(ext,".pdf")) {
+			type = "Content-Type: application/pdf\r\n";
+		} else if (!strcmp(ext,".manifest")) {
+			type = "Content-Type: text/cache-manifest\r\n";
+		}
+	}
+	*len = strlen(type);
+	return type;
+}
+
+/*
+ * Request parsing.
+ * These work in place on lines handleRequest has already read,
+ * and are kept out of it so bench.c can time them on their own.
+ */
+
+/*
+ * Copy a line read by fgets into the arena without its line ending.
+ * Returns NULL if the line has no newline (it was too long). The
+ * newline is found in one pass, which also gives the length for the
+ * copy, so nothing after this has to look for the end of the line.
+ */
+char * store_line(struct arena * a, const char * in) {
+	const char * nl = scan3(in, '\n', '\n', '\n');
+	if (!*nl) {
+		return NULL;
+	}
+	size_t len = nl - in;
+	if (len && in[len - 1] == '\r') {
+		len--;
+	}
+	char * out = arena_alloc(a, len + 1);
+	memcpy(out, in, len);
+	out[len] = '\0';
+	return out;
+}
+
+/*
+ * Split a request line into its method, target, query string and
+ * version. Returns NULL on success, or the reason to give with a
+ * 400; an unsupported method comes back as request_type 0.
+ */
+const char * parse_request_line(char * str, int * request_type, char ** filename,
+		char ** querystring, char ** http_version) {
+	int r_type_width = 0;
+	*request_type = 0;
+	switch (str[0]) {
+		case 'G':
+			if (strstr(str, "GET ") == str) {
+				/*
+				 * GET: Retreive file
+				 */
+				r_type_width = 4;
+				*request_type = 1;
+			}
+			break;
+#if ENABLE_CGI
+		case 'P':
+			if (strstr(str, "POST ") == str) {
+				/*
+				 * POST: Send data to CGI
+				 */
+				r_type_width = 5;
+				*request_type = 2;
+			}
+			break;
+		case 'H':
+			if (strstr(str, "HEAD ") == str) {
+				/*
+				 * HEAD: Retreive headers only
+				 */
+				r_type_width = 5;
+				*request_type = 3;
+			}
+			break;
+#endif
+	}
+	if (!*request_type) {
+		return NULL;
+	}
+
+	*filename = str + r_type_width;
+	if ((*filename)[0] == ' ' || (*filename)[0] == '\0') {
+		/*
+		 * Request was missing a filename or was in a form we don't want to handle.
+		 */
+		return "Bad request: No filename.";
+	}
+
+	/*
+	 * Get the HTTP version.
+	 */
+	*http_version = strstr(*filename, "HTTP/");
+	if (!*http_version) {
+		return "Bad request: No HTTP version supplied.";
+	}
+	if (strncmp(*http_version, "HTTP/1.", 7) || !isdigit((unsigned char)(*http_version)[7]) ||
+		(*http_version)[8] != '\0') {
+		return "Bad request: Unsupported HTTP version.";
+	}
+	(*http_version)[-1] = '\0';
+
+	/*
+	 * Get the query string.
+	 */
+	*querystring = (char *)scan3(*filename, '?', '?', '?');
+	if (**querystring) {
+		**querystring = '\0';
+		(*querystring)++;
+	} else {
+		*querystring = NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Split a stored header line into "Name\0value". Returns the
+ * value, or NULL if the line has no ": ".
+ */
+char * split_header(char * str) {
+	char * colon = (char *)scan3(str, ':', ':', ':');
+	while (*colon == ':' && colon[1] != ' ') {
+		colon = (char *)scan3(colon + 1, ':', ':', ':');
+	}
+	if (*colon != ':') {
+		return NULL;
+	}
+	colon[0] = '\0';
+	return colon + 2;
+}
+
+/*
+ * Decode %XX escapes and '+' in a path. Returns `str` itself if
+ * there is nothing to decode, a decoded arena copy if there is, or
+ * NULL if an escape is malformed or decodes to a NUL. Runs between
+ * escapes are found with scan3 and copied whole.
+ */
+char * url_decode(struct arena * a, char * str) {
+	const char * pstr = scan3(str, '%', '%', '%');
+	if (!*pstr) {
+		return str;
+	}
+	size_t len = pstr - str;
+	char * buf = arena_alloc(a, len + strlen(pstr) + 1);
+	memcpy(buf, str, len);
+	char * pbuf = buf + len;
+	while (*pstr) {
+		if (*pstr == '%') {
+			int hi = from_hex(pstr[1]);
+			int lo = hi < 0 ? -1 : from_hex(pstr[2]);
+			if (lo < 0 || (hi | lo) == 0) {
+				return NULL;
+			}
+			*pbuf++ = (char)(hi << 4 | lo);
+			pstr += 3;
+		} else if (*pstr == '+') {
+			*pbuf++ = ' ';
+			pstr++;
+		}
+		const char * run = scan3(pstr, '%', '+', '+');
+		memcpy(pbuf, pstr, run - pstr);
+		pbuf += run - pstr;
+		pstr = run;
+	}
+	*pbuf = '\0';
+	return buf;
+}
+
+/*
+ * Whether a path (with PAGES_DIRECTORY already at the front, so
+ * there is a / before any user-supplied directory) tries to make a
+ * relative jump: it contains "/../" or ends with "/..".
+ */
+int path_escapes(const char * path) {
+	size_t len = strlen(path);
+	return strstr(path, "/../") || (len >= 3 && !strcmp(path + len - 3, "/.."));
+}
+
+/*
+ * A request path the way prefix rules should see it: decoded, with
+ * empty and "." segments dropped and ".." applied, so "/a/%2e%2e/b"
+ * and "//b" are both "/b". NULL if an escape is malformed.
+ */
+char * path_normalize(struct arena * a, char * path) {
+	char * decoded = url_decode(a, path);
+	if (!decoded) {
+		return NULL;
+	}
+	char * out = arena_alloc(a, strlen(decoded) + 2);
+	size_t len = 0;
+	const char * p = decoded;
+	while (*p) {
+		while (*p == '/') {
+			p++;
+		}
+		const char * segment = p;
+		while (*p && *p != '/') {
+			p++;
+		}
+		size_t segment_len = p - segment;
+		if (!segment_len || (segment_len == 1 && segment[0] == '.')) {
+			continue;
+		}
+		if (segment_len == 2 && segment[0] == '.' && segment[1] == '.') {
+			while (len && out[--len] != '/');
+			continue;
+		}
+		out[len++] = '/';
+		memcpy(out + len, segment, segment_len);
+		len += segment_len;
+	}
+	if (!len || (p > decoded && p[-1] == '/')) {
+		out[len++] = '/';
+	}
+	out[len] = '\0';
+	return out;
+}
+
+/*
+ * The extension of a file name, or NULL if it lacks one. A dot
+ * right after the leading character starts a hidden file's name,
+ * not an extension.
+ */
+char * file_extension(char * name) {
+	if (!name[0] || !name[1]) {
+		return NULL;
+	}
+	return strrchr(name + 2, '.');
+}
+
+/*
+ * Content-Length, strictly: digits only, and no more than fit.
+ */
+int parse_content_length(const char * value, unsigned long * out) {
+	unsigned long length = 0;
+	if (!*value) {
+		return -1;
+	}
+	for (; *value; ++value) {
+		if (*value < '0' || *value > '9' || length > (ULONG_MAX - 9) / 10) {
+			return -1;
+		}
+		length = length * 10 + (*value - '0');
+	}
+	*out = length;
+	return 0;
+}
+
+/*
+ * Whether a path is under a prefix, at a path boundary:
+ * /api covers /api and /api/x but not /apix.
+ */
+int path_under(const char * filename, const char * prefix, size_t prefix_len) {
+	if (strncmp(filename, prefix, prefix_len)) {
+		return 0;
+	}
+	char after = filename[prefix_len];
+	return !after || after == '/' || prefix[prefix_len - 1] == '/';
+}
+
+/*
+ * Body size limits by path prefix.
+ */
+struct body_limit {
+	char *        prefix;
+	size_t        prefix_len;
+	unsigned long max;
+} body_limits[BODY_LIMITS];
+int body_limit_count = 0;
+
+/*
+ * Parse a -b argument: /prefix=bytes, with an optional k, m or g.
+ */
+int body_limit_add(const char * spec) {
+	const char * equals = strchr(spec, '=');
+	if (spec[0] != '/' || !equals || body_limit_count == BODY_LIMITS) {
+		return -1;
+	}
+	char * end;
+	unsigned long max = strtoul(equals + 1, &end, 10);
+	if (end == equals + 1) {
+		return -1;
+	}
+	switch (*end) {
+		case 'g': case 'G': max *= 1024;
+		/* fallthrough */
+		case 'm': case 'M': max *= 1024;
+		/* fallthrough */
+		case 'k': case 'K': max *= 1024; ++end;
+		/* fallthrough */
+		case '\0': break;
+		default: return -1;
+	}
+	if (*end) {
+		return -1;
+	}
+	struct body_limit * limit = &body_limits[body_limit_count++];
+	limit->prefix = strndup(spec, equals - spec);
+	limit->prefix_len = equals - spec;
+	limit->max = max;
+	return 0;
+}
+
+/*
+ * The limit for a path: its longest prefix, at a path boundary, or BODY_MAX.
+ */
+unsigned long body_limit(const char * filename) {
+	struct body_limit * best = NULL;
+	int i;
+	for (i = 0; i < body_limit_count; ++i) {
+		struct body_limit * limit = &body_limits[i];
+		if (!path_under(filename, limit->prefix, limit->prefix_len)) {
+			continue;
+		}
+		if (!best || limit->prefix_len > best->prefix_len) {
+			best = limit;
+		}
+	}
+	return best ? best->max : BODY_MAX;
+}
+
+/*
+ * Directory reading.
+ * Names come a buffer at a time from getdents64 where we have it
+ * (readdir elsewhere), and the entry type it gives saves a stat per
+ * name; only names of unknown type, and symlinks, are looked up.
+ * Only files are listed, not subdirectories.
+ */
+#if ENABLE_GETDENTS
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+#endif
+
+struct dir_reader {
+	const char *   path;
+	size_t         path_len;
+#if ENABLE_GETDENTS
+	int            fd;
+	char *         buf;      /* LISTING_BUFFER bytes */
+	long           pos;
+	long           len;
+#else
+	DIR *          dir;
+#endif
+};
+
+int dir_open(struct dir_reader * d, const char * path, char * buf) {
+	d->path = path;
+	d->path_len = strlen(path);
+#if ENABLE_GETDENTS
+	d->buf = buf;
+	d->pos = d->len = 0;
+	d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return d->fd < 0 ? -1 : 0;
+#else
+	(void)buf;
+	d->dir = opendir(path);
+	return d->dir ? 0 : -1;
+#endif
+}
+
+/*
+ * The next file in the directory, or NULL at the end.
+ */
+const char * dir_next_file(struct dir_reader * d, size_t * len) {
+	while (1) {
+		const char * name;
+		unsigned char type;
+#if ENABLE_GETDENTS
+		if (d->pos >= d->len) {
+			d->len = syscall(SYS_getdents64, d->fd, d->buf, LISTING_BUFFER);
+			d->pos = 0;
+			if (d->len <= 0) {
+				return NULL;
+			}
+		}
+		struct linux_dirent64 * ent = (struct linux_dirent64 *)(d->buf + d->pos);
+		d->pos += ent->d_reclen;
+		name = ent->d_name;
+		type = ent->d_type;
+#else
+		struct dirent * ent = readdir(d->dir);
+		if (!ent) {
+			return NULL;
+		}
+		name = ent->d_name;
+		type = ent->d_type;
+#endif
+		if (type == DT_DIR) {
+			continue;
+		}
+		*len = strlen(name);
+		if (type != DT_REG) {
+			/*
+			 * Symlinks, and filesystems that don't say.
+			 */
+			struct stat stats;
+			char _fullname[d->path_len + 1 + *len + 1];
+			memcpy(_fullname, d->path, d->path_len);
+			_fullname[d->path_len] = '/';
+			memcpy(_fullname + d->path_len + 1, name, *len + 1);
+			if (stat(_fullname, &stats) == 0 && S_ISDIR(stats.st_mode)) {
+				continue;
+			}
+		}
+		return name;
+	}
+}
+
+void dir_close(struct dir_reader * d) {
+#if ENABLE_GETDENTS
+	if (d->fd >= 0) {
+		close(d->fd);
+	}
+#else
+	if (d->dir) {
+		closedir(d->dir);
+	}
+#endif
+}
+
+/*
+ * Read files into the arena until there are more than max. Returns
+ * them, and sets *more if we stopped before the end.
+ */
+static char ** listing_collect(struct arena * a, struct dir_reader * d, size_t max, size_t * count, int * more) {
+	size_t size = 256, len;
+	char ** names = arena_alloc(a, size * sizeof(char *));
+	const char * name;
+	*count = 0;
+	*more = 0;
+	while (*count <= max && (name = dir_next_file(d, &len))) {
+		if (*count == size) {
+			names = arena_grow(a, names, size * sizeof(char *), size * 2 * sizeof(char *));
+			size *= 2;
+		}
+		char * copy = arena_alloc(a, len + 1);
+		memcpy(copy, name, len + 1);
+		names[(*count)++] = copy;
+	}
+	*more = *count > max;
+	return names;
+}
+
+static int compare_names(const void * a, const void * b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+#define LISTING_HEAD "<!doctype html><html><head><title>Directory Listing</title></head><body>"
+#define LISTING_TAIL "</body></html>"
+#define LISTING_ENTRY_MAX(len) (2 * (len) + 20)
+
+/*
+ * One link to a file; out needs LISTING_ENTRY_MAX(len) bytes.
+ */
+static size_t listing_entry(char * out, const char * name, size_t name_len) {
+	char * start = out;
+	memcpy(out, "<a href=\"", 9);
+	out += 9;
+	memcpy(out, name, name_len);
+	out += name_len;
+	memcpy(out, "\">", 2);
+	out += 2;
+	memcpy(out, name, name_len);
+	out += name_len;
+	memcpy(out, "</a><br>\n", 9);
+	out += 9;
+	return out - start;
+}
+
+/*
+ * Render links to the given names, between head and tail, into the arena.
+ */
+static char * listing_render(struct arena * a, char ** names, size_t count, const char * tail, size_t * out_len) {
+	size_t i, size = sizeof(LISTING_HEAD) + strlen(tail) + 1;
+	for (i = 0; i < count; ++i) {
+		size += LISTING_ENTRY_MAX(strlen(names[i]));
+	}
+	char * listing = arena_alloc(a, size);
+	size_t len = sizeof(LISTING_HEAD) - 1;
+	memcpy(listing, LISTING_HEAD, len);
+	for (i = 0; i < count; ++i) {
+		len += listing_entry(listing + len, names[i], strlen(names[i]));
+	}
+	strcpy(listing + len, tail);
+	*out_len = len + strlen(tail);
+	return listing;
+}
+
+/*
+ * Render the HTML listing of the files (not subdirectories) in a
+ * directory into the arena, sorted. Returns the listing and its length.
+ */
+char * render_listing(struct arena * a, const char * path, size_t * out_len) {
+	struct dir_reader d;
+	size_t count = 0;
+	int more;
+	char ** names = NULL;
+	if (dir_open(&d, path, arena_alloc(a, LISTING_BUFFER)) == 0) {
+		names = listing_collect(a, &d, (size_t)-1, &count, &more);
+	}
+	dir_close(&d);
+	qsort(names, count, sizeof(char *), compare_names);
+	return listing_render(a, names, count, LISTING_TAIL, out_len);
+}
+
+/*
+ * Send a listing. A directory of up to LISTING_BATCH files is sorted
+ * and sent whole, as it always was. Past that we don't wait to read
+ * it all: files go out in the order the filesystem has them, one
+ * chunk at a time, and at most OUTPUT_LIMIT bytes of it are held.
+ * Returns 1 if the connection has to be closed afterwards.
+ */
+int listing_send(struct socket_request * request, FILE * socket_stream, const char * path,
+		const char * http_version, int head) {
+	struct dir_reader d;
+	size_t count = 0, len;
+	int more = 0;
+	char ** names = NULL;
+	if (dir_open(&d, path, arena_alloc(&request->arena, LISTING_BUFFER)) == 0) {
+		names = listing_collect(&request->arena, &d, LISTING_BATCH, &count, &more);
+	}
+	header_block_t hb;
+	header_begin(&hb, FRAGMENT(STATUS_LINE("200 OK")));
+	header_add(&hb, FRAGMENT("Content-Type: text/html\r\n"));
+	if (!more) {
+		dir_close(&d);
+		qsort(names, count, sizeof(char *), compare_names);
+		char * listing = listing_render(&request->arena, names, count, LISTING_TAIL, &len);
+		header_content_length(&hb, len);
+		header_end(&hb);
+		send_response(socket_stream, &hb, listing, head ? 0 : len);
+		return 0;
+	}
+
+	int raw = strcmp(http_version, "HTTP/1.1") != 0;
+	if (raw) {
+		header_add(&hb, FRAGMENT("Connection: close\r\n\r\n"));
+	} else {
+		header_add(&hb, FRAGMENT("Transfer-Encoding: chunked\r\n\r\n"));
+	}
+	if (head) {
+		dir_close(&d);
+		send_response(socket_stream, &hb, NULL, 0);
+		return raw;
+	}
+
+	/*
+	 * The first batch, then the rest straight from the reader,
+	 * a buffer's worth per chunk.
+	 */
+	char * buf = io_buffer_get();
+	size_t used = sizeof(LISTING_HEAD) - 1, i = 0;
+	memcpy(buf, LISTING_HEAD, used);
+	const char * name;
+	while (1) {
+		if (i < count) {
+			name = names[i++];
+			len = strlen(name);
+		} else if (!(name = dir_next_file(&d, &len))) {
+			break;
+		}
+		if (used + LISTING_ENTRY_MAX(len) > IO_BUFFER) {
+			outq_chunk(&request->out, &hb, raw, buf, used);
+			used = 0;
+			if (outq_flush(&request->out, socket_stream, OUTPUT_LIMIT) < 0) {
+				break;
+			}
+		}
+		used += listing_entry(buf + used, name, len);
+	}
+	memcpy(buf + used, LISTING_TAIL, sizeof(LISTING_TAIL) - 1);
+	used += sizeof(LISTING_TAIL) - 1;
+	outq_chunk(&request->out, &hb, raw, buf, used);
+	if (!raw) {
+		outq_chunk(&request->out, &hb, raw, NULL, 0);
+	}
+	io_buffer_put(buf);
+	dir_close(&d);
+	return raw;
+}
+
+/*
+ * Paged listings.
+ * ?offset=N&limit=M asks for a page of a directory's files in sorted
+ * order. The sorted names are kept for the last LISTING_CACHE
+ * directories asked about, and rebuilt when a directory changes, so
+ * paging through one reads and sorts it once.
+ */
+struct listing_index {
+	dev_t           dev;
+	ino_t           ino;
+	struct timespec mtime;
+	char *          names;     /* Packed, NUL-terminated */
+	size_t *        offsets;   /* Sorted */
+	size_t          count;
+	int             refs;      /* Users, and one for the cache */
+	unsigned long   used;      /* When it was last asked for */
+};
+
+static struct listing_index * listing_cache[LISTING_CACHE];
+static unsigned long listing_clock = 0;
+static pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void listing_index_put(struct listing_index * index) {
+	pthread_mutex_lock(&listing_lock);
+	int refs = --index->refs;
+	pthread_mutex_unlock(&listing_lock);
+	if (!refs) {
+		free(index->names);
+		free(index->offsets);
+		free(index);
+	}
+}
+
+static const char * listing_sort_names;
+
+static int compare_offsets(const void * a, const void * b) {
+	return strcmp(listing_sort_names + *(const size_t *)a, listing_sort_names + *(const size_t *)b);
+}
+
+static struct listing_index * listing_index_build(const char * path, const struct stat * st) {
+	struct dir_reader d;
+	char * buf = malloc(LISTING_BUFFER);
+	if (dir_open(&d, path, buf) < 0) {
+		free(buf);
+		return NULL;
+	}
+	struct listing_index * index = calloc(1, sizeof(struct listing_index));
+	size_t names_size = LISTING_BUFFER, names_len = 0, offsets_size = 1024, len;
+	index->names = malloc(names_size);
+	index->offsets = malloc(offsets_size * sizeof(size_t));
+	const char * name;
+	while ((name = dir_next_file(&d, &len))) {
+		if (names_len + len + 1 > names_size) {
+			names_size = names_size * 2 + len;
+			index->names = realloc(index->names, names_size);
+		}
+		if (index->count == offsets_size) {
+			offsets_size *= 2;
+			index->offsets = realloc(index->offsets, offsets_size * sizeof(size_t));
+		}
+		memcpy(index->names + names_len, name, len + 1);
+		index->offsets[index->count++] = names_len;
+		names_len += len + 1;
+	}
+	dir_close(&d);
+	free(buf);
+
+	/*
+	 * qsort has no context argument in C99.
+	 */
+	static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&sort_lock);
+	listing_sort_names = index->names;
+	qsort(index->offsets, index->count, sizeof(size_t), compare_offsets);
+	pthread_mutex_unlock(&sort_lock);
+
+	index->dev = st->st_dev;
+	index->ino = st->st_ino;
+	index->mtime = st->st_mtim;
+	index->refs = 1;
+	return index;
+}
+
+/*
+ * The sorted index for a directory, from the cache or built now.
+ * Give it back with listing_index_put.
+ */
+struct listing_index * listing_index_get(const char * path, const struct stat * st) {
+	int i, slot = 0;
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < LISTING_CACHE; ++i) {
+		struct listing_index * index = listing_cache[i];
+		if (index && index->dev == st->st_dev && index->ino == st->st_ino &&
+				index->mtime.tv_sec == st->st_mtim.tv_sec && index->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+			index->refs++;
+			index->used = ++listing_clock;
+			pthread_mutex_unlock(&listing_lock);
+			return index;
+		}
+	}
+	pthread_mutex_unlock(&listing_lock);
+
+	struct listing_index * index = listing_index_build(path, st);
+	if (!index) {
+		return NULL;
+	}
+
+	/*
+	 * Replace an older index of the same directory, or the
+	 * one used longest ago.
+	 */
+	struct listing_index * old;
+	pthread_mutex_lock(&listing_lock);
+	for (i = 0; i < LISTING_CACHE; ++i) {
+		if (!listing_cache[i] || (listing_cache[i]->dev == st->st_dev && listing_cache[i]->ino == st->st_ino)) {
+			slot = i;
+			break;
+		}
+		if (listing_cache[i]->used < listing_cache[slot]->used) {
+			slot = i;
+		}
+	}
+	old = listing_cache[slot];
+	listing_cache[slot] = index;
+	index->refs++;
+	index->used = ++listing_clock;
+	pthread_mutex_unlock(&listing_lock);
+	if (old) {
+		listing_index_put(old);
+	}
+	return index;
+}
+
+/*
+ * Read offset= and limit= from a query string. Returns 0 if
+ * neither is there.
+ */
+int listing_page_query(const char * query, size_t * offset, size_t * limit) {
+	int found = 0;
+	*offset = 0;
+	*limit = LISTING_PAGE;
+	while (query && *query) {
+		if (!strncmp(query, "offset=", 7)) {
+			*offset = strtoul(query + 7, NULL, 10);
+			found = 1;
+		} else if (!strncmp(query, "limit=", 6)) {
+			*limit = strtoul(query + 6, NULL, 10);
+			found = 1;
+		}
+		query = strchr(query, '&');
+		if (query) {
+			query++;
+		}
+	}
+	if (*limit == 0 || *limit > LISTING_PAGE) {
+		*limit = LISTING_PAGE;
+	}
+	return found;
+}
+
+/*
+ * Send one page of a directory's sorted listing, with links to the
+ * pages either side.
+ */
+void listing_page(struct socket_request * request, FILE * socket_stream, const char * path,
+		const struct stat * st, size_t offset, size_t limit, int head) {
+	struct listing_index * index = listing_index_get(path, st);
+	if (!index) {
+		generic_response(socket_stream, "404 File Not Found", "The requested file could not be found.");
+		return;
+	}
+	size_t count = 0, i;
+	if (offset < index->count) {
+		count = index->count - offset < limit ? index->count - offset : limit;
+	}
+	char ** names = arena_alloc(&request->arena, (count ? count : 1) * sizeof(char *));
+	for (i = 0; i < count; ++i) {
+		names[i] = index->names + index->offsets[offset + i];
+	}
+	char tail[256];
+	size_t tail_len = sprintf(tail, "<p>%zu files.", index->count);
+	if (offset) {
+		tail_len += sprintf(tail + tail_len, " <a href=\"?offset=%zu&amp;limit=%zu\">Previous</a>",
+				offset > limit ? offset - limit : 0, limit);
+	}
+	if (offset + count < index->count) {
+		tail_len += sprintf(tail + tail_len, " <a href=\"?offset=%zu&amp;limit=%zu\">Next</a>", offset + count, limit);
+	}
+	strcpy(tail + tail_len, "</p>" LISTING_TAIL);
+	size_t len;
+	char * listing = listing_render(&request->arena, names, count, tail, &len);
+	listing_index_put(index);
+
+	header_block_t hb;
+	header_begin(&hb, FRAGMENT(STATUS_LINE("200 OK")));
+	header_add(&hb, FRAGMENT("Content-Type: text/html\r\n"));
+	header_content_length(&hb, len);
+	header_end(&hb);
+	send_response(socket_stream, &hb, listing, head ? 0 : len);
+}
+
+#if ENABLE_CGI
+/*
+ * CGI slots.
+ * A slot is taken before we fork and given back by wait_pid once
+ * the process has been reaped, so the caps count live processes.
+ * Waiters are served in arrival order, skipping any whose script
+ * is still at its own cap.
+ */
+struct cgi_script {
+	char *             path;     /* Script, relative to the server */
+	int                running;  /* Processes running it */
+	int                waiting;  /* Requests waiting for it */
+};
+
+struct cgi_waiter {
+	struct cgi_script * script;
+	pthread_cond_t     cond;
+	int                granted;
+	struct cgi_waiter * next;
+};
+
+pthread_mutex_t cgi_lock = PTHREAD_MUTEX_INITIALIZER;
+struct cgi_script cgi_scripts[CGI_SCRIPTS];
+struct cgi_waiter * cgi_queue_head = NULL;
+struct cgi_waiter * cgi_queue_tail = NULL;
+int cgi_running = 0;
+int cgi_queue_depth = 0;
+int cgi_queue_peak = 0;
+
+/*
+ * Find a script's entry, with cgi_lock held. Entries nobody is
+ * using are recycled; if there are none, the script goes without
+ * a per-script cap (NULL).
+ */
+static struct cgi_script * cgi_script_find(const char * path) {
+	unsigned int h = 5381;
+	const char * c;
+	for (c = path; *c; ++c) {
+		h = h * 33 + (unsigned char)*c;
+	}
+	struct cgi_script * unused = NULL;
+	int i;
+	for (i = 0; i < CGI_SCRIPTS; ++i) {
+		struct cgi_script * e = &cgi_scripts[(h + i) % CGI_SCRIPTS];
+		if (e->path && !strcmp(e->path, path)) {
+			return e;
+		}
+		if (!unused && (!e->path || (!e->running && !e->waiting))) {
+			unused = e;
+		}
+		if (!e->path) {
+			break;
+		}
+	}
+	if (unused) {
+		free(unused->path);
+		unused->path = strdup(path);
+		unused->running = 0;
+		unused->waiting = 0;
+	}
+	return unused;
+}
+
+static int cgi_slot_free(struct cgi_script * script) {
+	return cgi_running < CGI_MAX_CHILDREN && (!script || script->running < CGI_MAX_SCRIPT);
+}
+
+static void cgi_take(struct cgi_script * script) {
+	cgi_running++;
+	if (script) {
+		script->running++;
+	}
+}
+
+/*
+ * Wait for a slot to run a script. Returns 0 and sets *slot on
+ * success, or -1 if the request should be shed.
+ */
+int cgi_acquire(const char * path, struct cgi_script ** slot) {
+	pthread_mutex_lock(&cgi_lock);
+	struct cgi_script * script = cgi_script_find(path);
+	if (cgi_slot_free(script) && !(script ? script->waiting : cgi_queue_depth)) {
+		cgi_take(script);
+		pthread_mutex_unlock(&cgi_lock);
+		*slot = script;
+		return 0;
+	}
+	if (cgi_queue_depth >= CGI_QUEUE) {
+		pthread_mutex_unlock(&cgi_lock);
+		STAT_ADD(cgi_shed, 1);
+		return -1;
+	}
+
+	/*
+	 * Get in line.
+	 */
+	struct cgi_waiter waiter;
+	waiter.script = script;
+	waiter.granted = 0;
+	waiter.next = NULL;
+	pthread_cond_init(&waiter.cond, NULL);
+	if (cgi_queue_tail) {
+		cgi_queue_tail->next = &waiter;
+	} else {
+		cgi_queue_head = &waiter;
+	}
+	cgi_queue_tail = &waiter;
+	if (script) {
+		script->waiting++;
+	}
+	if (++cgi_queue_depth > cgi_queue_peak) {
+		cgi_queue_peak = cgi_queue_depth;
+	}
+	STAT_ADD(cgi_queued, 1);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += CGI_QUEUE_WAIT;
+	while (!waiter.granted) {
+		if (pthread_cond_timedwait(&waiter.cond, &cgi_lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	if (!waiter.granted) {
+		/*
+		 * Out of time, take ourselves out of line.
+		 */
+		struct cgi_waiter ** w = &cgi_queue_head;
+		struct cgi_waiter * prev = NULL;
+		while (*w != &waiter) {
+			prev = *w;
+			w = &(*w)->next;
+		}
+		*w = waiter.next;
+		if (cgi_queue_tail == &waiter) {
+			cgi_queue_tail = prev;
+		}
+		cgi_queue_depth--;
+		if (script) {
+			script->waiting--;
+		}
+	}
+	pthread_mutex_unlock(&cgi_lock);
+	pthread_cond_destroy(&waiter.cond);
+
+	if (!waiter.granted) {
+		STAT_ADD(cgi_shed, 1);
+		STAT_ADD(cgi_timeouts, 1);
+		return -1;
+	}
+	*slot = script;
+	return 0;
+}
+
+/*
+ * A CGI process exited (or never started); hand its slot to
+ * the first waiter that can use it.
+ */
+void cgi_release(struct cgi_script * script) {
+	pthread_mutex_lock(&cgi_lock);
+	cgi_running--;
+	if (script) {
+		script->running--;
+	}
+	struct cgi_waiter ** w = &cgi_queue_head;
+	struct cgi_waiter * prev = NULL;
+	while (*w && cgi_running < CGI_MAX_CHILDREN) {
+		struct cgi_waiter * waiter = *w;
+		if (!cgi_slot_free(waiter->script)) {
+			prev = waiter;
+			w = &waiter->next;
+			continue;
+		}
+		*w = waiter->next;
+		if (cgi_queue_tail == waiter) {
+			cgi_queue_tail = prev;
+		}
+		cgi_queue_depth--;
+		if (waiter->script) {
+			waiter->script->waiting--;
+		}
+		cgi_take(waiter->script);
+		waiter->granted = 1;
+		pthread_cond_signal(&waiter->cond);
+	}
+	pthread_mutex_unlock(&cgi_lock);
+}
+#endif
+
+/*
+ * Wait for a CGI thread to finish and
+ * close its pipe.
+ */
+void *wait_pid(void * onwhat) {
+	struct cgi_wait * cgi_w = (struct cgi_wait*)onwhat;
+	int status;
+
+	/*
+	 * Wait for the process to finish
+	 */
+	waitpid(cgi_w->pid, &status, 0);
+
+	/*
+	 * Close the respective pipe
+	 */
+	close(cgi_w->fd);
+	close(cgi_w->fd2);
+#if ENABLE_CGI
+	cgi_release(cgi_w->script);
+#endif
+
+	/*
+	 * Free the data we were sent.
+	 */
+	free(onwhat);
+	return NULL;
+}
+
+#if ENABLE_MICROCACHE
+/*
+ * CGI micro-cache.
+ * Scripts opt in per response with Cache-Control: max-age (or
+ * s-maxage); no-store, no-cache, private, Set-Cookie and Vary: *
+ * keep a response out. Entries are keyed on the script and query
+ * string, with one entry per combination of the request headers
+ * named by the response's Vary.
+ *
+ * Only one request fills a given key at a time: it inserts an empty
+ * placeholder, and anyone else missing on that key waits for it to
+ * finish (up to CACHE_WAIT seconds) and then looks again. A response
+ * that allows stale-while-revalidate keeps being served after it
+ * expires while a background request refreshes it.
+ */
+struct cache_entry {
+	char *             key;         /* Script path and query string */
+	char *             vary;        /* Request headers named by Vary, or NULL */
+	char *             vary_values; /* Their values when this was filled, one per line */
+	char *             headers;     /* Header lines from the script */
+	size_t             headers_len;
+	char *             body;        /* Response body */
+	size_t             body_len;
+	size_t             alloc;       /* Capacity of body while filling */
+	size_t             size;        /* Bytes charged against CACHE_MEMORY */
+	time_t             stored;      /* When the fill finished (for a replica, when the owner's did) */
+	double             expires;     /* Fresh until */
+	double             stale_until; /* Servable while revalidating until */
+	int                valid;       /* Filled; otherwise a placeholder */
+	int                filling;     /* Placeholder or revalidation in flight */
+	int                oversize;    /* Capture ran past CACHE_MAX_ENTRY */
+	int                replica;     /* Copied from the server that owns the key */
+	int                refs;        /* Readers sending it */
+	int                dead;        /* Unlinked, free when refs drop */
+	struct cache_entry * old;       /* Entry this fill replaces */
+	struct cache_entry * next;      /* Hash chain */
+	struct cache_entry * lru_prev;
+	struct cache_entry * lru_next;
+};
+
+/*
+ * Lookup results.
+ */
+#define CACHE_BYPASS 0 /* Run the script, don't store it */
+#define CACHE_HIT    1 /* Serve the entry */
+#define CACHE_FILL   2 /* Run the script and store it in the entry */
+
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+struct cache_entry * cache_table[CACHE_BUCKETS];
+struct cache_entry * cache_lru_head = NULL;
+struct cache_entry * cache_lru_tail = NULL;
+size_t cache_bytes = 0;
+size_t cache_replica_bytes = 0;  /* Of cache_bytes, in replicas */
+int cache_entries = 0;
+
+static double cache_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned int cache_hash(const char * key) {
+	unsigned int h = 5381;
+	for (; *key; ++key) {
+		h = h * 33 + (unsigned char)*key;
+	}
+	return h % CACHE_BUCKETS;
+}
+
+/*
+ * Find a request header once the queue has been processed (each
+ * line split into name and value); returns its value and sets *len,
+ * or NULL.
+ */
+const char * request_header(vector_t * queue, const char * name, size_t name_len, size_t * len) {
+	unsigned int i;
+	for (i = 1; i < queue->size; ++i) {
+		const char * line = (const char *)vector_at(queue, i);
+		if (strlen(line) == name_len && !strncasecmp(line, name, name_len)) {
+			const char * value = line + name_len + 2;
+			*len = strlen(value);
+			return value;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Walk the comma-separated names in a Vary list.
+ */
+static const char * cache_vary_next(const char * vary, size_t * len) {
+	while (*vary == ',' || *vary == ' ') {
+		vary++;
+	}
+	*len = strcspn(vary, ", ");
+	return *len ? vary : NULL;
+}
+
+/*
+ * Do this request's headers match the ones the entry was filled with?
+ */
+static int cache_vary_match(struct cache_entry * e, vector_t * queue) {
+	if (!e->vary) {
+		return 1;
+	}
+	const char * stored = e->vary_values;
+	const char * name = e->vary;
+	size_t name_len;
+	while ((name = cache_vary_next(name, &name_len))) {
+		size_t len = 0;
+		const char * value = request_header(queue, name, name_len, &len);
+		size_t stored_len = strcspn(stored, "\n");
+		if (stored_len != len || (len && memcmp(stored, value, len))) {
+			return 0;
+		}
+		stored += stored_len + 1;
+		name += name_len;
+	}
+	return 1;
+}
+
+static char * cache_vary_capture(const char * vary, vector_t * queue) {
+	size_t total = 1;
+	const char * name = vary;
+	size_t name_len;
+	while ((name = cache_vary_next(name, &name_len))) {
+		size_t len = 0;
+		request_header(queue, name, name_len, &len);
+		total += len + 1;
+		name += name_len;
+	}
+	char * out = malloc(total);
+	char * o = out;
+	name = vary;
+	while ((name = cache_vary_next(name, &name_len))) {
+		size_t len = 0;
+		const char * value = request_header(queue, name, name_len, &len);
+		if (len) {
+			memcpy(o, value, len);
+		}
+		o += len;
+		*o++ = '\n';
+		name += name_len;
+	}
+	*o = '\0';
+	return out;
+}
+
+static void cache_lru_unlink(struct cache_entry * e) {
+	if (e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else if (cache_lru_head == e) {
+		cache_lru_head = e->lru_next;
+	}
+	if (e->lru_next) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else if (cache_lru_tail == e) {
+		cache_lru_tail = e->lru_prev;
+	}
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void cache_lru_front(struct cache_entry * e) {
+	cache_lru_unlink(e);
+	e->lru_next = cache_lru_head;
+	if (cache_lru_head) {
+		cache_lru_head->lru_prev = e;
+	}
+	cache_lru_head = e;
+	if (!cache_lru_tail) {
+		cache_lru_tail = e;
+	}
+}
+
+static void cache_destroy(struct cache_entry * e) {
+	free(e->key);
+	free(e->vary);
+	free(e->vary_values);
+	free(e->headers);
+	free(e->body);
+	free(e);
+}
+
+/*
+ * Take an entry out of the table (cache_lock held).
+ */
+static void cache_unlink(struct cache_entry * e) {
+	struct cache_entry ** p = &cache_table[cache_hash(e->key)];
+	while (*p && *p != e) {
+		p = &(*p)->next;
+	}
+	if (*p) {
+		*p = e->next;
+	}
+	cache_lru_unlink(e);
+	cache_bytes -= e->size;
+	if (e->replica) {
+		cache_replica_bytes -= e->size;
+	}
+	cache_entries--;
+	e->dead = 1;
+	if (!e->refs) {
+		cache_destroy(e);
+	}
+}
+
+static struct cache_entry * cache_placeholder(const char * key, struct cache_entry * old) {
+	struct cache_entry * e = calloc(sizeof(struct cache_entry), 1);
+	e->key = strdup(key);
+	e->filling = 1;
+	e->old = old;
+	unsigned int h = cache_hash(key);
+	e->next = cache_table[h];
+	cache_table[h] = e;
+	cache_entries++;
+	return e;
+}
+
+/*
+ * Look up a CGI response. On CACHE_HIT the entry is referenced and
+ * must be given back with cache_release; if *revalidate is set, a
+ * background refresh should be started for it. On CACHE_FILL the
+ * caller owns the placeholder until cache_finish.
+ */
+int cache_lookup(const char * key, vector_t * queue, int may_fill,
+		struct cache_entry ** out, struct cache_entry ** revalidate) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += CACHE_WAIT;
+	int waited = 0;
+	*revalidate = NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	while (1) {
+		double now = cache_now();
+		struct cache_entry * usable = NULL;
+		int pending = 0;
+		struct cache_entry * e;
+		for (e = cache_table[cache_hash(key)]; e; e = e->next) {
+			if (strcmp(e->key, key)) {
+				continue;
+			}
+			if (!e->valid) {
+				pending = 1;
+				continue;
+			}
+			if (cache_vary_match(e, queue)) {
+				usable = e;
+				break;
+			}
+		}
+
+		if (usable && (now < usable->expires || now < usable->stale_until)) {
+			if (now >= usable->expires && !usable->filling && may_fill) {
+				/*
+				 * Stale: serve it, and have it refreshed.
+				 */
+				usable->filling = 1;
+				*revalidate = cache_placeholder(key, usable);
+				STAT_ADD(cache_stale, 1);
+			} else {
+				STAT_ADD(cache_hits, 1);
+			}
+			usable->refs++;
+			cache_lru_front(usable);
+			pthread_mutex_unlock(&cache_lock);
+			*out = usable;
+			return CACHE_HIT;
+		}
+
+		if (!may_fill) {
+			break;
+		}
+
+		if ((usable && usable->filling) || (!usable && pending)) {
+			/*
+			 * Someone is already running it; wait for them.
+			 */
+			if (!waited) {
+				STAT_ADD(cache_coalesced, 1);
+				waited = 1;
+			}
+			if (pthread_cond_timedwait(&cache_cond, &cache_lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+			continue;
+		}
+
+		if (usable) {
+			usable->filling = 1;
+		}
+		*out = cache_placeholder(key, usable);
+		STAT_ADD(cache_misses, 1);
+		pthread_mutex_unlock(&cache_lock);
+		return CACHE_FILL;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return CACHE_BYPASS;
+}
+
+void cache_release(struct cache_entry * e) {
+	pthread_mutex_lock(&cache_lock);
+	if (!--e->refs && e->dead) {
+		cache_destroy(e);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Record script output into a placeholder: header lines (body = 0)
+ * or body data (body = 1).
+ */
+void cache_capture(struct cache_entry * e, int body, const char * data, size_t len) {
+	if (e->oversize) {
+		return;
+	}
+	if (e->headers_len + e->body_len + len > CACHE_MAX_ENTRY) {
+		e->oversize = 1;
+		return;
+	}
+	if (!body) {
+		e->headers = realloc(e->headers, e->headers_len + len);
+		memcpy(e->headers + e->headers_len, data, len);
+		e->headers_len += len;
+		return;
+	}
+	if (e->body_len + len > e->alloc) {
+		e->alloc = (e->body_len + len) * 2;
+		e->body = realloc(e->body, e->alloc);
+	}
+	memcpy(e->body + e->body_len, data, len);
+	e->body_len += len;
+}
+
+/*
+ * Parse a number after a Cache-Control directive name.
+ */
+static long cache_directive(const char * cc, size_t cc_len, const char * name) {
+	size_t name_len = strlen(name);
+	const char * p = cc;
+	while (p < cc + cc_len) {
+		while (p < cc + cc_len && (*p == ' ' || *p == ',')) {
+			p++;
+		}
+		size_t len = 0;
+		while (p + len < cc + cc_len && p[len] != ',') {
+			len++;
+		}
+		if (len >= name_len && !strncasecmp(p, name, name_len)) {
+			if (len == name_len) {
+				return 0;
+			}
+			if (p[name_len] == '=') {
+				return strtol(p + name_len + 1, NULL, 10);
+			}
+		}
+		p += len;
+	}
+	return -1;
+}
+
+/*
+ * Finish a fill. If the script finished cleanly and asked to be
+ * cached, the placeholder becomes a real entry (replacing the one it
+ * was revalidating); otherwise it goes away. `queue` is the request
+ * that filled it, for its Vary values.
+ */
+void cache_finish(struct cache_entry * e, int ok, vector_t * queue) {
+	long max_age = -1;
+	long stale = 0;
+	char * vary = NULL;
+	const char * line = e->headers;
+	const char * end = e->headers + e->headers_len;
+	while (ok && line && line < end) {
+		size_t len = 0;
+		while (line + len < end && line[len] != '\n') {
+			len++;
+		}
+		if (len > 14 && !strncasecmp(line, "Cache-Control:", 14)) {
+			const char * cc = line + 14;
+			size_t cc_len = len - 14;
+			while (cc_len && (cc[cc_len - 1] == '\r' || cc[cc_len - 1] == ' ')) {
+				cc_len--;
+			}
+			if (cache_directive(cc, cc_len, "no-store") >= 0 ||
+				cache_directive(cc, cc_len, "no-cache") >= 0 ||
+				cache_directive(cc, cc_len, "private") >= 0) {
+				ok = 0;
+			}
+			long s_maxage = cache_directive(cc, cc_len, "s-maxage");
+			max_age = s_maxage >= 0 ? s_maxage : cache_directive(cc, cc_len, "max-age");
+			stale = cache_directive(cc, cc_len, "stale-while-revalidate");
+		} else if (len > 11 && !strncasecmp(line, "Set-Cookie:", 11)) {
+			ok = 0;
+		} else if (len > 5 && !strncasecmp(line, "Vary:", 5)) {
+			const char * v = line + 5;
+			while (*v == ' ') {
+				v++;
+			}
+			size_t v_len = line + len - v;
+			while (v_len && (v[v_len - 1] == '\r' || v[v_len - 1] == ' ')) {
+				v_len--;
+			}
+			if (memchr(v, '*', v_len)) {
+				ok = 0;
+			}
+			free(vary);
+			vary = strndup(v, v_len);
+		}
+		line += len + 1;
+	}
+	if (e->replica) {
+		/*
+		 * A copy of another server's response lives out what is
+		 * left of its age there, and no more than PEER_REPLICA_TTL.
+		 */
+		max_age -= (long)(time(NULL) - e->stored);
+		if (max_age > PEER_REPLICA_TTL) {
+			max_age = PEER_REPLICA_TTL;
+		}
+		stale = 0;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry * old = e->old;
+	e->old = NULL;
+	if (ok && !e->oversize && max_age > 0 && e->headers_len + e->body_len <= CACHE_MAX_ENTRY) {
+		double now = cache_now();
+		if (vary) {
+			e->vary_values = cache_vary_capture(vary, queue);
+		}
+		e->vary = vary;
+		vary = NULL;
+		if (!e->replica) {
+			e->stored = time(NULL);
+		}
+		e->expires = now + max_age;
+		e->stale_until = e->expires + (stale > 0 ? stale : 0);
+		e->size = strlen(e->key) + e->headers_len + e->body_len + sizeof(struct cache_entry);
+		e->valid = 1;
+		e->filling = 0;
+		cache_bytes += e->size;
+		if (e->replica) {
+			cache_replica_bytes += e->size;
+		}
+		cache_lru_front(e);
+		if (old && !old->dead) {
+			cache_unlink(old);
+		}
+
+		/*
+		 * Make room, and keep replicas to their share.
+		 */
+		struct cache_entry * victim = cache_lru_tail;
+		while ((cache_bytes > CACHE_MEMORY || cache_replica_bytes > PEER_REPLICA_MEMORY) && victim) {
+			struct cache_entry * prev = victim->lru_prev;
+			if (victim != e && !victim->filling && !victim->refs &&
+				(cache_bytes > CACHE_MEMORY || victim->replica)) {
+				cache_unlink(victim);
+				STAT_ADD(cache_evictions, 1);
+			}
+			victim = prev;
+		}
+	} else {
+		if (old && !old->dead) {
+			old->filling = 0;
+		}
+		cache_unlink(e);
+	}
+	pthread_cond_broadcast(&cache_cond);
+	pthread_mutex_unlock(&cache_lock);
+	free(vary);
+}
+
+/*
+ * Send a cached response.
+ */
+void cache_serve(FILE * socket_stream, struct cache_entry * e, int head_only) {
+	header_block_t hb;
+	header_begin(&hb, FRAGMENT(STATUS_LINE("200 OK")));
+	header_add_flush(socket_stream, &hb, e->headers, e->headers_len);
+	char age[48];
+	long seconds = (long)(time(NULL) - e->stored);
+	size_t age_len = sprintf(age, "Age: %ld\r\n", seconds > 0 ? seconds : 0);
+	header_add_flush(socket_stream, &hb, age, age_len);
+	header_content_length(&hb, e->body_len);
+	header_end(&hb);
+	send_response(socket_stream, &hb, e->body, head_only ? 0 : e->body_len);
+}
+
+/*
+ * Background refresh of a stale entry: replay the request that
+ * found it stale (rebuilt from the processed queue) to an internal handler, which fills the
+ * placeholder, and throw the response away.
+ */
+struct cache_refresh {
+	struct cache_entry * placeholder;
+	struct socket_request * handler;
+	char *             request;
+	size_t             request_len;
+};
+
+void *cache_refresh_thread(void * arg) {
+	struct cache_refresh * refresh = (struct cache_refresh *)arg;
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		cache_finish(refresh->placeholder, 0, NULL);
+		request_put(refresh->handler);
+		goto _done;
+	}
+	refresh->handler->fd = pair[1];
+	refresh->handler->revalidate = refresh->placeholder;
+	pthread_create(&(refresh->handler->thread), NULL, handleRequest, (void *)(refresh->handler));
+
+	size_t written = 0;
+	while (written < refresh->request_len) {
+		ssize_t w = write(pair[0], refresh->request + written, refresh->request_len - written);
+		if (w <= 0) {
+			break;
+		}
+		written += w;
+	}
+	shutdown(pair[0], SHUT_WR);
+	char discard[4096];
+	while (read(pair[0], discard, sizeof(discard)) > 0);
+	close(pair[0]);
+
+_done:
+	free(refresh->request);
+	free(refresh);
+	return NULL;
+}
+
+void cache_refresh(struct cache_entry * placeholder, vector_t * queue, struct socket_request * request,
+		const char * filename, const char * querystring) {
+	struct cache_refresh * refresh = malloc(sizeof(struct cache_refresh));
+	size_t total = strlen(filename) + (querystring ? strlen(querystring) : 0) + 32;
+	unsigned int i;
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = (const char *)vector_at(queue, i);
+		total += strlen(name) + strlen(name + strlen(name) + 2) + 4;
+	}
+	refresh->request = malloc(total);
+	refresh->request_len = sprintf(refresh->request, "GET %s%s%s HTTP/1.1\r\n", filename,
+			querystring ? "?" : "", querystring ? querystring : "");
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = (const char *)vector_at(queue, i);
+		refresh->request_len += sprintf(refresh->request + refresh->request_len, "%s: %s\r\n",
+				name, name + strlen(name) + 2);
+	}
+	refresh->request_len += sprintf(refresh->request + refresh->request_len, "\r\n");
+
+	refresh->placeholder = placeholder;
+	refresh->handler = request_get();
+	refresh->handler->address = request->address;
+	strcpy(refresh->handler->peer, request->peer);
+	refresh->handler->addr_len = request->addr_len ? request->addr_len : sizeof(request->address);
+	refresh->handler->listener = request->listener;
+	refresh->handler->internal = 1;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, cache_refresh_thread, (void *)refresh);
+	pthread_detach(thread);
+}
+#endif
+
+#if ENABLE_ADMIT
+/*
+ * Admission control.
+ * Each client gets a connection count and a token bucket; the
+ * table is split into stripes so unrelated clients rarely share
+ * a lock. When every slot a client could use is busy with a client
+ * that still has connections open, it goes untracked (we fail open
+ * rather than refuse strangers).
+ */
+struct admit_entry {
+	in_addr_t          addr;        /* Client address, 0 if free */
+	int                connections; /* Open connections */
+	double             tokens;      /* Requests left in the bucket */
+	double             last;        /* Last refill, in seconds */
+};
+
+struct admit_shard {
+	pthread_mutex_t    lock;
+	struct admit_entry slots[ADMIT_SLOTS];
+};
+
+struct admit_shard admit_table[ADMIT_SHARDS];
+
+/*
+ * Limits, from the ADMIT_* defaults and -A.
+ */
+struct admit_options {
+	int                enabled;
+	int                connections;
+	int                rate;
+	int                burst;
+} admit_options = {
+	0, ADMIT_CONNECTIONS, ADMIT_RATE, ADMIT_BURST
+};
+
+/*
+ * Parse a -A argument: name=value[,name=value...]
+ */
+int admit_configure(const char * spec) {
+	static const char * names[] = { "connections", "rate", "burst" };
+	int * values[] = { &admit_options.connections, &admit_options.rate, &admit_options.burst };
+	while (*spec) {
+		size_t len = strcspn(spec, ",");
+		const char * equals = memchr(spec, '=', len);
+		if (!equals) {
+			return -1;
+		}
+		unsigned int i;
+		for (i = 0; i < sizeof(names) / sizeof(*names); ++i) {
+			if (strlen(names[i]) == (size_t)(equals - spec) && !strncmp(spec, names[i], equals - spec)) {
+				break;
+			}
+		}
+		char * end;
+		long value = strtol(equals + 1, &end, 10);
+		if (i == sizeof(names) / sizeof(*names) || end != spec + len || value < 1 || value > INT_MAX) {
+			return -1;
+		}
+		*values[i] = (int)value;
+		spec += len;
+		if (*spec == ',') {
+			spec++;
+		}
+	}
+	if (admit_options.burst < admit_options.rate) {
+		admit_options.burst = admit_options.rate;
+	}
+	admit_options.enabled = 1;
+	return 0;
+}
+
+/*
+ * Whether a client is subject to the limits at all. Loopback
+ * clients are our own tools and local proxies, and aren't.
+ */
+static int admit_tracked(struct sockaddr_in * address) {
+	return admit_options.enabled && address->sin_family == AF_INET &&
+		(ntohl(address->sin_addr.s_addr) >> 24) != 127;
+}
+
+void admit_init(void) {
+	int i;
+	for (i = 0; i < ADMIT_SHARDS; ++i) {
+		pthread_mutex_init(&admit_table[i].lock, NULL);
+	}
+}
+
+static double admit_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned int admit_hash(in_addr_t addr) {
+	unsigned int h = (unsigned int)addr * 2654435761u;
+	return h ^ (h >> 16);
+}
+
+/*
+ * Find (or make room for) a client in its stripe, with the lock held.
+ * Returns NULL if the client can't be tracked right now.
+ */
+static struct admit_entry * admit_find(struct admit_shard * shard, in_addr_t addr, unsigned int h, double now) {
+	struct admit_entry * victim = NULL;
+	int i;
+	for (i = 0; i < ADMIT_PROBE; ++i) {
+		struct admit_entry * e = &shard->slots[(h + i) % ADMIT_SLOTS];
+		if (e->addr == addr) {
+			return e;
+		}
+		if (!e->addr) {
+			if (!victim || victim->addr) {
+				victim = e;
+			}
+		} else if (!e->connections && now - e->last > ADMIT_IDLE) {
+			if (!victim || (victim->addr && e->last < victim->last)) {
+				victim = e;
+			}
+		}
+	}
+	if (victim) {
+		victim->addr = addr;
+		victim->connections = 0;
+		victim->tokens = admit_options.burst;
+		victim->last = now;
+	}
+	return victim;
+}
+
+#define ADMIT_SHARD(h) (&admit_table[((h) >> 24) % ADMIT_SHARDS])
+
+/*
+ * A new connection from a client; returns 0 if it is over its limit.
+ */
+int admit_connection(struct sockaddr_in * address) {
+	if (!admit_tracked(address)) {
+		return 1;
+	}
+	in_addr_t addr = address->sin_addr.s_addr;
+	unsigned int h = admit_hash(addr);
+	struct admit_shard * shard = ADMIT_SHARD(h);
+	int admitted = 1;
+	pthread_mutex_lock(&shard->lock);
+	struct admit_entry * e = admit_find(shard, addr, h, admit_now());
+	if (e) {
+		if (e->connections >= admit_options.connections) {
+			admitted = 0;
+		} else {
+			e->connections++;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (!admitted) {
+		STAT_ADD(refused, 1);
+	}
+	return admitted;
+}
+
+/*
+ * A client's connection closed.
+ */
+void admit_release(struct sockaddr_in * address) {
+	if (!admit_tracked(address)) {
+		return;
+	}
+	in_addr_t addr = address->sin_addr.s_addr;
+	unsigned int h = admit_hash(addr);
+	struct admit_shard * shard = ADMIT_SHARD(h);
+	pthread_mutex_lock(&shard->lock);
+	int i;
+	for (i = 0; i < ADMIT_PROBE; ++i) {
+		struct admit_entry * e = &shard->slots[(h + i) % ADMIT_SLOTS];
+		if (e->addr == addr) {
+			if (e->connections > 0) {
+				e->connections--;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * A request from a client; returns 0 if its bucket is empty.
+ */
+int admit_request(struct sockaddr_in * address) {
+	if (!admit_tracked(address)) {
+		return 1;
+	}
+	in_addr_t addr = address->sin_addr.s_addr;
+	unsigned int h = admit_hash(addr);
+	struct admit_shard * shard = ADMIT_SHARD(h);
+	int admitted = 1;
+	double now = admit_now();
+	pthread_mutex_lock(&shard->lock);
+	struct admit_entry * e = admit_find(shard, addr, h, now);
+	if (e) {
+		e->tokens += (now - e->last) * admit_options.rate;
+		if (e->tokens > admit_options.burst) {
+			e->tokens = admit_options.burst;
+		}
+		e->last = now;
+		if (e->tokens < 1.0) {
+			admitted = 0;
+		} else {
+			e->tokens -= 1.0;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (!admitted) {
+		STAT_ADD(limited, 1);
+	}
+	return admitted;
+}
+
+/*
+ * Turn away a connection from the accept loop, without a thread.
+ */
+void admit_refuse(int fd) {
+	static const char refusal[] = "HTTP/1.1 429 Too Many Requests\r\n"
+		"Server: " VERSION_STRING "\r\n"
+		"Retry-After: 1\r\n"
+		"Connection: close\r\n"
+		"Content-Length: 0\r\n\r\n";
+	send(fd, refusal, sizeof(refusal) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+}
+#endif
+
+#if ENABLE_SCHED
+/*
+ * Scheduling classes.
+ * A handler thread holds a worker in its request's class from when
+ * it knows what the request is until the response is queued. While
+ * static files are waiting, nothing else gets a worker that frees up.
+ */
+#define SCHED_STATIC  0
+#define SCHED_LISTING 1
+#define SCHED_CGI     2
+#define SCHED_MODULE  3
+#define SCHED_PROXY   4
+#define SCHED_CLASSES 5
+
+struct sched_class {
+	const char *       name;
+	int                limit;       /* Requests in progress, at most */
+	int                active;
+	int                peak;
+	int                waiting;
+	pthread_cond_t     cond;        /* Signalled when a waiter may have room */
+	unsigned long      requests;
+	unsigned long      waited;      /* ...that had to wait */
+	unsigned long      shed;        /* ...that waited SCHED_WAIT and gave up */
+	unsigned long      latency[SCHED_BUCKETS]; /* Requests by log2 of microseconds held */
+};
+
+pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+struct sched_class sched_classes[SCHED_CLASSES];
+int sched_active = 0;
+
+void sched_init(void) {
+	static const char * names[SCHED_CLASSES] = { "static", "listing", "cgi", "module", "proxy" };
+	int limits[SCHED_CLASSES] = SCHED_LIMITS;
+	int i;
+	for (i = 0; i < SCHED_CLASSES; ++i) {
+		sched_classes[i].name = names[i];
+		sched_classes[i].limit = limits[i];
+		pthread_cond_init(&sched_classes[i].cond, NULL);
+	}
+}
+
+static double sched_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Whether a class may take a worker now (sched_lock held).
+ */
+static int sched_room(int c) {
+	if (sched_classes[c].active >= sched_classes[c].limit) {
+		return 0;
+	}
+	if (c == SCHED_STATIC) {
+		return sched_active < SCHED_WORKERS;
+	}
+	return sched_active < SCHED_WORKERS - SCHED_RESERVED && !sched_classes[SCHED_STATIC].waiting;
+}
+
+/*
+ * A worker came free: wake one waiter that can use it, static first.
+ */
+static void sched_wake(void) {
+	int i;
+	for (i = 0; i < SCHED_CLASSES; ++i) {
+		if (sched_classes[i].waiting && sched_room(i)) {
+			pthread_cond_signal(&sched_classes[i].cond);
+			return;
+		}
+	}
+}
+
+static void sched_give_back(int c) {
+	sched_classes[c].active--;
+	sched_active--;
+	sched_wake();
+}
+
+/*
+ * Take a worker in class c, giving up the one in *held (if any) and
+ * keeping *start if so. Returns 0, or -1 if the wait ran out and the
+ * request should get a 503; either way *held is up to date.
+ */
+int sched_enter(int c, int * held, double * start) {
+	struct sched_class * k = &sched_classes[c];
+	pthread_mutex_lock(&sched_lock);
+	if (*held >= 0) {
+		sched_give_back(*held);
+		*held = -1;
+	} else {
+		*start = sched_now();
+	}
+	int ok = 1;
+	if (k->waiting || !sched_room(c)) {
+		/*
+		 * Get in line.
+		 */
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += SCHED_WAIT;
+		k->waiting++;
+		k->waited++;
+		while (!sched_room(c)) {
+			if (pthread_cond_timedwait(&k->cond, &sched_lock, &deadline) == ETIMEDOUT) {
+				ok = sched_room(c);
+				break;
+			}
+		}
+		k->waiting--;
+	}
+	if (ok) {
+		sched_active++;
+		if (++k->active > k->peak) {
+			k->peak = k->active;
+		}
+		k->requests++;
+		*held = c;
+	} else {
+		k->shed++;
+	}
+	/*
+	 * There may be room for whoever is next, or a static request
+	 * may have stopped waiting and let other classes through.
+	 */
+	sched_wake();
+	pthread_mutex_unlock(&sched_lock);
+	return ok ? 0 : -1;
+}
+
+/*
+ * Done with the request: give back its worker and note how long it
+ * was held, from when the request was first classed.
+ */
+void sched_leave(int * held, double start) {
+	if (*held < 0) {
+		return;
+	}
+	double elapsed = (sched_now() - start) * 1e6;
+	int bucket = 0;
+	while (bucket < SCHED_BUCKETS - 1 && elapsed >= (double)(2ull << bucket)) {
+		bucket++;
+	}
+	pthread_mutex_lock(&sched_lock);
+	sched_classes[*held].latency[bucket]++;
+	sched_give_back(*held);
+	pthread_mutex_unlock(&sched_lock);
+	*held = -1;
+}
+
+/*
+ * Turn a request away when its class stayed full. A body we won't
+ * read means the connection goes after this.
+ */
+void sched_refuse(FILE * socket_stream, unsigned long c_length) {
+	header_block_t hb;
+	header_begin(&hb, FRAGMENT(STATUS_LINE("503 Service Unavailable")));
+	header_add(&hb, FRAGMENT("Retry-After: 1\r\n"));
+	if (c_length > 0) {
+		header_add(&hb, FRAGMENT("Connection: close\r\n"));
+	}
+	header_content_length(&hb, 0);
+	header_end(&hb);
+	send_response(socket_stream, &hb, NULL, 0);
+}
+
+/*
+ * Upper bound, in milliseconds, of the latency bucket that holds the
+ * given fraction of a class's requests (sched_lock held).
+ */
+static double sched_percentile(struct sched_class * k, double fraction) {
+	unsigned long total = 0, seen = 0;
+	int i;
+	for (i = 0; i < SCHED_BUCKETS; ++i) {
+		total += k->latency[i];
+	}
+	if (!total) {
+		return 0.0;
+	}
+	for (i = 0; i < SCHED_BUCKETS - 1; ++i) {
+		seen += k->latency[i];
+		if (seen >= fraction * total) {
+			break;
+		}
+	}
+	return (double)(2ull << i) / 1000.0;
+}
+#endif
+
+#if ENABLE_PROXY
+/*
+ * Reverse proxy.
+ * Requests under a configured prefix (-x /prefix=host:port,...) are
+ * forwarded to one of the prefix's upstreams, the one with the fewest
+ * requests in flight among those passing health checks. Each upstream
+ * keeps a pool of idle keep-alive connections. Bodies are streamed
+ * through IO_BUFFER at a time in both directions; a response without
+ * a length is re-chunked for HTTP/1.1 clients.
+ */
+struct upstream_conn {
+	int                fd;
+	size_t             start;     /* Unread data in buf */
+	size_t             end;
+	struct upstream_conn * next;  /* Idle list */
+	char               buf[PROXY_BUFFER];
+};
+
+struct upstream {
+	char               name[64];  /* host:port, also our Host: fallback */
+	struct sockaddr_in addr;
+	pthread_mutex_t    lock;      /* Protects the idle list */
+	struct upstream_conn * idle;
+	int                idle_count;
+	int                outstanding; /* Requests in flight (atomic) */
+	int                healthy;     /* Last health check passed (atomic) */
+	unsigned long      requests;
+	unsigned long      failures;
+};
+
+struct proxy_route {
+	char *             prefix;
+	size_t             prefix_len;
+	int                count;
+	unsigned int       next;      /* Where ties start, to spread them */
+	struct upstream *  upstreams[PROXY_UPSTREAMS];
+};
+
+struct proxy_route proxy_routes[PROXY_ROUTES];
+int proxy_route_count = 0;
+struct upstream proxy_upstreams[PROXY_ROUTES * PROXY_UPSTREAMS];
+int proxy_upstream_count = 0;
+
+static struct upstream * proxy_upstream(const char * spec, size_t len) {
+	char name[64];
+	if (len >= sizeof(name)) {
+		return NULL;
+	}
+	memcpy(name, spec, len);
+	name[len] = '\0';
+	int i;
+	for (i = 0; i < proxy_upstream_count; ++i) {
+		if (!strcmp(proxy_upstreams[i].name, name)) {
+			return &proxy_upstreams[i];
+		}
+	}
+	char * colon = strrchr(name, ':');
+	if (!colon || proxy_upstream_count == PROXY_ROUTES * PROXY_UPSTREAMS) {
+		return NULL;
+	}
+	*colon = '\0';
+	struct addrinfo hints, * result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(name, colon + 1, &hints, &result) != 0) {
+		return NULL;
+	}
+	*colon = ':';
+	struct upstream * u = &proxy_upstreams[proxy_upstream_count++];
+	memset(u, 0, sizeof(struct upstream));
+	strcpy(u->name, name);
+	memcpy(&u->addr, result->ai_addr, sizeof(u->addr));
+	freeaddrinfo(result);
+	pthread_mutex_init(&u->lock, NULL);
+	u->healthy = 1;
+	return u;
+}
+
+/*
+ * Parse a -x argument: /prefix=host:port[,host:port...]
+ */
+int proxy_add_route(const char * spec) {
+	const char * equals = strchr(spec, '=');
+	if (spec[0] != '/' || !equals || proxy_route_count == PROXY_ROUTES) {
+		return -1;
+	}
+	struct proxy_route * route = &proxy_routes[proxy_route_count];
+	route->prefix = strndup(spec, equals - spec);
+	route->prefix_len = equals - spec;
+	route->count = 0;
+	const char * host = equals + 1;
+	while (*host) {
+		size_t len = strcspn(host, ",");
+		if (route->count == PROXY_UPSTREAMS) {
+			return -1;
+		}
+		struct upstream * u = proxy_upstream(host, len);
+		if (!u) {
+			return -1;
+		}
+		route->upstreams[route->count++] = u;
+		host += len;
+		if (*host == ',') {
+			host++;
+		}
+	}
+	if (!route->count) {
+		return -1;
+	}
+	proxy_route_count++;
+	return 0;
+}
+
+/*
+ * Longest prefix that covers this path, at a path boundary.
+ */
+struct proxy_route * proxy_match(const char * filename) {
+	struct proxy_route * best = NULL;
+	int i;
+	for (i = 0; i < proxy_route_count; ++i) {
+		struct proxy_route * route = &proxy_routes[i];
+		if (!path_under(filename, route->prefix, route->prefix_len)) {
+			continue;
+		}
+		if (!best || route->prefix_len > best->prefix_len) {
+			best = route;
+		}
+	}
+	return best;
+}
+
+/*
+ * Least outstanding requests among healthy upstreams, not counting
+ * any we already gave up on for this request (`skip` is a bitmask).
+ */
+static struct upstream * proxy_pick(struct proxy_route * route, unsigned int skip) {
+	struct upstream * best = NULL;
+	int best_outstanding = 0;
+	unsigned int start = __atomic_fetch_add(&route->next, 1, __ATOMIC_RELAXED);
+	int i;
+	for (i = 0; i < route->count; ++i) {
+		int index = (start + i) % route->count;
+		struct upstream * u = route->upstreams[index];
+		if ((skip & (1u << index)) || !__atomic_load_n(&u->healthy, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		int outstanding = __atomic_load_n(&u->outstanding, __ATOMIC_RELAXED);
+		if (!best || outstanding < best_outstanding) {
+			best = u;
+			best_outstanding = outstanding;
+		}
+	}
+	return best;
+}
+
+static int proxy_index(struct proxy_route * route, struct upstream * u) {
+	int i;
+	for (i = 0; i < route->count; ++i) {
+		if (route->upstreams[i] == u) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+static int upstream_connect(struct upstream * u) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct timeval timeout = { PROXY_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&u->addr, sizeof(u->addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * An idle pooled connection, or a new one. *reused says which.
+ */
+static struct upstream_conn * upstream_get(struct upstream * u, int * reused) {
+	pthread_mutex_lock(&u->lock);
+	struct upstream_conn * c = u->idle;
+	if (c) {
+		u->idle = c->next;
+		u->idle_count--;
+	}
+	pthread_mutex_unlock(&u->lock);
+	if (c) {
+		*reused = 1;
+		return c;
+	}
+	*reused = 0;
+	int fd = upstream_connect(u);
+	if (fd < 0) {
+		return NULL;
+	}
+	c = malloc(sizeof(struct upstream_conn));
+	c->fd = fd;
+	c->start = c->end = 0;
+	return c;
+}
+
+static void upstream_close(struct upstream_conn * c) {
+	close(c->fd);
+	free(c);
+}
+
+static void upstream_put(struct upstream * u, struct upstream_conn * c) {
+	c->start = c->end = 0;
+	pthread_mutex_lock(&u->lock);
+	if (u->idle_count < PROXY_IDLE) {
+		c->next = u->idle;
+		u->idle = c;
+		u->idle_count++;
+		c = NULL;
+	}
+	pthread_mutex_unlock(&u->lock);
+	if (c) {
+		upstream_close(c);
+	}
+}
+
+static int upstream_write(struct upstream_conn * c, const char * data, size_t len) {
+	while (len) {
+		ssize_t sent = send(c->fd, data, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+static int upstream_fill(struct upstream_conn * c) {
+	if (c->start < c->end) {
+		return 1;
+	}
+	ssize_t r;
+	do {
+		r = read(c->fd, c->buf, PROXY_BUFFER);
+	} while (r < 0 && errno == EINTR);
+	if (r <= 0) {
+		return (int)r;
+	}
+	c->start = 0;
+	c->end = r;
+	return 1;
+}
+
+/*
+ * Read a line (with its newline) into out; returns its length,
+ * 0 on a clean EOF and -1 on errors or overlong lines.
+ */
+static ssize_t upstream_getline(struct upstream_conn * c, char * out, size_t max) {
+	size_t len = 0;
+	while (1) {
+		int r = upstream_fill(c);
+		if (r <= 0) {
+			return len ? -1 : r;
+		}
+		while (c->start < c->end) {
+			if (len == max - 1) {
+				return -1;
+			}
+			char ch = c->buf[c->start++];
+			out[len++] = ch;
+			if (ch == '\n') {
+				out[len] = '\0';
+				return len;
+			}
+		}
+	}
+}
+
+/*
+ * Read up to max bytes of body.
+ */
+static ssize_t upstream_read(struct upstream_conn * c, char * out, size_t max) {
+	if (c->start < c->end) {
+		size_t len = c->end - c->start;
+		if (len > max) {
+			len = max;
+		}
+		memcpy(out, c->buf + c->start, len);
+		c->start += len;
+		return len;
+	}
+	ssize_t r;
+	do {
+		r = read(c->fd, out, max);
+	} while (r < 0 && errno == EINTR);
+	return r;
+}
+
+/*
+ * Headers that describe a single hop and must not be forwarded.
+ */
+static int proxy_hop_header(const char * name) {
+	return !strcasecmp(name, "Connection") || !strcasecmp(name, "Keep-Alive") ||
+		!strcasecmp(name, "Proxy-Connection") || !strcasecmp(name, "Transfer-Encoding") ||
+		!strcasecmp(name, "TE") || !strcasecmp(name, "Trailer") || !strcasecmp(name, "Upgrade") ||
+		!strcasecmp(name, "Expect");
+}
+
+/*
+ * Health checks: ask every upstream for PROXY_HEALTH_PATH now and
+ * then; anything short of a 5xx (or no answer) counts as healthy.
+ */
+void *proxy_health(void * unused) {
+	(void)unused;
+	while (1) {
+		sleep(PROXY_HEALTH_INTERVAL);
+		int i;
+		for (i = 0; i < proxy_upstream_count; ++i) {
+			struct upstream * u = &proxy_upstreams[i];
+			int healthy = 0;
+			int fd = upstream_connect(u);
+			if (fd >= 0) {
+				char check[256];
+				int len = snprintf(check, sizeof(check), "GET " PROXY_HEALTH_PATH " HTTP/1.1\r\n"
+						"Host: %s\r\nUser-Agent: " VERSION_STRING "\r\nConnection: close\r\n\r\n", u->name);
+				char status[16];
+				if (send(fd, check, len, MSG_NOSIGNAL) == len && recv(fd, status, 12, MSG_WAITALL) == 12 &&
+					!strncmp(status, "HTTP/1.", 7) && status[9] < '5') {
+					healthy = 1;
+				}
+				close(fd);
+			}
+			if (!healthy) {
+				/*
+				 * Whatever is in the pool is from before it went away.
+				 */
+				pthread_mutex_lock(&u->lock);
+				struct upstream_conn * idle = u->idle;
+				u->idle = NULL;
+				u->idle_count = 0;
+				pthread_mutex_unlock(&u->lock);
+				while (idle) {
+					struct upstream_conn * next = idle->next;
+					upstream_close(idle);
+					idle = next;
+				}
+			}
+			if (healthy != __atomic_exchange_n(&u->healthy, healthy, __ATOMIC_RELAXED)) {
+				printf("[info] Upstream %s is %s.\n", u->name, healthy ? "back up" : "down");
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Forward a request (whose headers handleRequest has already split
+ * up in `queue`) and relay the response. Returns 0 if the client
+ * connection can be reused, -1 if it should be closed.
+ */
+int proxy_request(struct socket_request * request, FILE * socket_stream, struct proxy_route * route,
+		vector_t * queue, int request_type, const char * filename, const char * querystring,
+		const char * http_version, unsigned long c_length, char * buf) {
+	/*
+	 * Rebuild the request head.
+	 */
+	const char * method = request_type == 2 ? "POST" : (request_type == 3 ? "HEAD" : "GET");
+	size_t total = strlen(filename) + (querystring ? strlen(querystring) : 0) + 256;
+	unsigned int i;
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = (const char *)vector_at(queue, i);
+		total += strlen(name) + strlen(name + strlen(name) + 2) + 4;
+	}
+	char * head = arena_alloc(&request->arena, total);
+	size_t head_len = sprintf(head, "%s %s%s%s HTTP/1.1\r\n", method, filename,
+			querystring ? "?" : "", querystring ? querystring : "");
+	int has_host = 0;
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = (const char *)vector_at(queue, i);
+		if (proxy_hop_header(name)) {
+			continue;
+		}
+		if (!strcasecmp(name, "Host")) {
+			has_host = 1;
+		}
+		head_len += sprintf(head + head_len, "%s: %s\r\n", name, name + strlen(name) + 2);
+	}
+	if (request->peer[0]) {
+		head_len += sprintf(head + head_len, "X-Forwarded-For: %s\r\n", request->peer);
+	}
+#if ENABLE_TLS
+	head_len += sprintf(head + head_len, "X-Forwarded-Proto: %s\r\n",
+			request->listener && request->listener->tls ? "https" : "http");
+#endif
+
+	/*
+	 * Find an upstream that will take it. A pooled connection that
+	 * turns out to be closed is retried on a fresh one, as long as
+	 * there was no body to replay.
+	 */
+	unsigned int skip = 0;
+	struct upstream * u = NULL;
+	struct upstream_conn * c = NULL;
+	char * line = buf;
+	ssize_t line_len = 0;
+	while (1) {
+		u = proxy_pick(route, skip);
+		if (!u) {
+			generic_response(socket_stream, "502 Bad Gateway", "No upstream server is available.");
+			return c_length ? -1 : 0;
+		}
+		int reused;
+		c = upstream_get(u, &reused);
+		if (!c) {
+			__atomic_add_fetch(&u->failures, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&u->healthy, 0, __ATOMIC_RELAXED);
+			skip |= 1u << proxy_index(route, u);
+			continue;
+		}
+		__atomic_add_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&u->requests, 1, __ATOMIC_RELAXED);
+		char tail[96];
+		size_t tail_len = has_host ? (size_t)sprintf(tail, "\r\n") : (size_t)sprintf(tail, "Host: %s\r\n\r\n", u->name);
+		int ok = upstream_write(c, head, head_len) == 0 && upstream_write(c, tail, tail_len) == 0;
+		if (ok && c_length) {
+			/*
+			 * Stream the request body through.
+			 */
+			unsigned long sent = 0;
+			while (sent < c_length) {
+				size_t want = c_length - sent > IO_BUFFER ? IO_BUFFER : c_length - sent;
+				size_t got = fread(buf, 1, want, socket_stream);
+				if (!got) {
+					upstream_close(c);
+					__atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+					return -1;
+				}
+				if (upstream_write(c, buf, got) < 0) {
+					ok = 0;
+					break;
+				}
+				sent += got;
+			}
+		}
+		if (ok) {
+			line_len = upstream_getline(c, line, HEADER_SIZE);
+		}
+		if (ok && line_len > 0) {
+			break;
+		}
+		upstream_close(c);
+		__atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+		if (reused && !c_length && !(line_len < 0 && errno == EAGAIN)) {
+			continue;
+		}
+		__atomic_add_fetch(&u->failures, 1, __ATOMIC_RELAXED);
+		if (line_len < 0 && errno == EAGAIN) {
+			generic_response(socket_stream, "504 Gateway Timeout", "The upstream server did not answer in time.");
+		} else {
+			generic_response(socket_stream, "502 Bad Gateway", "The upstream server did not answer.");
+		}
+		return c_length ? -1 : 0;
+	}
+
+	/*
+	 * Status line and headers. Interim (1xx) responses are dropped.
+	 */
+	header_block_t hb;
+	int code = 0;
+	int upstream_keep = 1;
+	long resp_length = -1;
+	int chunked = 0;
+	while (1) {
+		if (strncmp(line, "HTTP/1.", 7) || line_len < 12) {
+			goto _bad_upstream;
+		}
+		upstream_keep = line[7] != '0';
+		code = atoi(line + 9);
+		hb.len = 0;
+		header_add(&hb, FRAGMENT("HTTP/1.1 "));
+		header_add(&hb, line + 9, strcspn(line + 9, "\r\n"));
+		header_add(&hb, FRAGMENT("\r\n"));
+		if (response_close) {
+			header_add(&hb, FRAGMENT("Connection: close\r\n"));
+		}
+		resp_length = -1;
+		chunked = 0;
+		while (1) {
+			line_len = upstream_getline(c, line, HEADER_SIZE);
+			if (line_len <= 0) {
+				goto _bad_upstream;
+			}
+			if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+				break;
+			}
+			char * colon = strchr(line, ':');
+			if (!colon) {
+				goto _bad_upstream;
+			}
+			*colon = '\0';
+			char * value = colon + 1;
+			while (*value == ' ') {
+				value++;
+			}
+			if (!strcasecmp(line, "Content-Length")) {
+				resp_length = atol(value);
+				continue;
+			}
+			if (!strcasecmp(line, "Transfer-Encoding")) {
+				chunked = strstr(value, "chunked") != NULL;
+				continue;
+			}
+			if (!strcasecmp(line, "Connection") || !strcasecmp(line, "Proxy-Connection")) {
+				if (strstr(value, "close")) {
+					upstream_keep = 0;
+				} else if (strstr(value, "keep-alive")) {
+					upstream_keep = 1;
+				}
+				continue;
+			}
+			if (proxy_hop_header(line)) {
+				continue;
+			}
+			*colon = ':';
+			header_add_flush(socket_stream, &hb, line, line_len);
+		}
+		if (code >= 100 && code < 200) {
+			line_len = upstream_getline(c, line, HEADER_SIZE);
+			if (line_len <= 0) {
+				goto _bad_upstream;
+			}
+			continue;
+		}
+		break;
+	}
+	if (chunked) {
+		resp_length = -1;
+	}
+
+	/*
+	 * Body.
+	 */
+	int has_body = request_type != 3 && code != 204 && code != 304;
+	int client_keep = 1;
+	int raw = 1;
+	int complete = 1;
+	if (!has_body) {
+		if (resp_length >= 0) {
+			header_content_length(&hb, resp_length);
+		}
+		header_end(&hb);
+		send_response(socket_stream, &hb, NULL, 0);
+	} else if (resp_length >= 0) {
+		header_content_length(&hb, resp_length);
+		header_end(&hb);
+		long left = resp_length;
+		while (left > 0) {
+			ssize_t r = upstream_read(c, buf, left > IO_BUFFER ? IO_BUFFER : left);
+			if (r <= 0) {
+				complete = 0;
+				break;
+			}
+			if (send_chunk(socket_stream, &hb, 1, buf, r) < 0) {
+				complete = 0;
+				break;
+			}
+			left -= r;
+		}
+		if (hb.len) {
+			send_response(socket_stream, &hb, NULL, 0);
+		}
+	} else {
+		if (!strcmp(http_version, "HTTP/1.1")) {
+			header_add_flush(socket_stream, &hb, FRAGMENT("Transfer-Encoding: chunked\r\n\r\n"));
+			raw = 0;
+		} else {
+			header_add_flush(socket_stream, &hb, FRAGMENT("Connection: close\r\n\r\n"));
+			client_keep = 0;
+		}
+		if (chunked) {
+			while (1) {
+				line_len = upstream_getline(c, line, HEADER_SIZE);
+				if (line_len <= 0) {
+					complete = 0;
+					break;
+				}
+				unsigned long size = strtoul(line, NULL, 16);
+				if (!size) {
+					/*
+					 * Skip any trailers.
+					 */
+					while ((line_len = upstream_getline(c, line, HEADER_SIZE)) > 0 &&
+						strcmp(line, "\r\n") && strcmp(line, "\n"));
+					complete = line_len > 0;
+					break;
+				}
+				while (size && complete) {
+					ssize_t r = upstream_read(c, buf, size > IO_BUFFER ? IO_BUFFER : size);
+					if (r <= 0 || send_chunk(socket_stream, &hb, raw, buf, r) < 0) {
+						complete = 0;
+						break;
+					}
+					size -= r;
+				}
+				if (!complete || upstream_getline(c, line, HEADER_SIZE) <= 0) {
+					complete = 0;
+					break;
+				}
+			}
+		} else {
+			/*
+			 * Body runs until the upstream closes.
+			 */
+			ssize_t r;
+			while ((r = upstream_read(c, buf, IO_BUFFER)) > 0) {
+				if (send_chunk(socket_stream, &hb, raw, buf, r) < 0) {
+					complete = 0;
+					break;
+				}
+			}
+			upstream_keep = 0;
+		}
+		if (complete && !raw) {
+			send_chunk(socket_stream, &hb, raw, NULL, 0);
+		} else if (hb.len) {
+			send_response(socket_stream, &hb, NULL, 0);
+		}
+	}
+
+	__atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+	if (complete && upstream_keep) {
+		upstream_put(u, c);
+	} else {
+		upstream_close(c);
+	}
+	return complete && client_keep ? 0 : -1;
+
+_bad_upstream:
+	__atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&u->failures, 1, __ATOMIC_RELAXED);
+	upstream_close(c);
+	generic_response(socket_stream, "502 Bad Gateway", "The upstream server sent a malformed response.");
+	return -1;
+}
+#endif
+
+#if ENABLE_PEERS
+/*
+ * Cluster cache.
+ * Servers started with the same -C list (each naming itself first,
+ * the others in any order) agree on which of them owns each CGI
+ * cache key: the one with the highest rendezvous score for it, among
+ * those passing health checks. A server that misses on a key owned
+ * elsewhere asks the owner, with PEER_HEADER set so the owner answers
+ * from its own cache or runs the script itself rather than passing
+ * the request on. The answer is kept here as a replica, for at most
+ * PEER_REPLICA_TTL seconds and within PEER_REPLICA_MEMORY, so a hot
+ * key doesn't send every request across. If the owner can't answer
+ * with a 200, the script runs here after all.
+ */
+struct peer_node {
+	struct upstream *  upstream;  /* NULL for ourselves */
+	uint64_t           seed;      /* Hash of the node's host:port */
+};
+
+struct peer_node peer_nodes[PEER_NODES];
+int peer_count = 0;
+
+/*
+ * FNV-1a, then a finalizer (from splitmix64) so that scores for
+ * similar keys and names don't come out ordered.
+ */
+static uint64_t peer_hash(const char * data, size_t len) {
+	uint64_t h = 14695981039346656037ull;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+	}
+	return h;
+}
+
+static uint64_t peer_mix(uint64_t x) {
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+/*
+ * Parse a -C argument: self-host:port,host:port[,host:port...]
+ */
+int peer_configure(const char * spec) {
+	peer_count = 0;
+	while (*spec) {
+		size_t len = strcspn(spec, ",");
+		if (!len || peer_count == PEER_NODES) {
+			return -1;
+		}
+		struct peer_node * node = &peer_nodes[peer_count];
+		node->upstream = NULL;
+		if (peer_count) {
+			node->upstream = proxy_upstream(spec, len);
+			if (!node->upstream) {
+				return -1;
+			}
+		} else if (!memchr(spec, ':', len)) {
+			return -1;
+		}
+		node->seed = peer_hash(spec, len);
+		peer_count++;
+		spec += len;
+		if (*spec == ',') {
+			spec++;
+		}
+	}
+	return peer_count > 1 ? 0 : -1;
+}
+
+/*
+ * Who owns a key: NULL if we do.
+ */
+struct upstream * peer_owner(const char * key) {
+	uint64_t h = peer_hash(key, strlen(key));
+	struct peer_node * best = NULL;
+	uint64_t best_score = 0;
+	int i;
+	for (i = 0; i < peer_count; ++i) {
+		struct peer_node * node = &peer_nodes[i];
+		if (node->upstream && !__atomic_load_n(&node->upstream->healthy, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		uint64_t score = peer_mix(h ^ node->seed);
+		if (!best || score > best_score) {
+			best = node;
+			best_score = score;
+		}
+	}
+	return best ? best->upstream : NULL;
+}
+
+/*
+ * Undo a fetch that didn't work out, so the script can fill it.
+ */
+static void peer_reset(struct cache_entry * e) {
+	free(e->headers);
+	free(e->body);
+	e->headers = e->body = NULL;
+	e->headers_len = e->body_len = e->alloc = 0;
+	e->oversize = 0;
+	e->replica = 0;
+	e->stored = 0;
+}
+
+/*
+ * Fill a placeholder from the key's owner, send it to the client and
+ * finish it. Returns 0 if the client got the owner's response, or -1
+ * if nothing was sent and the placeholder is still ours to fill.
+ */
+int peer_fetch(struct socket_request * request, FILE * socket_stream, struct upstream * u,
+		struct cache_entry * e, vector_t * queue, const char * filename, const char * querystring, char * buf) {
+	size_t total = strlen(filename) + (querystring ? strlen(querystring) : 0) + 256;
+	unsigned int i;
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = (const char *)vector_at(queue, i);
+		total += strlen(name) + strlen(name + strlen(name) + 2) + 4;
+	}
+	char * head = arena_alloc(&request->arena, total);
+	size_t head_len = sprintf(head, "GET %s%s%s HTTP/1.1\r\n", filename,
+			querystring ? "?" : "", querystring ? querystring : "");
+	int has_host = 0;
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = (const char *)vector_at(queue, i);
+		if (proxy_hop_header(name)) {
+			continue;
+		}
+		if (!strcasecmp(name, "Host")) {
+			has_host = 1;
+		}
+		head_len += sprintf(head + head_len, "%s: %s\r\n", name, name + strlen(name) + 2);
+	}
+	if (request->peer[0]) {
+		head_len += sprintf(head + head_len, "X-Forwarded-For: %s\r\n", request->peer);
+	}
+	head_len += sprintf(head + head_len, PEER_HEADER ": 1\r\n");
+	if (!has_host) {
+		head_len += sprintf(head + head_len, "Host: %s\r\n", u->name);
+	}
+	head_len += sprintf(head + head_len, "\r\n");
+
+	/*
+	 * A pooled connection the owner has since closed gets one retry
+	 * on a fresh one.
+	 */
+	struct upstream_conn * c = NULL;
+	char * line = buf;
+	ssize_t line_len = 0;
+	int reused = 0;
+	do {
+		c = upstream_get(u, &reused);
+		if (!c) {
+			__atomic_add_fetch(&u->failures, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&u->healthy, 0, __ATOMIC_RELAXED);
+			STAT_ADD(peer_fallbacks, 1);
+			return -1;
+		}
+		__atomic_add_fetch(&u->requests, 1, __ATOMIC_RELAXED);
+		line_len = -1;
+		if (upstream_write(c, head, head_len) == 0) {
+			line_len = upstream_getline(c, line, HEADER_SIZE);
+		}
+		if (line_len > 0) {
+			break;
+		}
+		upstream_close(c);
+		c = NULL;
+	} while (reused && !(line_len < 0 && errno == EAGAIN));
+	if (!c) {
+		__atomic_add_fetch(&u->failures, 1, __ATOMIC_RELAXED);
+		STAT_ADD(peer_fallbacks, 1);
+		return -1;
+	}
+	__atomic_add_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+
+	/*
+	 * Only a 200 is worth having; the headers are kept the way the
+	 * script sent them, less what describes the owner's connection.
+	 */
+	int keep = line_len >= 12 && !strncmp(line, "HTTP/1.", 7) && line[7] != '0';
+	long length = -1;
+	int chunked = 0;
+	if (line_len < 12 || strncmp(line, "HTTP/1.", 7) || atoi(line + 9) != 200) {
+		goto _give_up;
+	}
+	while (1) {
+		line_len = upstream_getline(c, line, HEADER_SIZE);
+		if (line_len <= 0) {
+			goto _give_up;
+		}
+		if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+			break;
+		}
+		char * colon = strchr(line, ':');
+		if (!colon) {
+			goto _give_up;
+		}
+		*colon = '\0';
+		char * value = colon + 1;
+		while (*value == ' ') {
+			value++;
+		}
+		if (!strcasecmp(line, "Content-Length")) {
+			length = atol(value);
+		} else if (!strcasecmp(line, "Transfer-Encoding")) {
+			chunked = strstr(value, "chunked") != NULL;
+		} else if (!strcasecmp(line, "Connection")) {
+			keep = strstr(value, "close") == NULL;
+		} else if (!strcasecmp(line, "Age")) {
+			e->stored = -atol(value);
+		} else if (strcasecmp(line, "Date") && strcasecmp(line, "Server") && !proxy_hop_header(line)) {
+			*colon = ':';
+			cache_capture(e, 0, line, line_len);
+		}
+	}
+
+	/*
+	 * Body, into the placeholder.
+	 */
+	if (chunked) {
+		while (1) {
+			line_len = upstream_getline(c, line, HEADER_SIZE);
+			if (line_len <= 0) {
+				goto _give_up;
+			}
+			unsigned long size = strtoul(line, NULL, 16);
+			if (!size) {
+				while ((line_len = upstream_getline(c, line, HEADER_SIZE)) > 0 &&
+					strcmp(line, "\r\n") && strcmp(line, "\n"));
+				if (line_len <= 0) {
+					goto _give_up;
+				}
+				break;
+			}
+			while (size) {
+				ssize_t r = upstream_read(c, buf, size > IO_BUFFER ? IO_BUFFER : size);
+				if (r <= 0) {
+					goto _give_up;
+				}
+				cache_capture(e, 1, buf, r);
+				size -= r;
+			}
+			if (e->oversize || upstream_getline(c, line, HEADER_SIZE) <= 0) {
+				goto _give_up;
+			}
+		}
+	} else if (length >= 0) {
+		while (length > 0 && !e->oversize) {
+			ssize_t r = upstream_read(c, buf, length > IO_BUFFER ? IO_BUFFER : length);
+			if (r <= 0) {
+				goto _give_up;
+			}
+			cache_capture(e, 1, buf, r);
+			length -= r;
+		}
+	} else {
+		ssize_t r;
+		while (!e->oversize && (r = upstream_read(c, buf, IO_BUFFER)) > 0) {
+			cache_capture(e, 1, buf, r);
+		}
+		keep = 0;
+	}
+	if (e->oversize) {
+		goto _give_up;
+	}
+
+	__atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+	if (keep) {
+		upstream_put(u, c);
+	} else {
+		upstream_close(c);
+	}
+	STAT_ADD(peer_fetches, 1);
+	e->replica = 1;
+	e->stored += time(NULL);
+	cache_serve(socket_stream, e, 0);
+	cache_finish(e, 1, queue);
+	return 0;
+
+_give_up:
+	__atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+	upstream_close(c);
+	peer_reset(e);
+	STAT_ADD(peer_fallbacks, 1);
+	return -1;
+}
+#endif
+
+#if ENABLE_STATUS
+/*
+ * Only local clients get to see the status page.
+ */
+int status_allowed(struct socket_request * request) {
+	return request->address.sin_family == AF_INET &&
+		(ntohl(request->address.sin_addr.s_addr) >> 24) == 127;
+}
+
+/*
+ * Append to the status page, stopping at the end of the buffer
+ * rather than letting len run past it.
+ */
+size_t status_printf(char * out, size_t size, size_t len, const char * fmt, ...) {
+	if (len >= size - 1) {
+		return len;
+	}
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(out + len, size - len, fmt, args);
+	va_end(args);
+	if (n < 0) {
+		return len;
+	}
+	return (size_t)n >= size - len ? size - 1 : len + n;
+}
+
+/*
+ * Plain-text status page.
+ */
+void status_page(FILE * socket_stream, int head_only) {
+	char out[16384];
+	size_t len = 0;
+	unsigned long requests = STAT_GET(requests);
+	unsigned long request_heap = STAT_GET(request_heap);
+	len = status_printf(out, sizeof(out), len,
+			"connections: %lu\n"
+			"accept_wakeups: %lu\n"
+			"requests: %lu\n"
+			"heap_calls: %lu\n"
+			"request_heap_calls: %lu\n"
+			"heap_calls_per_request: %.3f\n",
+			STAT_GET(connections), STAT_GET(accept_wakeups), requests,
+			__atomic_load_n(&stat_heap_calls, __ATOMIC_RELAXED),
+			request_heap, requests ? (double)request_heap / requests : 0.0);
+	pthread_mutex_lock(&io_pool_lock);
+	len = status_printf(out, sizeof(out), len, "io_buffers_idle: %d\n", io_pool_count);
+	pthread_mutex_unlock(&io_pool_lock);
+	pthread_mutex_lock(&request_pool_lock);
+	len = status_printf(out, sizeof(out), len, "connections_idle: %d\n", request_pool_count);
+	pthread_mutex_unlock(&request_pool_lock);
+	len = status_printf(out, sizeof(out), len, "bodies_refused: %lu\n", STAT_GET(too_large));
+#if ENABLE_ADMIT
+	len = status_printf(out, sizeof(out), len,
+			"admit_refused: %lu\n"
+			"admit_limited: %lu\n",
+			STAT_GET(refused), STAT_GET(limited));
+#endif
+#if ENABLE_CGI
+	pthread_mutex_lock(&cgi_lock);
+	len = status_printf(out, sizeof(out), len,
+			"cgi_running: %d\n"
+			"cgi_queue_depth: %d\n"
+			"cgi_queue_peak: %d\n",
+			cgi_running, cgi_queue_depth, cgi_queue_peak);
+	pthread_mutex_unlock(&cgi_lock);
+	len = status_printf(out, sizeof(out), len,
+			"cgi_queued: %lu\n"
+			"cgi_shed: %lu\n"
+			"cgi_timeouts: %lu\n",
+			STAT_GET(cgi_queued), STAT_GET(cgi_shed), STAT_GET(cgi_timeouts));
+#endif
+#if ENABLE_MICROCACHE
+	pthread_mutex_lock(&cache_lock);
+	len = status_printf(out, sizeof(out), len,
+			"cache_entries: %d\n"
+			"cache_bytes: %zu\n",
+			cache_entries, cache_bytes);
+	pthread_mutex_unlock(&cache_lock);
+	len = status_printf(out, sizeof(out), len,
+			"cache_hits: %lu\n"
+			"cache_stale: %lu\n"
+			"cache_misses: %lu\n"
+			"cache_coalesced: %lu\n"
+			"cache_evictions: %lu\n",
+			STAT_GET(cache_hits), STAT_GET(cache_stale), STAT_GET(cache_misses),
+			STAT_GET(cache_coalesced), STAT_GET(cache_evictions));
+#if ENABLE_PEERS
+	len = status_printf(out, sizeof(out), len,
+			"peer_fetches: %lu\n"
+			"peer_fallbacks: %lu\n"
+			"peer_served: %lu\n",
+			STAT_GET(peer_fetches), STAT_GET(peer_fallbacks), STAT_GET(peer_served));
+#endif
+#endif
+#if ENABLE_SCHED
+	int c;
+	pthread_mutex_lock(&sched_lock);
+	for (c = 0; c < SCHED_CLASSES; ++c) {
+		struct sched_class * k = &sched_classes[c];
+		len = status_printf(out, sizeof(out), len,
+				"class %s: active=%d peak=%d limit=%d requests=%lu waited=%lu shed=%lu p50_ms=%.3f p99_ms=%.3f\n",
+				k->name, k->active, k->peak, k->limit, k->requests, k->waited, k->shed,
+				sched_percentile(k, 0.5), sched_percentile(k, 0.99));
+	}
+	pthread_mutex_unlock(&sched_lock);
+#endif
+#if ENABLE_PROXY
+	int u;
+	for (u = 0; u < proxy_upstream_count; ++u) {
+		struct upstream * up = &proxy_upstreams[u];
+		pthread_mutex_lock(&up->lock);
+		int idle = up->idle_count;
+		pthread_mutex_unlock(&up->lock);
+		len = status_printf(out, sizeof(out), len,
+				"upstream %s: healthy=%d outstanding=%d idle=%d requests=%lu failures=%lu\n",
+				up->name, __atomic_load_n(&up->healthy, __ATOMIC_RELAXED),
+				__atomic_load_n(&up->outstanding, __ATOMIC_RELAXED), idle,
+				__atomic_load_n(&up->requests, __ATOMIC_RELAXED),
+				__atomic_load_n(&up->failures, __ATOMIC_RELAXED));
+	}
+#endif
+
+	header_block_t hb;
+	header_begin(&hb, FRAGMENT(STATUS_LINE("200 OK")));
+	header_add(&hb, FRAGMENT("Content-Type: text/plain\r\nCache-Control: no-store\r\n"));
+	header_content_length(&hb, len);
+	header_end(&hb);
+	send_response(socket_stream, &hb, out, head_only ? 0 : len);
+}
+#endif
+
+#if ENABLE_PROFILER
+/*
+ * Sampling profiler.
+ * With -p, a local client can ask PROFILE_PATH to sample the handler
+ * threads for a while (?seconds=10&hz=99) and gets back folded
+ * stacks, one "main;handleRequest;send_file 12" line per stack, as
+ * flamegraph.pl and speedscope take them. Each handler thread that
+ * starts a request during a profile arms a CPU-time timer of its
+ * own, so idle threads cost nothing and busy ones are sampled in
+ * proportion to the CPU they burn; the first tick comes at a random
+ * point in the interval, so short-lived connections are sampled
+ * fairly too. The SIGPROF handler only stores a backtrace in a slot
+ * the thread holds, out of a buffer set aside at startup; slots are
+ * handed on as threads exit, and frames are named once the profile
+ * is over. Between profiles a request pays one load and compare.
+ */
+struct profile_slot {
+	unsigned long      owner;       /* Profile of the thread holding it, or 0 */
+	unsigned int       count;       /* Samples taken */
+	unsigned int       dropped;     /* ...and not kept, the slot being full */
+	unsigned char      depth[PROFILE_SAMPLES];
+	void *             frames[PROFILE_SAMPLES][PROFILE_DEPTH];
+};
+
+int profile_enabled = 0;
+unsigned long profile_session = 0;      /* Profile running now, or 0 */
+unsigned long profile_sessions = 0;     /* Profiles taken so far */
+unsigned int profile_hz = PROFILE_HZ;
+unsigned long profile_threads = 0;      /* Threads sampled in this profile */
+unsigned long profile_unsampled = 0;    /* ...and not, for want of a slot */
+struct profile_slot * profile_slots = NULL;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER; /* One profile at a time */
+pthread_key_t profile_key;
+
+static __thread unsigned long profile_seen = 0; /* Profile this thread last looked at */
+static __thread struct profile_slot * profile_self = NULL;
+static __thread timer_t profile_timer;
+static __thread int profile_has_timer = 0;
+static __thread unsigned int profile_seed = 0;
+
+static void profile_disarm(void) {
+	struct itimerspec off;
+	memset(&off, 0, sizeof(off));
+	timer_settime(profile_timer, 0, &off, NULL);
+}
+
+/*
+ * SIGPROF. backtrace() has been called once already, so it won't
+ * load anything (or allocate) in here.
+ */
+static void profile_signal(int sig, siginfo_t * info, void * context) {
+	(void)sig;
+	(void)info;
+	(void)context;
+	int saved = errno;
+	struct profile_slot * slot = profile_self;
+	if (!slot || profile_seen != __atomic_load_n(&profile_session, __ATOMIC_RELAXED)) {
+		/*
+		 * The profile is over.
+		 */
+		if (profile_has_timer) {
+			profile_disarm();
+		}
+	} else if (slot->count < PROFILE_SAMPLES) {
+		unsigned int n = slot->count;
+		slot->depth[n] = backtrace(slot->frames[n], PROFILE_DEPTH);
+		__atomic_store_n(&slot->count, n + 1, __ATOMIC_RELEASE);
+	} else {
+		slot->dropped++;
+	}
+	errno = saved;
+}
+
+/*
+ * Give up our slot, for the next thread to carry on filling.
+ */
+static void profile_release(void) {
+	struct profile_slot * slot = profile_self;
+	profile_self = NULL;
+	if (slot) {
+		unsigned long mine = profile_seen;
+		__atomic_compare_exchange_n(&slot->owner, &mine, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * A handler thread is exiting; its timer goes with it.
+ */
+static void profile_thread_done(void * unused) {
+	(void)unused;
+	profile_release();
+	if (profile_has_timer) {
+		timer_delete(profile_timer);
+		profile_has_timer = 0;
+	}
+}
+
+int profile_init(void) {
+	profile_slots = calloc(PROFILE_THREADS, sizeof(struct profile_slot));
+	if (!profile_slots || pthread_key_create(&profile_key, profile_thread_done) != 0) {
+		return -1;
+	}
+	void * warm[4];
+	backtrace(warm, 4);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = profile_signal;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) < 0) {
+		return -1;
+	}
+	profile_enabled = 1;
+	return 0;
+}
+
+/*
+ * A profile has started or stopped since this thread last looked:
+ * take a slot and start the timer, or stop it.
+ */
+void profile_thread_join(void) {
+	unsigned long session = __atomic_load_n(&profile_session, __ATOMIC_ACQUIRE);
+	profile_release();
+	profile_seen = session;
+	if (!session) {
+		if (profile_has_timer) {
+			profile_disarm();
+		}
+		return;
+	}
+	pid_t tid = syscall(SYS_gettid);
+	struct profile_slot * slot = NULL;
+	unsigned int i;
+	for (i = 0; i < PROFILE_THREADS && !slot; ++i) {
+		struct profile_slot * s = &profile_slots[(tid + i) % PROFILE_THREADS];
+		unsigned long owner = __atomic_load_n(&s->owner, __ATOMIC_RELAXED);
+		if (owner != session && s->count < PROFILE_SAMPLES &&
+				__atomic_compare_exchange_n(&s->owner, &owner, session, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			slot = s;
+		}
+	}
+	if (!slot) {
+		__atomic_add_fetch(&profile_unsampled, 1, __ATOMIC_RELAXED);
+		if (profile_has_timer) {
+			profile_disarm();
+		}
+		return;
+	}
+	__atomic_add_fetch(&profile_threads, 1, __ATOMIC_RELAXED);
+	if (!profile_has_timer) {
+		struct sigevent ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.sigev_notify = SIGEV_THREAD_ID;
+		ev.sigev_signo = SIGPROF;
+		ev.sigev_notify_thread_id = tid;
+		if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &profile_timer) < 0) {
+			__atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+			return;
+		}
+		profile_has_timer = 1;
+		profile_seed = tid ^ (unsigned int)time(NULL);
+		pthread_setspecific(profile_key, (void *)1);
+	}
+	profile_self = slot;
+
+	/*
+	 * The first sample lands somewhere in the first period, so
+	 * threads started together don't all sample together. At 1 Hz
+	 * a period is a whole second, which tv_nsec can't hold.
+	 */
+	long period = 1000000000L / profile_hz;
+	long first = 1 + rand_r(&profile_seed) % period;
+	struct itimerspec every;
+	every.it_interval.tv_sec = period / 1000000000L;
+	every.it_interval.tv_nsec = period % 1000000000L;
+	every.it_value.tv_sec = first / 1000000000L;
+	every.it_value.tv_nsec = first % 1000000000L;
+	if (timer_settime(profile_timer, 0, &every, NULL) < 0) {
+		profile_release();
+		__atomic_sub_fetch(&profile_threads, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&profile_unsampled, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Frame names, remembered by address while a profile is rendered.
+ */
+struct profile_symbol {
+	void *             addr;
+	char *             name;
+};
+
+static const char * profile_name(struct profile_symbol * cache, void * addr) {
+	size_t h = ((uintptr_t)addr >> 2) % PROFILE_SYMBOLS;
+	size_t probe;
+	for (probe = 0; probe < PROFILE_SYMBOLS; ++probe) {
+		struct profile_symbol * e = &cache[(h + probe) % PROFILE_SYMBOLS];
+		if (e->addr == addr) {
+			return e->name;
+		}
+		if (!e->addr) {
+			break;
+		}
+	}
+	/*
+	 * dladdr only knows exported symbols and gives the nearest one
+	 * before the address, so check that it really covers it. Static
+	 * functions come out as object+offset, for addr2line.
+	 */
+	char name[PATH_MAX + 32];
+	Dl_info info;
+	const ElfW(Sym) * sym = NULL;
+	if (!dladdr1(addr, &info, (void **)&sym, RTLD_DL_SYMENT)) {
+		strcpy(name, "[unknown]");
+	} else if (info.dli_sname && sym &&
+			(char *)addr < (char *)info.dli_saddr + (sym->st_size ? sym->st_size : 1)) {
+		snprintf(name, sizeof(name), "%s", info.dli_sname);
+	} else {
+		const char * object = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+		snprintf(name, sizeof(name), "%s+0x%lx", object ? object + 1 : info.dli_fname ? info.dli_fname : "?",
+				(unsigned long)((char *)addr - (char *)info.dli_fbase));
+	}
+	if (probe < PROFILE_SYMBOLS) {
+		struct profile_symbol * e = &cache[(h + probe) % PROFILE_SYMBOLS];
+		e->addr = addr;
+		e->name = strdup(name);
+		return e->name;
+	}
+	static __thread char overflow[PATH_MAX + 32];
+	strcpy(overflow, name);
+	return overflow;
+}
+
+static int compare_stacks(const void * a, const void * b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Take a profile and send it back as folded stacks.
+ */
+void profile_page(FILE * socket_stream, const char * query, int head_only) {
+	unsigned long seconds = PROFILE_SECONDS, hz = PROFILE_HZ;
+	while (query && *query) {
+		if (!strncmp(query, "seconds=", 8)) {
+			seconds = strtoul(query + 8, NULL, 10);
+		} else if (!strncmp(query, "hz=", 3)) {
+			hz = strtoul(query + 3, NULL, 10);
+		}
+		query = strchr(query, '&');
+		if (query) {
+			query++;
+		}
+	}
+	if (!seconds || seconds > PROFILE_MAX_SECONDS || !hz || hz > PROFILE_MAX_HZ) {
+		generic_response(socket_stream, "400 Bad Request", "Bad request: seconds or hz out of range.");
+		return;
+	}
+	if (pthread_mutex_trylock(&profile_lock) != 0) {
+		generic_response(socket_stream, "503 Service Unavailable", "A profile is already being taken.");
+		return;
+	}
+
+	/*
+	 * Nobody is writing to the slots: the last profile's threads
+	 * stopped sampling once it ended.
+	 */
+	unsigned int i, j;
+	for (i = 0; i < PROFILE_THREADS; ++i) {
+		profile_slots[i].owner = 0;
+		profile_slots[i].count = 0;
+		profile_slots[i].dropped = 0;
+	}
+	profile_hz = hz;
+	profile_threads = 0;
+	profile_unsampled = 0;
+	__atomic_store_n(&profile_session, ++profile_sessions, __ATOMIC_RELEASE);
+	struct timespec wait = { seconds, 0 };
+	while (nanosleep(&wait, &wait) < 0 && errno == EINTR);
+	__atomic_store_n(&profile_session, 0, __ATOMIC_RELEASE);
+
+	/*
+	 * Name every frame, root first; the first two are our signal
+	 * handler and the kernel's trampoline. Frames above the one that
+	 * was interrupted are return addresses, so look up the call.
+	 */
+	unsigned long samples = 0, dropped = 0;
+	for (i = 0; i < PROFILE_THREADS; ++i) {
+		samples += __atomic_load_n(&profile_slots[i].count, __ATOMIC_ACQUIRE);
+		dropped += profile_slots[i].dropped;
+	}
+	char ** stacks = malloc((samples ? samples : 1) * sizeof(char *));
+	struct profile_symbol * cache = calloc(PROFILE_SYMBOLS, sizeof(struct profile_symbol));
+	size_t count = 0;
+	for (i = 0; i < PROFILE_THREADS; ++i) {
+		struct profile_slot * slot = &profile_slots[i];
+		unsigned int n, taken = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+		for (n = 0; n < taken && count < samples; ++n) {
+			char line[PROFILE_DEPTH * 64];
+			size_t len = 0;
+			for (j = slot->depth[n]; j-- > 2;) {
+				void * addr = (char *)slot->frames[n][j] - (j > 2);
+				const char * name = profile_name(cache, addr);
+				len += snprintf(line + len, sizeof(line) - len, "%s%s", len ? ";" : "", name);
+				if (len >= sizeof(line)) {
+					len = sizeof(line) - 1;
+					break;
+				}
+			}
+			line[len] = '\0';
+			stacks[count++] = strdup(len ? line : "[unknown]");
+		}
+	}
+	qsort(stacks, count, sizeof(char *), compare_stacks);
+
+	size_t out_size = 4096, out_len = 0;
+	char * out = malloc(out_size);
+	size_t k;
+	for (k = 0; k < count;) {
+		size_t run = 1;
+		while (k + run < count && !strcmp(stacks[k], stacks[k + run])) {
+			run++;
+		}
+		size_t need = strlen(stacks[k]) + 24;
+		if (out_len + need > out_size) {
+			while (out_len + need > out_size) {
+				out_size *= 2;
+			}
+			out = realloc(out, out_size);
+		}
+		out_len += sprintf(out + out_len, "%s %zu\n", stacks[k], run);
+		for (j = 0; j < run; ++j) {
+			free(stacks[k + j]);
+		}
+		k += run;
+	}
+	free(stacks);
+	for (k = 0; k < PROFILE_SYMBOLS; ++k) {
+		free(cache[k].name);
+	}
+	free(cache);
+	pthread_mutex_unlock(&profile_lock);
+
+	/*
+	 * What the folded stacks can't say goes in headers.
+	 */
+	char extra[256];
+	snprintf(extra, sizeof(extra),
+			"Content-Type: text/plain\r\nCache-Control: no-store\r\n"
+			"X-Profile: seconds=%lu hz=%lu threads=%lu unsampled_threads=%lu samples=%lu dropped=%lu\r\n",
+			seconds, hz, profile_threads, profile_unsampled, samples, dropped);
+	header_block_t hb;
+	header_begin(&hb, FRAGMENT(STATUS_LINE("200 OK")));
+	header_add(&hb, extra, strlen(extra));
+	header_content_length(&hb, out_len);
+	header_end(&hb);
+	send_response(socket_stream, &hb, out, head_only ? 0 : out_len);
+	free(out);
+}
+#endif
+
+#if ENABLE_IO_URING
+/*
+ * io_uring backend
+ *
+ * With -u, the accept loop runs off a single multishot accept on a
+ * ring, reaping however many connections are pending per wakeup, and
+ * each connection borrows a ring from a small pool for its flat-file
+ * work: statx, openat and the first read are submitted together, the
+ * file lives in a registered (direct) slot and is read into a
+ * registered buffer, and the close rides along with the next batch.
+ * Request parsing still goes through stdio on the socket.
+ *
+ * We talk to the kernel directly rather than pulling in liburing.
+ */
+int use_uring = 0;
+
+struct uring {
+	int                   fd;
+	unsigned *            sq_head;
+	unsigned *            sq_tail;
+	unsigned *            sq_mask;
+	unsigned *            sq_array;
+	unsigned              sq_pending; /* Queued but not yet submitted */
+	struct io_uring_sqe * sqes;
+	unsigned *            cq_head;
+	unsigned *            cq_tail;
+	unsigned *            cq_mask;
+	struct io_uring_cqe * cqes;
+	void *                ring_ptr;
+	size_t                ring_size;
+	size_t                sqes_size;
+	char *                buffer;     /* Registered buffer, FLAT_BUFFER bytes */
+	int                   file_open;  /* Registered file slot is in use */
+	struct uring *        next;       /* Pool link */
+};
+
+#define URING_TAG_STATX 1
+#define URING_TAG_OPEN  2
+#define URING_TAG_READ  3
+#define URING_TAG_CLOSE 4
+
+int uring_init(struct uring * ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		/*
+		 * Kernels old enough to need separate ring mappings
+		 * are too old for the rest of what we use, too.
+		 */
+		close(ring->fd);
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring_ptr == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->ring_ptr, ring->ring_size);
+		close(ring->fd);
+		return -1;
+	}
+
+	char * base = ring->ring_ptr;
+	ring->sq_head  = (unsigned *)(base + params.sq_off.head);
+	ring->sq_tail  = (unsigned *)(base + params.sq_off.tail);
+	ring->sq_mask  = (unsigned *)(base + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(base + params.sq_off.array);
+	ring->cq_head  = (unsigned *)(base + params.cq_off.head);
+	ring->cq_tail  = (unsigned *)(base + params.cq_off.tail);
+	ring->cq_mask  = (unsigned *)(base + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	return 0;
+}
+
+void uring_free(struct uring * ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring_ptr, ring->ring_size);
+	close(ring->fd);
+	free(ring->buffer);
+}
+
+/*
+ * Grab the next submission entry, or NULL if the queue is full.
+ */
+struct io_uring_sqe * uring_get_sqe(struct uring * ring, uint8_t opcode, uint64_t tag) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+	if (tail - head > *ring->sq_mask) {
+		return NULL;
+	}
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe * sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = tag;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+	return sqe;
+}
+
+/*
+ * Submit everything queued and wait for at least wait_nr completions.
+ */
+int uring_submit(struct uring * ring, unsigned wait_nr) {
+	while (1) {
+		int ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		ring->sq_pending -= ret;
+		return 0;
+	}
+}
+
+/*
+ * Pop a completion, if there is one.
+ */
+int uring_next_cqe(struct uring * ring, struct io_uring_cqe * out) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	*out = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Pool of per-connection file rings. Each has one sparse
+ * registered file slot and one registered FLAT_BUFFER.
+ */
+struct uring *  uring_pool = NULL;
+unsigned int    uring_pool_size = 0;
+pthread_mutex_t uring_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct uring * uring_pool_get(void) {
+	pthread_mutex_lock(&uring_pool_lock);
+	struct uring * ring = uring_pool;
+	if (ring) {
+		uring_pool = ring->next;
+		uring_pool_size--;
+	}
+	pthread_mutex_unlock(&uring_pool_lock);
+	if (ring) {
+		return ring;
+	}
+
+	ring = malloc(sizeof(struct uring));
+	if (uring_init(ring, 8) < 0) {
+		free(ring);
+		return NULL;
+	}
+	int slot = -1;
+	ring->buffer = malloc(FLAT_BUFFER);
+	struct iovec iov = { ring->buffer, FLAT_BUFFER };
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &slot, 1) < 0 ||
+		syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+		uring_free(ring);
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+void uring_pool_put(struct uring * ring) {
+	/*
+	 * Close the last file before the ring changes hands.
+	 */
+	struct io_uring_cqe cqe;
+	if (ring->file_open) {
+		struct io_uring_sqe * sqe = uring_get_sqe(ring, IORING_OP_CLOSE, URING_TAG_CLOSE);
+		sqe->file_index = 1;
+		uring_submit(ring, 1);
+		ring->file_open = 0;
+	}
+	while (uring_next_cqe(ring, &cqe));
+
+	pthread_mutex_lock(&uring_pool_lock);
+	if (uring_pool_size < URING_POOL) {
+		ring->next = uring_pool;
+		uring_pool = ring;
+		uring_pool_size++;
+		ring = NULL;
+	}
+	pthread_mutex_unlock(&uring_pool_lock);
+	if (ring) {
+		uring_free(ring);
+		free(ring);
+	}
+}
+
+/*
+ * Serve a flat file that fits in one read through a connection's
+ * ring; the response itself is made by send_entity like any other.
+ * Returns -1 without having sent anything if the file could not be
+ * opened or read whole, so the caller can fall back to the stdio path.
+ */
+int uring_send_file(struct uring * ring, struct outq * q, FILE * socket_stream, char * _filename, char * ext,
+		struct file_request * fr, int head_only) {
+	struct statx stx;
+	struct io_uring_sqe * sqe;
+	struct io_uring_cqe cqe;
+
+	sqe = uring_get_sqe(ring, IORING_OP_STATX, URING_TAG_STATX);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)_filename;
+	sqe->len = STATX_SIZE | STATX_MTIME;
+	sqe->off = (uint64_t)(uintptr_t)&stx;
+
+	if (ring->file_open) {
+		/*
+		 * Close the previous file ahead of the open that
+		 * reuses its slot.
+		 */
+		sqe = uring_get_sqe(ring, IORING_OP_CLOSE, URING_TAG_CLOSE);
+		sqe->file_index = 1;
+		sqe->flags = IOSQE_IO_HARDLINK;
+		ring->file_open = 0;
+	}
+
+	sqe = uring_get_sqe(ring, IORING_OP_OPENAT, URING_TAG_OPEN);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)_filename;
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = 1;
+	sqe->flags = IOSQE_IO_LINK;
+
+	sqe = uring_get_sqe(ring, IORING_OP_READ_FIXED, URING_TAG_READ);
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (uint64_t)(uintptr_t)ring->buffer;
+	sqe->len = FLAT_BUFFER;
+	sqe->off = 0;
+	sqe->buf_index = 0;
+
+	if (uring_submit(ring, 3) < 0) {
+		return -1;
+	}
+
+	/*
+	 * Collect the batch. There may be a stale close
+	 * completion from the last file in here as well.
+	 */
+	int statx_res = -1, open_res = -1, read_res = -1, seen = 0;
+	while (seen < 3) {
+		if (!uring_next_cqe(ring, &cqe)) {
+			uring_submit(ring, 1);
+			continue;
+		}
+		switch (cqe.user_data) {
+			case URING_TAG_STATX: statx_res = cqe.res; seen++; break;
+			case URING_TAG_OPEN:  open_res  = cqe.res; seen++; break;
+			case URING_TAG_READ:  read_res  = cqe.res; seen++; break;
+		}
+	}
+	if (open_res < 0) {
+		return -1;
+	}
+
+	/*
+	 * Leave the file in its slot; the close goes in
+	 * with the next submission.
+	 */
+	ring->file_open = 1;
+	if (statx_res < 0 || read_res < 0 || (unsigned long)read_res != stx.stx_size) {
+		/*
+		 * Bigger than the buffer, or it changed on us.
+		 */
+		return -1;
+	}
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_size = stx.stx_size;
+	st.st_mtime = stx.stx_mtime.tv_sec;
+	char etag[48];
+	char modified[48];
+	struct entity e = { -1, 0, stx.stx_size, ring->buffer, etag, 0, modified, 0 };
+	file_validators(&st, etag, &e.etag_len, modified, &e.modified_len);
+
+	size_t mime_len;
+	const char * mime = mime_header(ext, &mime_len);
+	send_entity(q, socket_stream, &e, FRAGMENT(STATUS_LINE("200 OK")), mime, mime_len, fr, head_only);
+	return 0;
+}
+#endif
+
+#if ENABLE_TLS
+/*
+ * TLS
+ *
+ * HTTPS connections come in on their own listener (-s) and are
+ * handshaken in the handler thread. The server context keeps a session
+ * cache and issues session tickets, so reconnecting clients resume
+ * without a full handshake. We ask OpenSSL to hand the record layer to
+ * kernel TLS; when it manages that in both directions the socket is
+ * used as a plain descriptor from then on (and writev, sendfile and
+ * friends keep working), otherwise the connection is wrapped in a
+ * stdio stream that reads and writes through the session.
+ */
+SSL_CTX * tls_ctx = NULL;
+char *    tls_cert = NULL;
+char *    tls_key = NULL;
+
+int tls_init(void) {
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if (!tls_ctx) {
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char *)VERSION_STRING, strlen(VERSION_STRING));
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1 ||
+		SSL_CTX_use_PrivateKey_file(tls_ctx, tls_key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(tls_ctx) != 1) {
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t tls_cookie_read(void * cookie, char * buf, size_t size) {
+	int ret = SSL_read((SSL *)cookie, buf, size > INT_MAX ? INT_MAX : (int)size);
+	if (ret > 0) {
+		return ret;
+	}
+	return SSL_get_error((SSL *)cookie, ret) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+ssize_t tls_cookie_write(void * cookie, const char * buf, size_t size) {
+	size_t written = 0;
+	while (written < size) {
+		size_t len = size - written;
+		int ret = SSL_write((SSL *)cookie, buf + written, len > INT_MAX ? INT_MAX : (int)len);
+		if (ret <= 0) {
+			return written ? (ssize_t)written : -1;
+		}
+		written += ret;
+	}
+	return written;
+}
+
+int tls_cookie_close(void * cookie) {
+	SSL * ssl = (SSL *)cookie;
+	int fd = SSL_get_fd(ssl);
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	return close(fd);
+}
+
+/*
+ * Handshake and return a stream for the connection, or NULL
+ * (with the socket closed) if the handshake failed.
+ */
+FILE * tls_open(struct socket_request * request) {
+	SSL * ssl = SSL_new(tls_ctx);
+	if (!ssl || !SSL_set_fd(ssl, request->fd) || SSL_accept(ssl) != 1) {
+		if (ssl) {
+			SSL_free(ssl);
+		}
+		ERR_clear_error();
+		close(request->fd);
+		return NULL;
+	}
+
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		/*
+		 * The kernel has the keys; the socket carries plaintext for us now.
+		 */
+		request->ssl = ssl;
+		return fdopen(request->fd, "r+");
+	}
+
+	cookie_io_functions_t functions = {
+		tls_cookie_read,
+		tls_cookie_write,
+		NULL,
+		tls_cookie_close
+	};
+	FILE * stream = fopencookie(ssl, "r+", functions);
+	if (!stream) {
+		tls_cookie_close(ssl);
+	}
+	return stream;
+}
+#endif
+
+#if ENABLE_HTTP2
+/*
+ * HTTP/2 over cleartext (h2c)
+ *
+ * Connections start HTTP/2 either with the prior-knowledge preface or
+ * by upgrading a GET/HEAD request. Each stream is handed to its own
+ * handleRequest thread over a socketpair as a plain HTTP/1.1 request,
+ * and a pump thread per stream turns the HTTP/1.1 response it writes
+ * back into HEADERS and DATA frames, so a slow CGI script only holds up
+ * its own stream. The connection's thread reads frames; all frame
+ * writes go through h2_send under a write lock.
+ */
+
+#define H2_PREFACE       "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_SIZE    16384  /* Largest frame we accept (the protocol default) */
+#define H2_WINDOW        65535  /* Initial flow control window */
+#define H2_MAX_STREAMS   100    /* Concurrent streams per connection */
+#define H2_TABLE_SIZE    4096   /* HPACK dynamic table limit */
+#define H2_HEADER_BLOCK  65536L /* Largest header block we will assemble */
+#define H2_HEADER_LIST   16384L /* Largest request header list, decoded (SETTINGS_MAX_HEADER_LIST_SIZE) */
+
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+#define H2_END_STREAM    0x1
+#define H2_ACK           0x1
+#define H2_END_HEADERS   0x4
+#define H2_PADDED        0x8
+#define H2_PRIORITY_FLAG 0x20
+
+#define H2_NO_ERROR          0x0
+#define H2_PROTOCOL_ERROR    0x1
+#define H2_INTERNAL_ERROR    0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR  0x6
+#define H2_REFUSED_STREAM    0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+/*
+ * Growable byte buffer for header blocks and synthesized requests.
+ */
+struct h2_buf {
+	char * data;
+	size_t len;
+	size_t cap;
+};
+
+void h2_buf_put(struct h2_buf * buf, const void * data, size_t len) {
+	if (buf->len + len + 1 > buf->cap) {
+		while (buf->len + len + 1 > buf->cap) {
+			buf->cap = buf->cap ? buf->cap * 2 : 1024;
+		}
+		buf->data = realloc(buf->data, buf->cap);
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+}
+
+void h2_buf_puts(struct h2_buf * buf, const char * str) {
+	h2_buf_put(buf, str, strlen(str));
+}
+
+/*
+ * HPACK static table (RFC 7541, Appendix A).
+ */
+static const char * hpack_static[61][2] = {
+	{":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+	{":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+	{":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+	{":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+	{"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+	{"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+	{"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+	{"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+	{"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+	{"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+	{"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+	{"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+	{"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+	{"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+	{"www-authenticate", ""}
+};
+
+/*
+ * HPACK Huffman code lengths per symbol (RFC 7541, Appendix B).
+ * The code is canonical, so the codes themselves follow from these.
+ */
+static const unsigned char hpack_huffman_bits[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+unsigned int   hpack_first_code[31];
+unsigned short hpack_first_index[31];
+unsigned short hpack_count[31];
+unsigned short hpack_symbols[257];
+
+void hpack_init(void) {
+	unsigned int len, sym, index = 0, code = 0;
+	for (len = 1; len <= 30; ++len) {
+		hpack_first_index[len] = index;
+		for (sym = 0; sym < 257; ++sym) {
+			if (hpack_huffman_bits[sym] == len) {
+				hpack_symbols[index++] = sym;
+				hpack_count[len]++;
+			}
+		}
+		hpack_first_code[len] = code;
+		code = (code + hpack_count[len]) << 1;
+	}
+}
+
+/*
+ * Decode a Huffman-coded string. Returns -1 on a malformed code.
+ */
+int hpack_huffman_decode(const unsigned char * in, size_t len, struct h2_buf * out) {
+	unsigned int code = 0, bits = 0;
+	size_t i;
+	int bit;
+	for (i = 0; i < len; ++i) {
+		for (bit = 7; bit >= 0; --bit) {
+			code = (code << 1) | ((in[i] >> bit) & 1);
+			bits++;
+			if (bits > 30) {
+				return -1;
+			}
+			if (hpack_count[bits] && code - hpack_first_code[bits] < hpack_count[bits]) {
+				unsigned short sym = hpack_symbols[hpack_first_index[bits] + code - hpack_first_code[bits]];
+				if (sym == 256) {
+					return -1;
+				}
+				char c = sym;
+				h2_buf_put(out, &c, 1);
+				code = 0;
+				bits = 0;
+			}
+		}
+	}
+	/*
+	 * Whatever is left must be at most seven bits of EOS padding.
+	 */
+	if (bits > 7 || code != (1U << bits) - 1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * HPACK dynamic table, newest entry first.
+ */
+struct hpack_entry {
+	char * name;
+	char * value;
+};
+
+struct hpack_table {
+	struct hpack_entry * entries;
+	unsigned int count;
+	unsigned int alloc;
+	size_t size;
+	size_t max_size;
+};
+
+void hpack_evict(struct hpack_table * table, size_t needed) {
+	while (table->count && table->size + needed > table->max_size) {
+		struct hpack_entry * last = &table->entries[--table->count];
+		table->size -= strlen(last->name) + strlen(last->value) + 32;
+		free(last->name);
+		free(last->value);
+	}
+}
+
+void hpack_insert(struct hpack_table * table, const char * name, const char * value) {
+	size_t size = strlen(name) + strlen(value) + 32;
+	hpack_evict(table, size);
+	if (size > table->max_size) {
+		/*
+		 * Too big for the table at all; it just empties it.
+		 */
+		return;
+	}
+	if (table->count == table->alloc) {
+		table->alloc = table->alloc ? table->alloc * 2 : 16;
+		table->entries = realloc(table->entries, table->alloc * sizeof(struct hpack_entry));
+	}
+	memmove(&table->entries[1], &table->entries[0], table->count * sizeof(struct hpack_entry));
+	table->entries[0].name = strdup(name);
+	table->entries[0].value = strdup(value);
+	table->count++;
+	table->size += size;
+}
+
+void hpack_free(struct hpack_table * table) {
+	table->max_size = 0;
+	hpack_evict(table, 0);
+	free(table->entries);
+}
+
+int hpack_lookup(struct hpack_table * table, unsigned long index, const char ** name, const char ** value) {
+	if (index >= 1 && index <= 61) {
+		*name  = hpack_static[index - 1][0];
+		*value = hpack_static[index - 1][1];
+		return 0;
+	}
+	if (index > 61 && index - 62 < table->count) {
+		*name  = table->entries[index - 62].name;
+		*value = table->entries[index - 62].value;
+		return 0;
+	}
+	return -1;
+}
+
+int hpack_integer(const unsigned char ** pos, const unsigned char * end, int prefix, unsigned long * out) {
+	unsigned int mask = (1U << prefix) - 1;
+	if (*pos >= end) {
+		return -1;
+	}
+	unsigned long value = **pos & mask;
+	(*pos)++;
+	if (value == mask) {
+		int shift = 0;
+		unsigned char b;
+		do {
+			if (*pos >= end || shift > 28) {
+				return -1;
+			}
+			b = **pos;
+			(*pos)++;
+			value += (unsigned long)(b & 0x7F) << shift;
+			shift += 7;
+		} while (b & 0x80);
+	}
+	*out = value;
+	return 0;
+}
+
+int hpack_string(const unsigned char ** pos, const unsigned char * end, struct h2_buf * out) {
+	if (*pos >= end) {
+		return -1;
+	}
+	int huffman = **pos & 0x80;
+	unsigned long len;
+	if (hpack_integer(pos, end, 7, &len) < 0 || len > (unsigned long)(end - *pos)) {
+		return -1;
+	}
+	out->len = 0;
+	h2_buf_put(out, "", 0);
+	if (huffman) {
+		if (hpack_huffman_decode(*pos, len, out) < 0) {
+			return -1;
+		}
+	} else {
+		h2_buf_put(out, *pos, len);
+	}
+	*pos += len;
+	return 0;
+}
+
+/*
+ * Decode a header block, calling emit for each field.
+ */
+typedef void (*hpack_emit_t)(void * context, const char * name, const char * value);
+
+int hpack_decode(struct hpack_table * table, const unsigned char * pos, size_t len, hpack_emit_t emit, void * context) {
+	const unsigned char * end = pos + len;
+	struct h2_buf name  = {0};
+	struct h2_buf value = {0};
+	int ret = 0;
+	while (pos < end) {
+		unsigned long index;
+		const char * n;
+		const char * v;
+		if (*pos & 0x80) {
+			/*
+			 * Indexed header field.
+			 */
+			if (hpack_integer(&pos, end, 7, &index) < 0 || hpack_lookup(table, index, &n, &v) < 0) {
+				ret = -1;
+				break;
+			}
+			emit(context, n, v);
+		} else if ((*pos & 0xE0) == 0x20) {
+			/*
+			 * Dynamic table size update.
+			 */
+			if (hpack_integer(&pos, end, 5, &index) < 0 || index > H2_TABLE_SIZE) {
+				ret = -1;
+				break;
+			}
+			table->max_size = index;
+			hpack_evict(table, 0);
+		} else {
+			/*
+			 * Literal, with incremental indexing (01), without (0000)
+			 * or never indexed (0001).
+			 */
+			int indexing = (*pos & 0xC0) == 0x40;
+			if (hpack_integer(&pos, end, indexing ? 6 : 4, &index) < 0) {
+				ret = -1;
+				break;
+			}
+			if (index) {
+				if (hpack_lookup(table, index, &n, &v) < 0) {
+					ret = -1;
+					break;
+				}
+				name.len = 0;
+				h2_buf_puts(&name, n);
+			} else if (hpack_string(&pos, end, &name) < 0) {
+				ret = -1;
+				break;
+			}
+			if (hpack_string(&pos, end, &value) < 0) {
+				ret = -1;
+				break;
+			}
+			if (strlen(name.data) != name.len || strlen(value.data) != value.len) {
+				/*
+				 * An embedded NUL; hand over an empty name, which
+				 * no field may have, so the stream gets rejected.
+				 */
+				emit(context, "", value.data);
+			} else {
+				emit(context, name.data, value.data);
+			}
+			if (indexing) {
+				hpack_insert(table, name.data, value.data);
+			}
+		}
+	}
+	free(name.data);
+	free(value.data);
+	return ret;
+}
+
+void hpack_put_integer(struct h2_buf * out, unsigned char first, int prefix, unsigned long value) {
+	unsigned long mask = (1UL << prefix) - 1;
+	unsigned char c;
+	if (value < mask) {
+		c = first | value;
+		h2_buf_put(out, &c, 1);
+		return;
+	}
+	c = first | mask;
+	h2_buf_put(out, &c, 1);
+	value -= mask;
+	while (value >= 0x80) {
+		c = (value & 0x7F) | 0x80;
+		h2_buf_put(out, &c, 1);
+		value >>= 7;
+	}
+	c = value;
+	h2_buf_put(out, &c, 1);
+}
+
+void hpack_put_string(struct h2_buf * out, const char * str, size_t len) {
+	hpack_put_integer(out, 0x00, 7, len);
+	h2_buf_put(out, str, len);
+}
+
+struct h2_conn;
+
+struct h2_stream {
+	unsigned int       id;
+	struct h2_conn *   conn;
+	int                fd;           /* Our end of the socketpair to the handler */
+	long               send_window;
+	long               recv_window;  /* What the client may still send us */
+	int                head;         /* HEAD request, response has no body */
+	int                remote_open;  /* Client may still send DATA */
+	int                reset;
+	int                refs;         /* Reader side (or feeder) and pump */
+	struct h2_buf      inbox;        /* Request body the handler hasn't taken yet */
+	struct h2_buf      cookies;
+	struct h2_stream * next;
+};
+
+struct h2_conn {
+	int                fd;
+	FILE *             in;
+	struct socket_request * request;
+	pthread_mutex_t    lock;         /* Streams and windows */
+	pthread_cond_t     cond;
+	pthread_mutex_t    write_lock;   /* Frame writes */
+	long               send_window;
+	long               recv_window;
+	long               initial_window;
+	unsigned int       max_frame;
+	struct h2_stream * streams;
+	int                active;
+	unsigned int       last_stream;
+	int                goaway;       /* No new streams (the client's GOAWAY or ours) */
+	int                goaway_sent;  /* We sent one because we are draining */
+	int                dead;
+	struct hpack_table decoder;
+};
+
+/*
+ * Write a frame. Callers that need several frames to go out
+ * back to back (HEADERS + CONTINUATION) hold write_lock themselves.
+ */
+int h2_send_locked(struct h2_conn * conn, int type, int flags, unsigned int id, const void * payload, size_t len) {
+	unsigned char header[9];
+	header[0] = len >> 16;
+	header[1] = len >> 8;
+	header[2] = len;
+	header[3] = type;
+	header[4] = flags;
+	header[5] = (id >> 24) & 0x7F;
+	header[6] = id >> 16;
+	header[7] = id >> 8;
+	header[8] = id;
+	struct iovec iov[2] = {
+		{ header, 9 },
+		{ (void *)payload, len }
+	};
+	int count = len ? 2 : 1;
+	struct iovec * v = iov;
+	while (count > 0) {
+		ssize_t written = writev(conn->fd, v, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while (count > 0 && (size_t)written >= v->iov_len) {
+			written -= v->iov_len;
+			v++;
+			count--;
+		}
+		if (count > 0) {
+			v->iov_base = (char *)v->iov_base + written;
+			v->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+int h2_send(struct h2_conn * conn, int type, int flags, unsigned int id, const void * payload, size_t len) {
+	pthread_mutex_lock(&conn->write_lock);
+	int ret = h2_send_locked(conn, type, flags, id, payload, len);
+	pthread_mutex_unlock(&conn->write_lock);
+	return ret;
+}
+
+void h2_put32(unsigned char * out, unsigned long value) {
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+unsigned long h2_get32(const unsigned char * in) {
+	return ((unsigned long)in[0] << 24) | ((unsigned long)in[1] << 16) | ((unsigned long)in[2] << 8) | in[3];
+}
+
+void h2_rst_stream(struct h2_conn * conn, unsigned int id, unsigned long error) {
+	unsigned char payload[4];
+	h2_put32(payload, error);
+	h2_send(conn, H2_RST_STREAM, 0, id, payload, 4);
+}
+
+void h2_goaway(struct h2_conn * conn, unsigned long error) {
+	unsigned char payload[8];
+	h2_put32(payload, conn->last_stream);
+	h2_put32(payload + 4, error);
+	h2_send(conn, H2_GOAWAY, 0, 0, payload, 8);
+}
+
+void h2_window_update(struct h2_conn * conn, unsigned int id, unsigned long increment) {
+	unsigned char payload[4];
+	h2_put32(payload, increment);
+	h2_send(conn, H2_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+/*
+ * Drop a reference to a stream; the last one unlinks and frees it.
+ */
+void h2_stream_release(struct h2_stream * stream) {
+	struct h2_conn * conn = stream->conn;
+	pthread_mutex_lock(&conn->lock);
+	if (--stream->refs > 0) {
+		pthread_mutex_unlock(&conn->lock);
+		return;
+	}
+	struct h2_stream ** link = &conn->streams;
+	while (*link != stream) {
+		link = &(*link)->next;
+	}
+	*link = stream->next;
+	conn->active--;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+
+	close(stream->fd);
+	free(stream->inbox.data);
+	free(stream->cookies.data);
+	free(stream);
+}
+
+/*
+ * The client is done sending on this stream. The feeder owns the
+ * reader side's reference from here and lets go of it once the
+ * handler has what was still queued.
+ */
+void h2_stream_remote_close(struct h2_stream * stream) {
+	struct h2_conn * conn = stream->conn;
+	pthread_mutex_lock(&conn->lock);
+	stream->remote_open = 0;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Feeder: hands request body from the stream's inbox to the handler,
+ * and only gives the client window back for what the handler took.
+ */
+void *h2_feed(void * arg) {
+	struct h2_stream * stream = (struct h2_stream *)arg;
+	struct h2_conn * conn = stream->conn;
+	char buf[H2_FRAME_SIZE];
+	int failed = 0;
+
+	pthread_mutex_lock(&conn->lock);
+	while (1) {
+		while (!stream->inbox.len && stream->remote_open) {
+			pthread_cond_wait(&conn->cond, &conn->lock);
+		}
+		if (!stream->inbox.len) {
+			break;
+		}
+		size_t len = stream->inbox.len > sizeof(buf) ? sizeof(buf) : stream->inbox.len;
+		memcpy(buf, stream->inbox.data, len);
+		memmove(stream->inbox.data, stream->inbox.data + len, stream->inbox.len - len);
+		stream->inbox.len -= len;
+		pthread_mutex_unlock(&conn->lock);
+
+		/*
+		 * If the handler stopped reading, the rest is thrown away,
+		 * but the client still gets its window back.
+		 */
+		size_t written = 0;
+		while (!failed && !stream->reset && written < len) {
+			ssize_t w = write(stream->fd, buf + written, len - written);
+			if (w <= 0) {
+				failed = 1;
+				break;
+			}
+			written += w;
+		}
+
+		pthread_mutex_lock(&conn->lock);
+		conn->recv_window += len;
+		stream->recv_window += len;
+		int remote_open = stream->remote_open;
+		int dead = conn->dead;
+		pthread_mutex_unlock(&conn->lock);
+		if (!dead) {
+			h2_window_update(conn, 0, len);
+			if (remote_open) {
+				h2_window_update(conn, stream->id, len);
+			}
+		}
+		pthread_mutex_lock(&conn->lock);
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	shutdown(stream->fd, SHUT_WR);
+	h2_stream_release(stream);
+	return NULL;
+}
+
+/*
+ * Find a stream the client can still send on. The reader side's
+ * reference keeps it alive for as long as that is true, so only the
+ * reading thread may use the result after the lock is dropped.
+ */
+struct h2_stream * h2_find_stream(struct h2_conn * conn, unsigned int id) {
+	pthread_mutex_lock(&conn->lock);
+	struct h2_stream * stream = conn->streams;
+	while (stream && (stream->id != id || !stream->remote_open)) {
+		stream = stream->next;
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return stream;
+}
+
+/*
+ * Wait for send window on both the connection and the stream,
+ * and claim up to len bytes of it. Returns 0 if the stream or
+ * the connection went away in the meantime.
+ */
+size_t h2_claim_window(struct h2_stream * stream, size_t len) {
+	struct h2_conn * conn = stream->conn;
+	pthread_mutex_lock(&conn->lock);
+	while (!stream->reset && !conn->dead && (conn->send_window <= 0 || stream->send_window <= 0)) {
+		pthread_cond_wait(&conn->cond, &conn->lock);
+	}
+	if (stream->reset || conn->dead) {
+		pthread_mutex_unlock(&conn->lock);
+		return 0;
+	}
+	if ((long)len > conn->send_window) {
+		len = conn->send_window;
+	}
+	if ((long)len > stream->send_window) {
+		len = stream->send_window;
+	}
+	if (len > conn->max_frame) {
+		len = conn->max_frame;
+	}
+	conn->send_window -= len;
+	stream->send_window -= len;
+	pthread_mutex_unlock(&conn->lock);
+	return len;
+}
+
+/*
+ * Send response body bytes as DATA frames.
+ */
+int h2_send_data(struct h2_stream * stream, const char * data, size_t len) {
+	while (len) {
+		size_t allowed = h2_claim_window(stream, len);
+		if (!allowed) {
+			return -1;
+		}
+		if (h2_send(stream->conn, H2_DATA, 0, stream->id, data, allowed) < 0) {
+			return -1;
+		}
+		data += allowed;
+		len -= allowed;
+	}
+	return 0;
+}
+
+/*
+ * Send a header block as HEADERS plus however many CONTINUATIONs.
+ */
+int h2_send_headers(struct h2_stream * stream, struct h2_buf * block, int end_stream) {
+	struct h2_conn * conn = stream->conn;
+	size_t offset = 0;
+	int ret = 0;
+	pthread_mutex_lock(&conn->write_lock);
+	do {
+		size_t len = block->len - offset;
+		int flags = 0;
+		if (len > conn->max_frame) {
+			len = conn->max_frame;
+		} else {
+			flags |= H2_END_HEADERS;
+		}
+		if (offset == 0 && end_stream) {
+			flags |= H2_END_STREAM;
+		}
+		if (h2_send_locked(conn, offset ? H2_CONTINUATION : H2_HEADERS, flags, stream->id, block->data + offset, len) < 0) {
+			ret = -1;
+			break;
+		}
+		offset += len;
+	} while (offset < block->len);
+	pthread_mutex_unlock(&conn->write_lock);
+	return ret;
+}
+
+/*
+ * Pump: read the HTTP/1.1 response the handler wrote for a stream
+ * and forward it as HTTP/2 frames.
+ */
+void *h2_pump(void * arg) {
+	struct h2_stream * stream = (struct h2_stream *)arg;
+	FILE * response = fdopen(dup(stream->fd), "r");
+	char line[HEADER_SIZE];
+	struct h2_buf block = {0};
+	long content_length = -1;
+	int chunked = 0;
+
+	if (!response || !fgets(line, sizeof(line), response) || strncmp(line, "HTTP/1.", 7) || strlen(line) < 12) {
+		if (!stream->reset) {
+			h2_rst_stream(stream->conn, stream->id, H2_INTERNAL_ERROR);
+		}
+		goto _done;
+	}
+
+	/*
+	 * Status line to :status.
+	 */
+	int status = atoi(line + 9);
+	static const int static_status[] = { 200, 204, 206, 304, 400, 404, 500 };
+	unsigned int s;
+	for (s = 0; s < sizeof(static_status) / sizeof(int); ++s) {
+		if (static_status[s] == status) {
+			break;
+		}
+	}
+	if (s < sizeof(static_status) / sizeof(int)) {
+		hpack_put_integer(&block, 0x80, 7, 8 + s);
+	} else {
+		hpack_put_integer(&block, 0x00, 4, 8);
+		hpack_put_string(&block, line + 9, 3);
+	}
+
+	/*
+	 * Header lines, lowercased, minus the connection-specific ones.
+	 */
+	while (fgets(line, sizeof(line), response)) {
+		if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+			break;
+		}
+		char * colon = strchr(line, ':');
+		if (!colon) {
+			continue;
+		}
+		char * value = colon + 1;
+		while (*value == ' ') {
+			value++;
+		}
+		value[strcspn(value, "\r\n")] = '\0';
+		*colon = '\0';
+		char * c;
+		for (c = line; *c; ++c) {
+			*c = tolower(*c);
+		}
+		if (!strcmp(line, "transfer-encoding")) {
+			chunked = strstr(value, "chunked") != NULL;
+			continue;
+		}
+		if (!strcmp(line, "content-length")) {
+			content_length = atol(value);
+		}
+		if (!strcmp(line, "connection") || !strcmp(line, "keep-alive") ||
+			!strcmp(line, "upgrade") || !strcmp(line, "proxy-connection")) {
+			continue;
+		}
+		hpack_put_integer(&block, 0x00, 4, 0);
+		hpack_put_string(&block, line, strlen(line));
+		hpack_put_string(&block, value, strlen(value));
+	}
+
+	int no_body = stream->head || status == 204 || status == 304 || status < 200 || content_length == 0;
+	if (h2_send_headers(stream, &block, no_body) < 0 || no_body) {
+		goto _done;
+	}
+
+	/*
+	 * Body: chunked, sized, or up to EOF.
+	 */
+	char buf[H2_FRAME_SIZE];
+	if (chunked) {
+		while (fgets(line, sizeof(line), response)) {
+			unsigned long size = strtoul(line, NULL, 16);
+			if (!size) {
+				break;
+			}
+			while (size) {
+				size_t read = fread(buf, 1, size > sizeof(buf) ? sizeof(buf) : size, response);
+				if (!read || h2_send_data(stream, buf, read) < 0) {
+					goto _done;
+				}
+				size -= read;
+			}
+			if (!fgets(line, sizeof(line), response)) {
+				break;
+			}
+		}
+	} else {
+		unsigned long remaining = content_length < 0 ? (unsigned long)-1 : (unsigned long)content_length;
+		while (remaining) {
+			size_t read = fread(buf, 1, remaining > sizeof(buf) ? sizeof(buf) : remaining, response);
+			if (!read) {
+				break;
+			}
+			if (h2_send_data(stream, buf, read) < 0) {
+				goto _done;
+			}
+			remaining -= read;
+		}
+	}
+	h2_send(stream->conn, H2_DATA, H2_END_STREAM, stream->id, NULL, 0);
+
+_done:
+	free(block.data);
+	if (response) {
+		fclose(response);
+	}
+	/*
+	 * Whatever the handler still has to say, we aren't listening.
+	 */
+	shutdown(stream->fd, SHUT_RD);
+	h2_stream_release(stream);
+	return NULL;
+}
+
+/*
+ * Title-Case a lowercase HTTP/2 header name for the HTTP/1.1 handler.
+ */
+void h2_canonical_name(struct h2_buf * out, const char * name) {
+	int upper = 1;
+	for (; *name; ++name) {
+		char c = upper ? toupper(*name) : *name;
+		h2_buf_put(out, &c, 1);
+		upper = (*name == '-');
+	}
+}
+
+/*
+ * Collects decoded request headers into an HTTP/1.1 request.
+ */
+struct h2_request_fields {
+	struct h2_stream * stream;
+	const char *       method;
+	struct h2_buf      method_buf;
+	struct h2_buf      path;
+	struct h2_buf      authority;
+	struct h2_buf      headers;
+	size_t             size;     /* Decoded so far: name, value and 32 per field */
+	int                has_host;
+	int                bad;
+	int                too_large; /* Over H2_HEADER_LIST; the rest are dropped */
+};
+
+void h2_collect_header(void * context, const char * name, const char * value) {
+	struct h2_request_fields * fields = (struct h2_request_fields *)context;
+	if (!fields->stream) {
+		/*
+		 * Decoding only to keep the table in sync.
+		 */
+		return;
+	}
+	/*
+	 * A small block can still decode to a huge list by naming a
+	 * large table entry over and over; stop before it costs us.
+	 */
+	if (fields->too_large) {
+		return;
+	}
+	fields->size += strlen(name) + strlen(value) + 32;
+	if (fields->size > H2_HEADER_LIST) {
+		fields->too_large = 1;
+		return;
+	}
+	/*
+	 * RFC 9113 8.2.1: names are lowercase tokens and values can't
+	 * carry CR, LF or NUL. Pseudo-headers end up in the request line,
+	 * so they can't have spaces either.
+	 */
+	const char * c;
+	if (!name[0] || strpbrk(value, "\r\n") || (name[0] == ':' && strchr(value, ' '))) {
+		fields->bad = 1;
+		return;
+	}
+	for (c = name[0] == ':' ? name + 1 : name; *c; ++c) {
+		if (*c <= ' ' || *c == ':' || *c == 0x7F || isupper((unsigned char)*c)) {
+			fields->bad = 1;
+			return;
+		}
+	}
+	if (name[0] == ':') {
+		if (!strcmp(name, ":method")) {
+			fields->method_buf.len = 0;
+			h2_buf_puts(&fields->method_buf, value);
+		} else if (!strcmp(name, ":path")) {
+			fields->path.len = 0;
+			h2_buf_puts(&fields->path, value);
+		} else if (!strcmp(name, ":authority")) {
+			fields->authority.len = 0;
+			h2_buf_puts(&fields->authority, value);
+		}
+		return;
+	}
+	if (!strcmp(name, "cookie")) {
+		/*
+		 * Cookies may be split across fields; join them back up.
+		 */
+		if (fields->stream->cookies.len) {
+			h2_buf_puts(&fields->stream->cookies, "; ");
+		}
+		h2_buf_puts(&fields->stream->cookies, value);
+		return;
+	}
+	if (!strcmp(name, "connection") || !strcmp(name, "keep-alive") || !strcmp(name, "upgrade") ||
+		!strcmp(name, "transfer-encoding") || !strcmp(name, "te") || !strcmp(name, "expect") ||
+		!strcmp(name, "http2-settings")) {
+		return;
+	}
+	if (!strcmp(name, "host")) {
+		fields->has_host = 1;
+	}
+	h2_canonical_name(&fields->headers, name);
+	h2_buf_puts(&fields->headers, ": ");
+	h2_buf_puts(&fields->headers, value);
+	h2_buf_puts(&fields->headers, "\r\n");
+}
+
+/*
+ * Start a stream: connect a handler thread over a socketpair, send it
+ * the request and start the pump.
+ */
+struct h2_stream * h2_open_stream(struct h2_conn * conn, unsigned int id, const char * request_text, size_t len, int head, int end_stream) {
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		return NULL;
+	}
+	struct h2_stream * stream = calloc(sizeof(struct h2_stream), 1);
+	stream->id = id;
+	stream->conn = conn;
+	stream->fd = pair[0];
+	stream->head = head;
+	stream->remote_open = 1;
+	stream->refs = 2;
+
+	pthread_mutex_lock(&conn->lock);
+	stream->send_window = conn->initial_window;
+	stream->recv_window = H2_WINDOW;
+	stream->next = conn->streams;
+	conn->streams = stream;
+	conn->active++;
+	pthread_mutex_unlock(&conn->lock);
+
+	struct socket_request * handler = request_get();
+	handler->fd = pair[1];
+	handler->address = conn->request->address;
+	strcpy(handler->peer, conn->request->peer);
+	handler->addr_len = conn->request->addr_len ? conn->request->addr_len : sizeof(handler->address);
+	handler->listener = conn->request->listener;
+	handler->internal = 1;
+	pthread_create(&(handler->thread), NULL, handleRequest, (void *)(handler));
+
+	pthread_t pump;
+	pthread_create(&pump, NULL, h2_pump, (void *)stream);
+	pthread_detach(pump);
+
+	/*
+	 * Requests with a body get a feeder; the rest are done sending.
+	 */
+	if (!end_stream) {
+		pthread_t feeder;
+		pthread_create(&feeder, NULL, h2_feed, (void *)stream);
+		pthread_detach(feeder);
+	}
+
+	/*
+	 * The handler will be reading by now, so a blocking write is fine.
+	 */
+	ssize_t written = 0;
+	while ((size_t)written < len) {
+		ssize_t w = write(stream->fd, request_text + written, len - written);
+		if (w <= 0) {
+			break;
+		}
+		written += w;
+	}
+	if (end_stream) {
+		stream->remote_open = 0;
+		shutdown(stream->fd, SHUT_WR);
+		h2_stream_release(stream);
+	}
+	return stream;
+}
+
+/*
+ * A complete header block arrived for a new stream.
+ */
+void h2_headers(struct h2_conn * conn, unsigned int id, int end_stream, struct h2_buf * block) {
+	struct h2_request_fields fields;
+	memset(&fields, 0, sizeof(fields));
+	struct h2_stream dummy;
+	memset(&dummy, 0, sizeof(dummy));
+
+	struct h2_stream * existing = h2_find_stream(conn, id);
+	int refuse = existing || conn->goaway || (id & 1) == 0 || id <= conn->last_stream;
+	if (!refuse && conn->active >= H2_MAX_STREAMS) {
+		refuse = 2;
+	}
+	fields.stream = refuse ? NULL : &dummy;
+
+	if (hpack_decode(&conn->decoder, (unsigned char *)block->data, block->len, h2_collect_header, &fields) < 0) {
+		h2_goaway(conn, H2_COMPRESSION_ERROR);
+		conn->dead = 1;
+		goto _cleanup;
+	}
+	if (existing) {
+		/*
+		 * Trailers; we don't pass them on, but they may end the stream.
+		 */
+		if (end_stream && existing->remote_open) {
+			h2_stream_remote_close(existing);
+		}
+		goto _cleanup;
+	}
+	if (refuse) {
+		if (refuse == 2) {
+			h2_rst_stream(conn, id, H2_REFUSED_STREAM);
+		}
+		goto _cleanup;
+	}
+	pthread_mutex_lock(&conn->lock);
+	if (conn->goaway) {
+		/*
+		 * We started draining while this was being decoded; the
+		 * client will retry it somewhere else.
+		 */
+		pthread_mutex_unlock(&conn->lock);
+		goto _cleanup;
+	}
+	conn->last_stream = id;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (fields.too_large) {
+		/*
+		 * 431, with :status as a literal so the encoder's table
+		 * is left alone; then we're done with the stream.
+		 */
+		static const unsigned char status_431[] = { 0x08, 0x03, '4', '3', '1' };
+		h2_send(conn, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, id, status_431, sizeof(status_431));
+		if (!end_stream) {
+			h2_rst_stream(conn, id, H2_NO_ERROR);
+		}
+		goto _cleanup;
+	}
+	if (!fields.method_buf.len || !fields.path.len || fields.bad) {
+		h2_rst_stream(conn, id, H2_PROTOCOL_ERROR);
+		goto _cleanup;
+	}
+
+	/*
+	 * Build the HTTP/1.1 request.
+	 */
+	struct h2_buf text = {0};
+	h2_buf_puts(&text, fields.method_buf.data);
+	h2_buf_puts(&text, " ");
+	h2_buf_puts(&text, fields.path.data);
+	h2_buf_puts(&text, " HTTP/1.1\r\n");
+	if (fields.authority.len && !fields.has_host) {
+		h2_buf_puts(&text, "Host: ");
+		h2_buf_puts(&text, fields.authority.data);
+		h2_buf_puts(&text, "\r\n");
+	}
+	if (fields.headers.len) {
+		h2_buf_put(&text, fields.headers.data, fields.headers.len);
+	}
+	if (dummy.cookies.len) {
+		h2_buf_puts(&text, "Cookie: ");
+		h2_buf_put(&text, dummy.cookies.data, dummy.cookies.len);
+		h2_buf_puts(&text, "\r\n");
+	}
+	h2_buf_puts(&text, "\r\n");
+
+	if (!h2_open_stream(conn, id, text.data, text.len, !strcmp(fields.method_buf.data, "HEAD"), end_stream)) {
+		h2_rst_stream(conn, id, H2_INTERNAL_ERROR);
+	}
+	free(text.data);
+
+_cleanup:
+	free(fields.method_buf.data);
+	free(fields.path.data);
+	free(fields.authority.data);
+	free(fields.headers.data);
+	free(dummy.cookies.data);
+}
+
+/*
+ * Apply a SETTINGS payload from the client.
+ */
+int h2_apply_settings(struct h2_conn * conn, const unsigned char * payload, size_t len) {
+	size_t i;
+	if (len % 6) {
+		return -1;
+	}
+	pthread_mutex_lock(&conn->lock);
+	for (i = 0; i < len; i += 6) {
+		unsigned int id = (payload[i] << 8) | payload[i + 1];
+		unsigned long value = h2_get32(payload + i + 2);
+		if (id == 0x4) {
+			/*
+			 * INITIAL_WINDOW_SIZE moves every open stream's window.
+			 */
+			if (value > 0x7FFFFFFF) {
+				pthread_mutex_unlock(&conn->lock);
+				return -1;
+			}
+			long delta = (long)value - conn->initial_window;
+			struct h2_stream * stream;
+			for (stream = conn->streams; stream; stream = stream->next) {
+				stream->send_window += delta;
+			}
+			conn->initial_window = value;
+		} else if (id == 0x5) {
+			if (value < H2_FRAME_SIZE || value > 0xFFFFFF) {
+				pthread_mutex_unlock(&conn->lock);
+				return -1;
+			}
+			conn->max_frame = value;
+		}
+	}
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+	return 0;
+}
+
+/*
+ * Decode base64url (HTTP2-Settings).
+ */
+size_t h2_base64url(const char * in, unsigned char * out, size_t max) {
+	unsigned long acc = 0;
+	int bits = 0;
+	size_t len = 0;
+	for (; *in && *in != '\r' && *in != '\n'; ++in) {
+		int v;
+		if (*in >= 'A' && *in <= 'Z') v = *in - 'A';
+		else if (*in >= 'a' && *in <= 'z') v = *in - 'a' + 26;
+		else if (*in >= '0' && *in <= '9') v = *in - '0' + 52;
+		else if (*in == '-') v = 62;
+		else if (*in == '_') v = 63;
+		else continue;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (len < max) {
+				out[len++] = (acc >> bits) & 0xFF;
+			}
+		}
+	}
+	return len;
+}
+
+/*
+ * We are draining: take no new streams and send GOAWAY with the last
+ * one we took, so the client retries anything newer elsewhere. Called
+ * from the drain with active_lock held, so it won't wait on a client
+ * that isn't reading. Returns -1 if the GOAWAY couldn't go out yet, 1
+ * once it has and no streams are left, 0 while some still are.
+ */
+int h2_drain(struct h2_conn * conn) {
+	if (!conn->goaway_sent) {
+		struct pollfd waiting = { conn->fd, POLLOUT, 0 };
+		if (poll(&waiting, 1, 0) != 1 || pthread_mutex_trylock(&conn->write_lock)) {
+			return -1;
+		}
+		unsigned char frame[17] = { 0, 0, 8, H2_GOAWAY, 0, 0, 0, 0, 0 };
+		pthread_mutex_lock(&conn->lock);
+		conn->goaway = 1;
+		h2_put32(frame + 9, conn->last_stream);
+		pthread_mutex_unlock(&conn->lock);
+		h2_put32(frame + 13, H2_NO_ERROR);
+		size_t sent = 0;
+		while (sent < sizeof(frame)) {
+			ssize_t w = write(conn->fd, frame + sent, sizeof(frame) - sent);
+			if (w <= 0 && errno != EINTR) {
+				break;
+			}
+			sent += w > 0 ? w : 0;
+		}
+		pthread_mutex_unlock(&conn->write_lock);
+		conn->goaway_sent = 1;
+	}
+	pthread_mutex_lock(&conn->lock);
+	int done = !conn->active;
+	pthread_mutex_unlock(&conn->lock);
+	return done;
+}
+
+/*
+ * Serve an HTTP/2 connection until the client goes away.
+ * upgrade_request is the HTTP/1.1 request that asked for h2c, which
+ * becomes stream 1; without it the client used prior knowledge and
+ * the first line of the preface has already been read.
+ */
+void h2_serve(struct socket_request * request, FILE * socket_stream, const char * upgrade_request, const char * upgrade_settings) {
+	struct h2_conn conn;
+	memset(&conn, 0, sizeof(conn));
+	conn.fd = fileno(socket_stream);
+	conn.in = socket_stream;
+	conn.request = request;
+	conn.send_window = H2_WINDOW;
+	conn.recv_window = H2_WINDOW;
+	conn.initial_window = H2_WINDOW;
+	conn.max_frame = H2_FRAME_SIZE;
+	conn.decoder.max_size = H2_TABLE_SIZE;
+	pthread_mutex_init(&conn.lock, NULL);
+	pthread_cond_init(&conn.cond, NULL);
+	pthread_mutex_init(&conn.write_lock, NULL);
+	pthread_mutex_lock(&active_lock);
+	request->h2 = &conn;
+	pthread_mutex_unlock(&active_lock);
+
+	/*
+	 * Our SETTINGS go first.
+	 */
+	unsigned char settings[12] = {
+		0x00, 0x03, 0, 0, 0, H2_MAX_STREAMS,
+		0x00, 0x06, (H2_HEADER_LIST >> 24) & 0xFF, (H2_HEADER_LIST >> 16) & 0xFF,
+		(H2_HEADER_LIST >> 8) & 0xFF, H2_HEADER_LIST & 0xFF
+	};
+	fflush(socket_stream);
+	h2_send(&conn, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+	char preface[sizeof(H2_PREFACE)];
+	size_t preface_len = upgrade_request ? strlen(H2_PREFACE) : strlen(H2_PREFACE) - strlen("PRI * HTTP/2.0\r\n");
+	if (upgrade_request) {
+		unsigned char client_settings[256];
+		size_t len = h2_base64url(upgrade_settings, client_settings, sizeof(client_settings));
+		h2_apply_settings(&conn, client_settings, len - len % 6);
+		conn.last_stream = 1;
+		int head = !strncmp(upgrade_request, "HEAD ", 5);
+		h2_open_stream(&conn, 1, upgrade_request, strlen(upgrade_request), head, 1);
+	}
+	if (fread(preface, 1, preface_len, socket_stream) != preface_len ||
+		memcmp(preface, H2_PREFACE + strlen(H2_PREFACE) - preface_len, preface_len)) {
+		h2_goaway(&conn, H2_PROTOCOL_ERROR);
+		conn.dead = 1;
+	}
+
+	/*
+	 * Frame loop.
+	 */
+	unsigned char * payload = malloc(H2_FRAME_SIZE);
+	struct h2_buf block = {0};
+	unsigned int block_stream = 0;
+	int block_end_stream = 0;
+	while (!conn.dead) {
+		unsigned char header[9];
+		if (fread(header, 1, 9, socket_stream) != 9) {
+			break;
+		}
+		size_t len = (header[0] << 16) | (header[1] << 8) | header[2];
+		int type = header[3];
+		int flags = header[4];
+		unsigned int id = h2_get32(header + 5) & 0x7FFFFFFF;
+		if (len > H2_FRAME_SIZE) {
+			h2_goaway(&conn, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (len && fread(payload, 1, len, socket_stream) != len) {
+			break;
+		}
+		if (block_stream && type != H2_CONTINUATION) {
+			/*
+			 * Header blocks can't be interleaved with anything.
+			 */
+			h2_goaway(&conn, H2_PROTOCOL_ERROR);
+			break;
+		}
+
+		/*
+		 * Strip padding and priority from frames that carry them.
+		 */
+		unsigned char * data = payload;
+		size_t data_len = len;
+		if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_PADDED)) {
+			if (!len || payload[0] >= len) {
+				h2_goaway(&conn, H2_PROTOCOL_ERROR);
+				break;
+			}
+			data_len = len - 1 - payload[0];
+			data = payload + 1;
+		}
+		if (type == H2_HEADERS && (flags & H2_PRIORITY_FLAG)) {
+			if (data_len < 5) {
+				h2_goaway(&conn, H2_PROTOCOL_ERROR);
+				break;
+			}
+			data += 5;
+			data_len -= 5;
+		}
+
+		switch (type) {
+			case H2_HEADERS:
+			case H2_CONTINUATION:
+				if (!id || (type == H2_CONTINUATION && id != block_stream) ||
+					block.len + data_len > H2_HEADER_BLOCK) {
+					h2_goaway(&conn, H2_PROTOCOL_ERROR);
+					conn.dead = 1;
+					break;
+				}
+				if (type == H2_HEADERS) {
+					block.len = 0;
+					block_stream = id;
+					block_end_stream = flags & H2_END_STREAM;
+				}
+				h2_buf_put(&block, data, data_len);
+				if (flags & H2_END_HEADERS) {
+					h2_headers(&conn, block_stream, block_end_stream, &block);
+					block_stream = 0;
+				}
+				break;
+			case H2_DATA: {
+				struct h2_stream * stream = id ? h2_find_stream(&conn, id) : NULL;
+				if (!id) {
+					h2_goaway(&conn, H2_PROTOCOL_ERROR);
+					conn.dead = 1;
+					break;
+				}
+				/*
+				 * Queue the data for the stream's feeder, which gives
+				 * the window back as the handler reads it. Padding and
+				 * data for streams we aren't reading are credited now.
+				 */
+				size_t credit = len - data_len;
+				int overrun = 0;
+				pthread_mutex_lock(&conn.lock);
+				conn.recv_window -= len;
+				if (conn.recv_window < 0) {
+					overrun = 1;
+				} else if (stream) {
+					stream->recv_window -= len;
+					if (stream->recv_window < 0) {
+						overrun = 2;
+						credit = len;
+						stream->reset = 1;
+						shutdown(stream->fd, SHUT_RDWR);
+						pthread_cond_broadcast(&conn.cond);
+					} else {
+						stream->recv_window += credit;
+						h2_buf_put(&stream->inbox, data, data_len);
+						pthread_cond_broadcast(&conn.cond);
+					}
+				} else {
+					credit = len;
+				}
+				conn.recv_window += credit;
+				pthread_mutex_unlock(&conn.lock);
+				if (overrun == 1) {
+					h2_goaway(&conn, H2_FLOW_CONTROL_ERROR);
+					conn.dead = 1;
+					break;
+				}
+				if (credit) {
+					h2_window_update(&conn, 0, credit);
+				}
+				if (overrun == 2) {
+					h2_rst_stream(&conn, id, H2_FLOW_CONTROL_ERROR);
+					h2_stream_remote_close(stream);
+					break;
+				}
+				if (!stream) {
+					break;
+				}
+				if (flags & H2_END_STREAM) {
+					h2_stream_remote_close(stream);
+				} else if (len - data_len) {
+					h2_window_update(&conn, id, len - data_len);
+				}
+				break;
+			}
+			case H2_RST_STREAM: {
+				struct h2_stream * stream;
+				int remote_open = 0;
+				pthread_mutex_lock(&conn.lock);
+				for (stream = conn.streams; stream && stream->id != id; stream = stream->next);
+				if (stream) {
+					stream->reset = 1;
+					remote_open = stream->remote_open;
+					shutdown(stream->fd, SHUT_RDWR);
+					pthread_cond_broadcast(&conn.cond);
+				}
+				pthread_mutex_unlock(&conn.lock);
+				if (remote_open) {
+					h2_stream_remote_close(stream);
+				}
+				break;
+			}
+			case H2_SETTINGS:
+				if (flags & H2_ACK) {
+					break;
+				}
+				if (id || h2_apply_settings(&conn, payload, len) < 0) {
+					h2_goaway(&conn, H2_PROTOCOL_ERROR);
+					conn.dead = 1;
+					break;
+				}
+				h2_send(&conn, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+				break;
+			case H2_PING:
+				if (len != 8) {
+					h2_goaway(&conn, H2_FRAME_SIZE_ERROR);
+					conn.dead = 1;
+					break;
+				}
+				if (!(flags & H2_ACK)) {
+					h2_send(&conn, H2_PING, H2_ACK, 0, payload, 8);
+				}
+				break;
+			case H2_WINDOW_UPDATE: {
+				if (len != 4) {
+					h2_goaway(&conn, H2_FRAME_SIZE_ERROR);
+					conn.dead = 1;
+					break;
+				}
+				unsigned long increment = h2_get32(payload) & 0x7FFFFFFF;
+				pthread_mutex_lock(&conn.lock);
+				if (!id) {
+					conn.send_window += increment;
+				} else {
+					struct h2_stream * stream;
+					for (stream = conn.streams; stream; stream = stream->next) {
+						if (stream->id == id) {
+							stream->send_window += increment;
+						}
+					}
+				}
+				pthread_cond_broadcast(&conn.cond);
+				pthread_mutex_unlock(&conn.lock);
+				break;
+			}
+			case H2_GOAWAY:
+				conn.goaway = 1;
+				break;
+			case H2_PUSH_PROMISE:
+				h2_goaway(&conn, H2_PROTOCOL_ERROR);
+				conn.dead = 1;
+				break;
+			default:
+				/*
+				 * PRIORITY and unknown frame types are ignored.
+				 */
+				break;
+		}
+	}
+
+	/*
+	 * Stop taking request data, let the streams finish and wait for them.
+	 */
+	struct h2_stream * stream;
+	while (1) {
+		pthread_mutex_lock(&conn.lock);
+		for (stream = conn.streams; stream && !stream->remote_open; stream = stream->next);
+		pthread_mutex_unlock(&conn.lock);
+		if (!stream) {
+			break;
+		}
+		h2_stream_remote_close(stream);
+	}
+	pthread_mutex_lock(&conn.lock);
+	conn.dead = 1;
+	pthread_cond_broadcast(&conn.cond);
+	while (conn.active) {
+		pthread_cond_wait(&conn.cond, &conn.lock);
+	}
+	pthread_mutex_unlock(&conn.lock);
+	pthread_mutex_lock(&active_lock);
+	request->h2 = NULL;
+	pthread_mutex_unlock(&active_lock);
+	if (!conn.goaway_sent) {
+		h2_goaway(&conn, H2_NO_ERROR);
+	}
+
+	free(payload);
+	free(block.data);
+	hpack_free(&conn.decoder);
+	pthread_mutex_destroy(&conn.lock);
+	pthread_cond_destroy(&conn.cond);
+	pthread_mutex_destroy(&conn.write_lock);
+}
+#endif
+
+/*
+ * Graceful upgrades.
+ * On SIGUSR2 (or SIGHUP) we exec whatever binary now sits at our
+ * path, passing it our listening sockets in UPGRADE_ENV as
+ * fd:port:tls triples. Once it says it is accepting, by writing to
+ * the pipe in UPGRADE_READY_ENV, we stop accepting, close
+ * keep-alive connections that are waiting for a request, let the
+ * rest finish what they are doing for up to DRAIN_DEADLINE seconds,
+ * and exit. The sockets never close, so nobody gets refused.
+ *
+ * Responses sent while draining carry Connection: close. A client
+ * that has been quiet for DRAIN_IDLE seconds is unlikely to be in
+ * the middle of sending a request, so those connections are closed
+ * without waiting for one.
+ */
+volatile int draining = 0;
+int wake_pipe[2] = { -1, -1 };
+char exec_path[PATH_MAX];
+char ** exec_argv;
+
+pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+struct socket_request * active_head = NULL;
+int active_count = 0;
+
+/*
+ * Connections are added by the accept loop rather than their own
+ * thread, so a drain can't miss one whose thread hasn't started yet.
+ */
+void active_add(struct socket_request * request) {
+	pthread_mutex_lock(&active_lock);
+	request->active_prev = NULL;
+	request->active_next = active_head;
+	if (active_head) {
+		active_head->active_prev = request;
+	}
+	active_head = request;
+	active_count++;
+	pthread_mutex_unlock(&active_lock);
+}
+
+void active_remove(struct socket_request * request) {
+	pthread_mutex_lock(&active_lock);
+	if (request->active_prev) {
+		request->active_prev->active_next = request->active_next;
+	} else {
+		active_head = request->active_next;
+	}
+	if (request->active_next) {
+		request->active_next->active_prev = request->active_prev;
+	}
+	active_count--;
+	pthread_mutex_unlock(&active_lock);
+}
+
+#if ENABLE_XSENDFILE
+/*
+ * X-Sendfile.
+ * A CGI script that has decided a client may have a file can name
+ * it in an X-Sendfile header (a path on disk) or an X-Accel-Redirect
+ * header (a URL path under the document root). We drop whatever body
+ * the script writes and serve the file as we would a static one, with
+ * ranges and conditionals, while the script exits. The file has to
+ * resolve to somewhere inside the document root or a -X directory.
+ */
+char * sendfile_roots[SENDFILE_ROOTS + 1];
+int sendfile_root_count = 0;
+
+int sendfile_add_root(const char * dir) {
+	char resolved[PATH_MAX];
+	if (sendfile_root_count == SENDFILE_ROOTS + 1 || !realpath(dir, resolved)) {
+		return -1;
+	}
+	sendfile_roots[sendfile_root_count++] = strdup(resolved);
+	return 0;
+}
+
+static int sendfile_allowed(const char * path) {
+	int i;
+	for (i = 0; i < sendfile_root_count; ++i) {
+		size_t len = strlen(sendfile_roots[i]);
+		if (!strncmp(path, sendfile_roots[i], len) &&
+			(path[len] == '/' || path[len] == '\0' || sendfile_roots[i][len - 1] == '/')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Serve the file a script handed back. headers are the script's
+ * other headers; a length it sent for its own body is dropped.
+ */
+void sendfile_serve(struct socket_request * request, FILE * socket_stream, const char * target, int redirect,
+		const char * headers, size_t headers_len, struct file_request * fr, int head) {
+	char * path = (char *)target;
+	if (redirect) {
+		path = arena_alloc(&request->arena, strlen(PAGES_DIRECTORY) + strlen(target) + 1);
+		strcpy(path, PAGES_DIRECTORY);
+		strcat(path, target);
+		char * query = strchr(path, '?');
+		if (query) {
+			*query = '\0';
+		}
+		path = url_decode(&request->arena, path);
+	}
+	char resolved[PATH_MAX];
+	struct stat stats;
+	int file = -1;
+	if (path && realpath(path, resolved)) {
+		if (!sendfile_allowed(resolved)) {
+			fprintf(stderr, "[warn] CGI script tried to send %s, which is outside the allowed directories.\n", resolved);
+		} else {
+			file = open(resolved, O_RDONLY);
+		}
+	}
+	if (file >= 0 && (fstat(file, &stats) < 0 || !S_ISREG(stats.st_mode))) {
+		close(file);
+		file = -1;
+	}
+	if (file < 0) {
+		generic_response(socket_stream, "404 File Not Found", "The requested file could not be found.");
+		return;
+	}
+
+	char * kept = arena_alloc(&request->arena, headers_len + 64);
+	size_t kept_len = 0;
+	int typed = 0;
+	const char * line = headers;
+	while (line < headers + headers_len) {
+		const char * next = memchr(line, '\n', headers + headers_len - line);
+		next = next ? next + 1 : headers + headers_len;
+		if (!strncasecmp(line, "Content-Type:", 13)) {
+			typed = 1;
+		}
+		if (strncasecmp(line, "Content-Length:", 15)) {
+			memcpy(kept + kept_len, line, next - line);
+			kept_len += next - line;
+		}
+		line = next;
+	}
+	if (!typed) {
+		size_t mime_len;
+		const char * mime = mime_header(file_extension(strrchr(resolved, '/')), &mime_len);
+		memcpy(kept + kept_len, mime, mime_len);
+		kept_len += mime_len;
+	}
+	send_file(&request->out, socket_stream, file, &stats, FRAGMENT(STATUS_LINE("200 OK")),
+			kept, kept_len, fr, head);
+}
+#endif
+
+/*
+ * Parked connections.
+ * Once a response is completely queued the handler thread has
+ * nothing left to do but wait for the client, so the connection
+ * is handed to the parking thread instead. It feeds the queue to
+ * the socket as it becomes writable and starts a new handler for
+ * the connection when the queue is empty (or the client is gone).
+ */
+pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t park_once = PTHREAD_ONCE_INIT;
+struct socket_request * park_incoming = NULL;
+int park_pipe[2] = { -1, -1 };
+
+void *park_thread(void * unused) {
+	(void)unused;
+	struct socket_request ** parked = NULL;
+	struct pollfd * waiting = malloc(sizeof(struct pollfd));
+	size_t count = 0, size = 0, i;
+	while (1) {
+		waiting[0].fd = park_pipe[0];
+		waiting[0].events = POLLIN;
+		for (i = 0; i < count; ++i) {
+			waiting[i + 1].fd = parked[i]->fd;
+			waiting[i + 1].events = POLLOUT;
+		}
+		if (poll(waiting, count + 1, 1000) < 0) {
+			continue;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/*
+		 * Feed whoever can take more; resume whoever is done.
+		 */
+		size_t kept = 0;
+		for (i = 0; i < count; ++i) {
+			struct socket_request * request = parked[i];
+			if (waiting[i + 1].revents) {
+				size_t before = request->out.len;
+				outq_send(&request->out, request->fd);
+				if (request->out.len < before) {
+					request->parked_since = now.tv_sec;
+				}
+			}
+			if (request->out.len && now.tv_sec - request->parked_since >= PARK_TIMEOUT) {
+				request->out.failed = 1;
+				outq_clear(&request->out);
+			}
+			if (request->out.len) {
+				parked[kept++] = request;
+			} else {
+				pthread_create(&(request->thread), NULL, handleRequest, (void *)(request));
+			}
+		}
+		count = kept;
+
+		/*
+		 * Pick up newly parked connections.
+		 */
+		if (waiting[0].revents) {
+			char wake[64];
+			if (read(park_pipe[0], wake, sizeof(wake)) < 0) {
+				continue;
+			}
+			pthread_mutex_lock(&park_lock);
+			struct socket_request * incoming = park_incoming;
+			park_incoming = NULL;
+			pthread_mutex_unlock(&park_lock);
+			while (incoming) {
+				if (count == size) {
+					size = size ? size * 2 : 64;
+					parked = realloc(parked, size * sizeof(*parked));
+					waiting = realloc(waiting, (size + 1) * sizeof(*waiting));
+				}
+				incoming->parked_since = now.tv_sec;
+				parked[count++] = incoming;
+				incoming = incoming->next_free;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void park_init(void) {
+	if (pipe2(park_pipe, O_CLOEXEC) == 0) {
+		pthread_t parker;
+		pthread_create(&parker, NULL, park_thread, NULL);
+	}
+}
+
+/*
+ * Park a connection whose response is still queued; its handler
+ * returns right after. Connections fed by another handler and
+ * streams without a descriptor stay where they are (-1).
+ */
+int park_connection(struct socket_request * request, FILE * socket_stream, char * stdio_buf, int closing) {
+	if (request->internal || fileno(socket_stream) < 0) {
+		return -1;
+	}
+	pthread_once(&park_once, park_init);
+	if (park_pipe[1] < 0) {
+		return -1;
+	}
+#if ENABLE_TIMING
+	timing_finish(request->peer);
+#endif
+	request->parked = socket_stream;
+	request->parked_buf = stdio_buf;
+	request->parked_close = closing;
+	request->parked_last = response_close;
+	fcntl(request->fd, F_SETFL, fcntl(request->fd, F_GETFL) | O_NONBLOCK);
+	pthread_detach(request->thread);
+	pthread_mutex_lock(&park_lock);
+	request->next_free = park_incoming;
+	park_incoming = request;
+	pthread_mutex_unlock(&park_lock);
+	if (write(park_pipe[1], "", 1) < 0) {
+		perror("[warn] Failed to wake the parking thread");
+	}
+	return 0;
+}
+
+#if ENABLE_PROXY_PROTOCOL
+/*
+ * PROXY protocol.
+ * A proxy in front of us (-P, or ",proxy" on -U) starts every
+ * connection with a header naming the client, as a line of text
+ * (version 1) or a binary block (version 2). Exactly the header is
+ * read off the socket, so what follows is left for the request
+ * parser or the TLS handshake. A LOCAL or UNKNOWN header, which the
+ * proxy sends for its own health checks, leaves the address alone.
+ */
+static const unsigned char proxy_signature[12] = {
+	0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A
+};
+
+/*
+ * An IPv6 client has no room in request->address, which admission
+ * control and the status page look at; only its text is kept.
+ */
+static void proxy_client_v6(struct socket_request * request, const void * addr) {
+	request->address.sin_family = AF_UNSPEC;
+	inet_ntop(AF_INET6, addr, request->peer, sizeof(request->peer));
+}
+
+static void proxy_client_v4(struct socket_request * request, const void * addr, unsigned short port) {
+	request->address.sin_family = AF_INET;
+	memcpy(&request->address.sin_addr, addr, 4);
+	request->address.sin_port = port;
+	request->addr_len = sizeof(request->address);
+}
+
+static int proxy_v2(struct socket_request * request) {
+	unsigned char head[16 + 216];
+	if (recv(request->fd, head, 16, MSG_WAITALL) != 16) {
+		return -1;
+	}
+	size_t len = (head[14] << 8) | head[15];
+	size_t take = len < 216 ? len : 216;
+	if (recv(request->fd, head + 16, take, MSG_WAITALL) != (ssize_t)take) {
+		return -1;
+	}
+	while (len > take) {
+		/*
+		 * TLVs we have no use for.
+		 */
+		char skip[256];
+		size_t piece = len - take < sizeof(skip) ? len - take : sizeof(skip);
+		if (recv(request->fd, skip, piece, MSG_WAITALL) != (ssize_t)piece) {
+			return -1;
+		}
+		take += piece;
+	}
+	if ((head[12] & 0xF0) != 0x20) {
+		return -1;
+	}
+	if ((head[12] & 0x0F) == 0x00) {
+		return 0;
+	}
+	if ((head[12] & 0x0F) != 0x01) {
+		return -1;
+	}
+	if ((head[13] >> 4) == 1 && len >= 12) {
+		unsigned short port;
+		memcpy(&port, head + 24, 2);
+		proxy_client_v4(request, head + 16, port);
+	} else if ((head[13] >> 4) == 2 && len >= 36) {
+		proxy_client_v6(request, head + 16);
+	}
+	return 0;
+}
+
+static int proxy_v1(struct socket_request * request) {
+	char line[108];
+	size_t have = 0;
+	while (!have || line[have - 1] != '\n') {
+		/*
+		 * Take up to the end of the line, and no further.
+		 */
+		if (have == sizeof(line) - 1) {
+			return -1;
+		}
+		ssize_t got = recv(request->fd, line + have, sizeof(line) - 1 - have, MSG_PEEK);
+		if (got <= 0) {
+			return -1;
+		}
+		char * end = memchr(line + have, '\n', got);
+		size_t take = end ? (size_t)(end - (line + have)) + 1 : (size_t)got;
+		if (recv(request->fd, line + have, take, 0) != (ssize_t)take) {
+			return -1;
+		}
+		have += take;
+	}
+	if (have < 2 || line[have - 2] != '\r') {
+		return -1;
+	}
+	line[have - 2] = '\0';
+	if (!strncmp(line, "PROXY UNKNOWN", 13)) {
+		return 0;
+	}
+	char family[8], source[64], dest[64];
+	unsigned int source_port, dest_port;
+	if (sscanf(line, "PROXY %7s %63s %63s %u %u", family, source, dest, &source_port, &dest_port) != 5 ||
+			source_port > 65535) {
+		return -1;
+	}
+	unsigned char addr[16];
+	if (!strcmp(family, "TCP4") && inet_pton(AF_INET, source, addr) == 1) {
+		proxy_client_v4(request, addr, htons(source_port));
+	} else if (!strcmp(family, "TCP6") && inet_pton(AF_INET6, source, addr) == 1) {
+		proxy_client_v6(request, addr);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the PROXY header a connection starts with; -1 if it has none
+ * (or it is broken), in which case the connection should be dropped.
+ */
+int proxy_header_read(struct socket_request * request) {
+	struct timeval wait = { PROXY_HEADER_WAIT, 0 };
+	setsockopt(request->fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+	unsigned char start[16];
+	int result = -1;
+	if (recv(request->fd, start, sizeof(start), MSG_PEEK | MSG_WAITALL) == sizeof(start)) {
+		if (!memcmp(start, proxy_signature, sizeof(proxy_signature))) {
+			result = proxy_v2(request);
+		} else if (!memcmp(start, "PROXY ", 6)) {
+			result = proxy_v1(request);
+		}
+	}
+	wait.tv_sec = 0;
+	setsockopt(request->fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+	return result;
+}
+#endif
+
+#if ENABLE_CAPTURE
+/*
+ * Request capture.
+ * With -R, every request is appended to a log that replay can run
+ * against a server later: which connection it came in on, when,
+ * what status it got, and its request line and headers. Bodies are
+ * not kept, only their length, and neither are credentials: the log
+ * is only readable by us, and Cookie and Authorization values are
+ * replaced with CAPTURE_REDACTED. Each record goes out in one write to
+ * a file opened for appending, so records from different threads
+ * don't interleave, and an upgraded server carries on the same log.
+ * Connection numbers come from a counter in the log's header, which
+ * every process writing the log has mapped, so an upgraded server
+ * carries on numbering where the old one is (and while it drains)
+ * instead of starting over.
+ */
+struct capture_header {
+	char     magic[8];      /* CAPTURE_MAGIC */
+	uint64_t start;         /* Wall clock time the log was started, in microseconds */
+	uint64_t connections;   /* Connection numbers handed out so far */
+};
+
+struct capture_record {
+	uint64_t usec;          /* Since the start, when the request was read */
+	uint64_t body;          /* Request body length (not logged) */
+	uint32_t conn;          /* Connection, numbered from 1 */
+	uint16_t status;        /* Response status, 0 if none was sent */
+	uint16_t reserved;
+	uint32_t len;           /* Request line and headers that follow, padded to 8 */
+	uint32_t padding;
+};
+
+int capture_fd = -1;
+uint64_t capture_start = 0;
+struct capture_header * capture_shared = NULL;
+
+static uint64_t capture_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int capture_open(const char * path) {
+	capture_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (capture_fd < 0) {
+		perror(path);
+		return -1;
+	}
+	struct capture_header header;
+	ssize_t got = pread(capture_fd, &header, sizeof(header), 0);
+	if (got == 0) {
+		memcpy(header.magic, CAPTURE_MAGIC, 8);
+		header.start = capture_now();
+		header.connections = 0;
+		if (write(capture_fd, &header, sizeof(header)) != sizeof(header)) {
+			perror(path);
+			return -1;
+		}
+	} else if (got != sizeof(header) || memcmp(header.magic, CAPTURE_MAGIC, 8)) {
+		fprintf(stderr, "%s is not a capture log.\n", path);
+		return -1;
+	}
+	capture_start = header.start;
+	capture_shared = mmap(NULL, sizeof(header), PROT_READ | PROT_WRITE, MAP_SHARED, capture_fd, 0);
+	if (capture_shared == MAP_FAILED) {
+		perror(path);
+		capture_shared = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Put the request back together from its parsed pieces, ready to log
+ * once we know how it was answered.
+ */
+void capture_request(struct socket_request * request, vector_t * queue, int request_type,
+		const char * filename, const char * querystring, const char * http_version, unsigned long c_length) {
+	static const char * method_names[] = { "-", "GET", "POST", "HEAD" };
+	size_t size = sizeof(struct capture_record) + 72 + strlen(filename) +
+		(querystring ? strlen(querystring) : 0) + strlen(http_version);
+	unsigned int i;
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = vector_at(queue, i);
+		size_t name_len = strlen(name);
+		size += name_len + strlen(name + name_len + 2) + 4 + sizeof(CAPTURE_REDACTED);
+	}
+	char * out = arena_alloc(&request->arena, size);
+	struct capture_record * record = (struct capture_record *)out;
+	size_t len = sizeof(struct capture_record);
+	len += sprintf(out + len, "%s %s%s%s %s\r\n", method_names[request_type], filename,
+			querystring ? "?" : "", querystring ? querystring : "", http_version);
+	for (i = 1; i < queue->size; ++i) {
+		const char * name = vector_at(queue, i);
+		const char * value = name + strlen(name) + 2;
+		if (!strcasecmp(name, "Cookie") || !strcasecmp(name, "Authorization") ||
+			!strcasecmp(name, "Proxy-Authorization")) {
+			value = CAPTURE_REDACTED;
+		}
+		len += sprintf(out + len, "%s: %s\r\n", name, value);
+	}
+	memcpy(out + len, "\r\n", 2);
+	len += 2;
+	record->len = len - sizeof(struct capture_record);
 
 	/*
-	 * Close the respective pipe
+	 * Records are padded to eight bytes so the next one's header
+	 * can be read in place.
 	 */
-	close(cgi_w->fd);
-	close(cgi_w->fd2);
+	while (len % 8) {
+		out[len++] = '\0';
+	}
+	if (!request->capture_id) {
+		request->capture_id = __atomic_add_fetch(&capture_shared->connections, 1, __ATOMIC_RELAXED);
+	}
+	record->usec = capture_now() - capture_start;
+	record->conn = request->capture_id;
+	record->body = c_length;
+	record->status = 0;
+	record->reserved = 0;
+	record->padding = 0;
+	request->capture = out;
+	request->capture_len = len;
+}
+
+/*
+ * Log the current request, if there is one.
+ */
+void capture_write(struct socket_request * request) {
+	if (!request->capture) {
+		return;
+	}
+#if ENABLE_TIMING
+	((struct capture_record *)request->capture)->status = timing.status;
+#endif
+	if (write(capture_fd, request->capture, request->capture_len) < 0) {
+		perror("[warn] Failed to write to the capture log");
+	}
+	request->capture = NULL;
+}
+#endif
+
+/*
+ * Tell a client that sent Expect: 100-continue to go ahead with its
+ * body. Anything still queued for it goes out first.
+ */
+int send_continue(struct socket_request * request, FILE * socket_stream) {
+	outq_append(&request->out, FRAGMENT("HTTP/1.1 100 Continue\r\n\r\n"));
+	return outq_flush(&request->out, socket_stream, 0);
+}
+
+#if ENABLE_MODULES
+/*
+ * Handler modules.
+ * Shared objects listed in the -m file are loaded at startup and
+ * mounted on path prefixes. A request under a prefix is handed to
+ * the module on the handler thread, with callbacks that read the
+ * body from the connection and queue the response on it, so slow
+ * clients and parking work as they do for everything else.
+ */
+struct module_mount {
+	char *                    prefix;
+	size_t                    prefix_len;
+	struct cgiserver_module * module;
+	void *                    state;
+} module_mounts[MODULE_MOUNTS];
+int module_mount_count = 0;
+
+/*
+ * Read a module file: one "/prefix module.so [argument]" per line,
+ * # for comments.
+ */
+int module_load_config(const char * path) {
+	FILE * config = fopen(path, "re");
+	if (!config) {
+		perror(path);
+		return -1;
+	}
+	char line[PATH_MAX * 2];
+	int line_no = 0;
+	while (fgets(line, sizeof(line), config)) {
+		line_no++;
+		char * prefix = strtok(line, " \t\r\n");
+		if (!prefix || prefix[0] == '#') {
+			continue;
+		}
+		char * object = strtok(NULL, " \t\r\n");
+		char * argument = strtok(NULL, "\r\n");
+		while (argument && (*argument == ' ' || *argument == '\t')) {
+			argument++;
+		}
+		const char * error = NULL;
+		struct cgiserver_module * module = NULL;
+		void * handle = NULL;
+		if (prefix[0] != '/' || !object) {
+			error = "expected /prefix module.so [argument]";
+		} else if (module_mount_count == MODULE_MOUNTS) {
+			error = "too many modules";
+		} else if (!(handle = dlopen(object, RTLD_NOW | RTLD_LOCAL))) {
+			error = dlerror();
+		} else if (!(module = dlsym(handle, "cgiserver_module"))) {
+			error = "no cgiserver_module in it";
+		} else if (module->abi != CGISERVER_MODULE_ABI || !module->handle) {
+			error = "built for a different version of module.h";
+		}
+		struct module_mount * mount = &module_mounts[module_mount_count];
+		mount->state = NULL;
+		if (!error && module->init && module->init(prefix, argument && *argument ? argument : NULL, &mount->state) < 0) {
+			error = "its init failed";
+		}
+		if (error) {
+			fprintf(stderr, "%s:%d: %s: %s\n", path, line_no, object ? object : prefix, error);
+			fclose(config);
+			return -1;
+		}
+		mount->prefix = strdup(prefix);
+		mount->prefix_len = strlen(prefix);
+		mount->module = module;
+		module_mount_count++;
+		fprintf(stderr, "[info] Module %s mounted on %s.\n", module->name ? module->name : object, prefix);
+	}
+	fclose(config);
+	return 0;
+}
+
+struct module_mount * module_match(const char * filename) {
+	struct module_mount * best = NULL;
+	int i;
+	for (i = 0; i < module_mount_count; ++i) {
+		struct module_mount * mount = &module_mounts[i];
+		if (path_under(filename, mount->prefix, mount->prefix_len) &&
+				(!best || mount->prefix_len > best->prefix_len)) {
+			best = mount;
+		}
+	}
+	return best;
+}
+
+/*
+ * One module request in progress; req.server and res.server point here.
+ */
+struct module_call {
+	struct cgiserver_request  req;
+	struct cgiserver_response res;
+	struct socket_request *   request;
+	FILE *                    stream;
+	header_block_t            hb;
+	unsigned long             body_left;    /* Request body not read yet */
+	int                       expect;       /* Client waits for 100 Continue */
+	int                       head;
+	int                       begun;
+	int                       chunked;
+	int                       close;        /* The connection can't be reused */
+	long                      length_left;  /* Of a declared Content-Length, or -1 */
+};
+
+static long module_read_body(struct cgiserver_request * req, void * buf, size_t len) {
+	struct module_call * call = req->server;
+	if (!call->body_left || !len) {
+		return 0;
+	}
+	if (call->expect) {
+		call->expect = 0;
+		if (send_continue(call->request, call->stream) < 0) {
+			return -1;
+		}
+	}
+	if (len > call->body_left) {
+		len = call->body_left;
+	}
+	size_t got = fread(buf, 1, len, call->stream);
+	if (!got) {
+		call->close = 1;
+		return -1;
+	}
+	call->body_left -= got;
+	return got;
+}
+
+static int module_begin(struct cgiserver_response * res, const char * status, const char * headers, long content_length) {
+	struct module_call * call = res->server;
+	char line[128];
+	int len = snprintf(line, sizeof(line), "HTTP/1.1 %s\r\nServer: " VERSION_STRING "\r\n", status);
+	if (call->begun || len < 0 || len >= (int)sizeof(line)) {
+		return -1;
+	}
+	header_begin(&call->hb, line, len);
+	if (headers && header_add(&call->hb, headers, strlen(headers)) < 0) {
+		fprintf(stderr, "[warn] Module headers for %s did not fit.\n", call->req.path);
+		return -1;
+	}
+	call->begun = 1;
+	call->length_left = content_length;
+	if (content_length >= 0) {
+		header_content_length(&call->hb, content_length);
+	} else if (!strcmp(call->req.version, "HTTP/1.1")) {
+		header_add(&call->hb, FRAGMENT("Transfer-Encoding: chunked\r\n"));
+		call->chunked = !call->head;
+	} else {
+		header_add(&call->hb, FRAGMENT("Connection: close\r\n"));
+		call->close = 1;
+	}
+	header_end(&call->hb);
+	outq_append(&call->request->out, call->hb.data, call->hb.len);
+	call->hb.len = 0;
+	return 0;
+}
+
+/*
+ * Account for len more bytes of body; a module that sends more
+ * than it declared has its response cut off.
+ */
+static int module_body(struct module_call * call, size_t len) {
+	if (!call->begun || call->request->out.failed) {
+		return -1;
+	}
+	if (call->length_left >= 0) {
+		if (len > (unsigned long)call->length_left) {
+			fprintf(stderr, "[warn] Module sent more than its Content-Length for %s.\n", call->req.path);
+			call->close = 1;
+			return -1;
+		}
+		call->length_left -= len;
+	}
+	return 0;
+}
+
+static int module_write(struct cgiserver_response * res, const void * data, size_t len) {
+	struct module_call * call = res->server;
+	if (module_body(call, len) < 0) {
+		return -1;
+	}
+	if (call->head || !len) {
+		return 0;
+	}
+	outq_chunk(&call->request->out, &call->hb, !call->chunked, data, len);
+	return outq_flush(&call->request->out, call->stream, OUTPUT_LIMIT);
+}
+
+static int module_send_file(struct cgiserver_response * res, int fd, size_t offset, size_t len) {
+	struct module_call * call = res->server;
+	if (module_body(call, len) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (call->head || !len) {
+		close(fd);
+		return 0;
+	}
+	struct outq * q = &call->request->out;
+	if (call->chunked) {
+		char size_line[24];
+		size_t size_len = fast_utox(size_line, len);
+		size_line[size_len++] = '\r';
+		size_line[size_len++] = '\n';
+		outq_append(q, size_line, size_len);
+	}
+	outq_file(q, fd, offset, len);
+	if (call->chunked) {
+		outq_append(q, "\r\n", 2);
+	}
+	return outq_flush(q, call->stream, OUTPUT_LIMIT);
+}
+
+/*
+ * Run a module for a request. Returns 1 if the connection has
+ * to be closed afterwards.
+ */
+int module_call(struct socket_request * request, FILE * socket_stream, struct module_mount * mount,
+		vector_t * queue, int request_type, char * filename, char * querystring, char * http_version,
+		unsigned long c_length, int expect_continue) {
+	static const char * method_names[] = { "-", "GET", "POST", "HEAD" };
+	struct module_call * call = arena_alloc(&request->arena, sizeof(struct module_call));
+	memset(call, 0, sizeof(struct module_call));
+	call->request = request;
+	call->stream = socket_stream;
+	call->body_left = c_length;
+	call->expect = expect_continue;
+	call->head = request_type == 3;
+	call->length_left = -1;
+
+	struct cgiserver_header * headers = arena_alloc(&request->arena, queue->size * sizeof(struct cgiserver_header));
+	unsigned int i;
+	for (i = 1; i < queue->size; ++i) {
+		headers[i - 1].name = vector_at(queue, i);
+		headers[i - 1].value = headers[i - 1].name + strlen(headers[i - 1].name) + 2;
+	}
+
+	call->req.method = method_names[request_type];
+	call->req.path = filename;
+	call->req.query = querystring;
+	call->req.version = http_version;
+	call->req.remote_addr = request->peer;
+	call->req.prefix = mount->prefix;
+	call->req.headers = headers;
+	call->req.header_count = queue->size - 1;
+	call->req.content_length = c_length;
+	call->req.read_body = module_read_body;
+	call->req.server = call;
+	call->res.begin = module_begin;
+	call->res.write = module_write;
+	call->res.send_file = module_send_file;
+	call->res.server = call;
+
+	int result = mount->module->handle(mount->state, &call->req, &call->res);
+	if (!call->begun) {
+		if (result == 0) {
+			fprintf(stderr, "[warn] Module for %s returned without a response.\n", filename);
+		}
+		generic_response(socket_stream, "500 Internal Server Error", "The request could not be handled.");
+	} else if (call->length_left > 0) {
+		/*
+		 * Short of what it promised; the client can only
+		 * find out when we hang up.
+		 */
+		call->close = 1;
+	} else if (call->chunked) {
+		outq_chunk(&request->out, &call->hb, 0, NULL, 0);
+	}
 
 	/*
-	 * Free the data we were sent.
+	 * Skip whatever of the body the module didn't want, unless the
+	 * client is still waiting to be asked for it.
 	 */
-	free(onwhat);
-	return NULL;
+	if (call->body_left && call->expect) {
+		return 1;
+	}
+	while (call->body_left && !call->close) {
+		char discard[CGI_POST];
+		if (module_read_body(&call->req, discard, sizeof(discard)) <= 0) {
+			return 1;
+		}
+	}
+	return call->close;
 }
+#endif
 
 /*
  * Handle an incoming connection request.
  */
 void *handleRequest(void *socket) {
 	struct socket_request * request = (struct socket_request *)socket;
+	char * stdio_buf = NULL;  /* Pooled buffer behind socket_stream */
+	char * line_buf = NULL;   /* Pooled buffer for request header lines */
+	char * io_buf = NULL;     /* Pooled buffer for file and CGI bodies */
+#if ENABLE_MICROCACHE
+	struct cache_entry * cache_fill = NULL; /* Cache placeholder this response fills */
+#endif
+#if ENABLE_SCHED
+	int sched_held = -1;      /* Class whose worker the request holds */
+	double sched_start = 0;   /* ...since when */
+#endif
+	FILE * socket_stream = NULL;
+
+	if (request->parked) {
+		/*
+		 * Back from the parking thread, the last response delivered.
+		 */
+		socket_stream = request->parked;
+		stdio_buf = request->parked_buf;
+		request->parked = NULL;
+		response_close = request->parked_last;
+		fcntl(request->fd, F_SETFL, fcntl(request->fd, F_GETFL) & ~O_NONBLOCK);
+		line_buf = io_buffer_get();
+		io_buf = io_buffer_get();
+		if (request->parked_close || request->out.failed) {
+			goto _close;
+		}
+		goto _resume;
+	}
+	STAT_ADD(connections, 1);
+
+	if (!request->addr_len) {
+		/*
+		 * Multishot accepts don't give us the peer address.
+		 */
+		request->addr_len = sizeof(request->address);
+		getpeername(request->fd, (struct sockaddr *)&request->address, &request->addr_len);
+	}
+#if ENABLE_PROXY_PROTOCOL
+	if (request->listener && request->listener->proxy && !request->internal) {
+		/*
+		 * The proxy tells us who the client is. Limiting clients
+		 * is left to the proxy, which sees all of their traffic.
+		 */
+		if (proxy_header_read(request) < 0) {
+			request->address.sin_family = AF_UNSPEC;
+			close(request->fd);
+			request->fd = -1;
+			goto _disconnect;
+		}
+	}
+#endif
+	if (!request->peer[0]) {
+		if (request->address.sin_family == AF_INET) {
+			inet_ntop(AF_INET, &request->address.sin_addr, request->peer, sizeof(request->peer));
+		} else {
+			/*
+			 * A Unix socket peer has no address of its own; don't
+			 * pass it off as loopback to scripts and backends.
+			 */
+			strcpy(request->peer, "unix:");
+		}
+	}
+
+#ifdef TCP_NOTSENT_LOWAT
+	if (!request->internal) {
+		/*
+		 * Keep what the kernel holds for the client small; the rest
+		 * waits in our output queue, where we can see it.
+		 */
+		int lowat = NOTSENT_LOWAT;
+		setsockopt(request->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+	}
+#endif
+	if (!request->internal && listen_options.nodelay && request->listener && !request->listener->path) {
+		/*
+		 * Responses go out whole, so there is nothing for Nagle to
+		 * coalesce; don't let the last segment wait on an ACK.
+		 */
+		setsockopt(request->fd, IPPROTO_TCP, TCP_NODELAY, &listen_options.nodelay, sizeof(int));
+	}
 
 	/*
 	 * Convert the socket into a standard file descriptor
 	 */
-	FILE *socket_stream = NULL;
-	socket_stream = fdopen(request->fd, "r+");
+#if ENABLE_TLS
+	if (request->listener && request->listener->tls && !request->internal) {
+		socket_stream = tls_open(request);
+		if (!socket_stream) {
+			/*
+			 * Handshake failed; the socket is already closed.
+			 */
+			goto _disconnect;
+		}
+	}
+#endif
+	if (!socket_stream) {
+		socket_stream = fdopen(request->fd, "r+");
+	}
 	if (!socket_stream) {
 		fprintf(stderr,"Ran out of a file descriptors, can not respond to request.\n");
 		goto _disconnect;
 	};
+	response_close = 0;
+	stdio_buf = io_buffer_get();
+	setvbuf(socket_stream, stdio_buf, _IOFBF, IO_BUFFER);
+	line_buf = io_buffer_get();
+	io_buf = io_buffer_get();
 
 	/*
 	 * Read requests until the client disconnects.
 	 */
+_resume:
 	while (1) {
-		vector_t * queue = alloc_vector();
-		char buf[HEADER_SIZE];
+		if (response_close) {
+			/*
+			 * We told the client this was the last response;
+			 * the new process takes it from here.
+			 */
+			break;
+		}
+		arena_reset(&request->arena);
+		unsigned long heap_calls = thread_heap_calls;
+#if ENABLE_PROFILER
+		if (__atomic_load_n(&profile_session, __ATOMIC_RELAXED) != profile_seen) {
+			profile_thread_join();
+		}
+#endif
+		vector_t * queue = arena_vector(&request->arena);
+		char * buf = line_buf;
+#if ENABLE_HTTP2
+		int h2c_upgrade = 0;          /* Upgrade: h2c was requested */
+		char * h2c_settings = NULL;   /* HTTP2-Settings value */
+#endif
 		while (!feof(socket_stream)) {
 			/*
 			 * While the client has not yet disconnected,
 			 * read request headers into the queue.
 			 */
+			if (!queue->size) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				request->idle_since = now.tv_sec;
+				request->idle = 1;
+			}
 			char * in = fgets( buf, HEADER_SIZE - 2, socket_stream );
+			request->idle = 0;
 
 			if (!in) {
 				/*
@@ -279,6 +8506,11 @@ void *handleRequest(void *socket) {
 				 */
 				break;
 			}
+#if ENABLE_TIMING
+			if (!queue->size) {
+				timing_start(request->fd);
+			}
+#endif
 
 			if (!strcmp(in, "\r\n") || !strcmp(in,"\n")) {
 				/*
@@ -287,29 +8519,105 @@ void *handleRequest(void *socket) {
 				break;
 			}
 
-			if (!strstr(in, "\n")) {
-				/*
-				 * Oversized request line.
-				 */
-				generic_response(socket_stream, "400 Bad Request", "Bad request: Request line was too long.");
-				delete_vector(queue);
-				goto _disconnect;
-			}
+#if ENABLE_HTTP2
+			if (!queue->size && !strcmp(in, "PRI * HTTP/2.0\r\n") && fileno(socket_stream) >= 0) {
+				/*
+				 * HTTP/2 connection preface, the client has prior knowledge.
+				 */
+				delete_vector(queue);
+				h2_serve(request, socket_stream, NULL, NULL);
+				goto _disconnect;
+			}
+#endif
+
+			/*
+			 * Store the request line in the queue for this request.
+			 */
+			char * request_line = store_line(&request->arena, in);
+			if (!request_line) {
+				/*
+				 * Oversized request line.
+				 */
+				generic_response(socket_stream, "400 Bad Request", "Bad request: Request line was too long.");
+				delete_vector(queue);
+				goto _disconnect;
+			}
+			vector_append(queue, (void*)request_line);
+#if ENABLE_HTTP2
+			if (!strncasecmp(request_line, "Upgrade:", 8) && strstr(request_line, "h2c")) {
+				h2c_upgrade = 1;
+			} else if (!strncasecmp(request_line, "HTTP2-Settings:", 15)) {
+				h2c_settings = request_line + 15;
+				while (*h2c_settings == ' ') {
+					h2c_settings++;
+				}
+			}
+#endif
+		}
+
+		if (feof(socket_stream)) {
+			/*
+			 * End of stream -> Client closed connection.
+			 */
+			delete_vector(queue);
+			break;
+		}
+
+		/*
+		 * If we are handing over to a new process, this is the last
+		 * request on the connection and the client should know it.
+		 */
+		response_close = draining;
+#if ENABLE_TIMING
+		timing_mark(PHASE_READ);
+		timing.line = (const char *)vector_at(queue, 0);
+#endif
+
+#if ENABLE_ADMIT
+		if (!(request->listener && request->listener->proxy) && !admit_request(&request->address)) {
 			/*
-			 * Store the request line in the queue for this request.
+			 * Over this client's request rate. We haven't read any
+			 * body, so the connection can't be reused.
 			 */
-			char * request_line = malloc((strlen(buf)+1) * sizeof(char));
-			strcpy(request_line, buf);
-			vector_append(queue, (void*)request_line);
+			header_block_t hb;
+			header_begin(&hb, FRAGMENT(STATUS_LINE("429 Too Many Requests")));
+			header_add(&hb, FRAGMENT("Retry-After: 1\r\nConnection: close\r\n"));
+			header_content_length(&hb, 0);
+			header_end(&hb);
+			send_response(socket_stream, &hb, NULL, 0);
+			delete_vector(queue);
+			goto _disconnect;
 		}
+#endif
 
-		if (feof(socket_stream)) {
+#if ENABLE_HTTP2
+		char * first_line = (char *)vector_at(queue, 0);
+		if (h2c_upgrade && h2c_settings && first_line && strstr(first_line, " HTTP/1.1") && fileno(socket_stream) >= 0 &&
+			(!strncmp(first_line, "GET ", 4) || !strncmp(first_line, "HEAD ", 5))) {
 			/*
-			 * End of stream -> Client closed connection.
+			 * Upgrade to HTTP/2. This request becomes stream 1, minus
+			 * the headers that asked for the upgrade.
 			 */
+			struct h2_buf upgraded = {0};
+			unsigned int l;
+			for (l = 0; l < queue->size; ++l) {
+				char * line = (char *)vector_at(queue, l);
+				if (strncasecmp(line, "Upgrade:", 8) && strncasecmp(line, "Connection:", 11) &&
+					strncasecmp(line, "HTTP2-Settings:", 15)) {
+					h2_buf_puts(&upgraded, line);
+					h2_buf_puts(&upgraded, "\r\n");
+				}
+			}
+			h2_buf_puts(&upgraded, "\r\n");
+			stream_write(socket_stream, FRAGMENT("HTTP/1.1 101 Switching Protocols\r\n"
+					"Connection: Upgrade\r\n"
+					"Upgrade: h2c\r\n\r\n"));
+			h2_serve(request, socket_stream, upgraded.data, h2c_settings);
+			free(upgraded.data);
 			delete_vector(queue);
-			break;
+			goto _disconnect;
 		}
+#endif
 
 		/*
 		 * Request variables
@@ -323,9 +8631,13 @@ void *handleRequest(void *socket) {
 		char * http_version      = NULL; /* HTTP version used in request */
 		unsigned long c_length   = 0L;   /* Content-Length, usually for POST */
 		char * c_type            = NULL; /* Content-Type, usually for POST */
+		int expect_continue      = 0;    /* Client waits for 100 Continue before its body */
+		int body_read            = 0;    /* Someone took the body off the connection */
 		char * c_cookie          = NULL; /* HTTP_COOKIE */
 		char * c_uagent          = NULL; /* User-Agent, for CGI */
 		char * c_referer         = NULL; /* Referer, for CGI */
+		char * c_encoding        = NULL; /* Accept-Encoding */
+		struct file_request fr   = { NULL, NULL, NULL, NULL }; /* Range and conditionals */
 
 		/*
 		 * Process headers
@@ -335,9 +8647,9 @@ void *handleRequest(void *socket) {
 			char * str = (char*)(vector_at(queue,i));
 
 			/*
-			 * Find the colon for a header
+			 * Split the header at its colon
 			 */
-			char * colon = strstr(str,": ");
+			char * colon = split_header(str);
 			if (!colon) {
 				if (i > 0) {
 					/*
@@ -349,92 +8661,19 @@ void *handleRequest(void *socket) {
 				}
 
 				/*
-				 * Request type
+				 * Request line
 				 */
-				int r_type_width = 0;
-				switch (str[0]) {
-					case 'G':
-						if (strstr(str, "GET ") == str) {
-							/*
-							 * GET: Retreive file
-							 */
-							r_type_width = 4;
-							request_type = 1;
-						} else {
-							goto _unsupported;
-						}
-						break;
-#if ENABLE_CGI
-					case 'P':
-						if (strstr(str, "POST ") == str) {
-							/*
-							 * POST: Send data to CGI
-							 */
-							r_type_width = 5;
-							request_type = 2;
-						} else {
-							goto _unsupported;
-						}
-						break;
-					case 'H':
-						if (strstr(str, "HEAD ") == str) {
-							/*
-							 * HEAD: Retreive headers only
-							 */
-							r_type_width = 5;
-							request_type = 3;
-						} else {
-							goto _unsupported;
-						}
-						break;
+#if ENABLE_TIMING
+				timing.line = NULL;
 #endif
-					default:
-						/*
-						 * Unsupported method.
-						 */
-						goto _unsupported;
-						break;
-				}
-
-				filename = str + r_type_width;
-				if (filename[0] == ' ' || filename[0] == '\r' || filename[0] == '\n') {
-					/*
-					 * Request was missing a filename or was in a form we don't want to handle.
-					 */
-					generic_response(socket_stream, "400 Bad Request", "Bad request: No filename.");
-					delete_vector(queue);
-					goto _disconnect;
-				}
-
-				/*
-				 * Get the HTTP version.
-				 */
-				http_version = strstr(filename, "HTTP/");
-				if (!http_version) {
-					/*
-					 * No HTTP version was present in the request.
-					 */
-					generic_response(socket_stream, "400 Bad Request", "Bad request: No HTTP version supplied.");
+				const char * error = parse_request_line(str, &request_type, &filename, &querystring, &http_version);
+				if (error) {
+					generic_response(socket_stream, "400 Bad Request", (char *)error);
 					delete_vector(queue);
 					goto _disconnect;
 				}
-				http_version[-1] = '\0';
-				char * tmp_newline;
-				tmp_newline = strstr(http_version, "\r\n");
-				if (tmp_newline) {
-					tmp_newline[0] = '\0';
-				}
-				tmp_newline = strstr(http_version, "\n");
-				if (tmp_newline) {
-					tmp_newline[0] = '\0';
-				}
-				/*
-				 * Get the query string.
-				 */
-				querystring = strstr(filename, "?");
-				if (querystring) {
-					querystring++;
-					querystring[-1] = '\0';
+				if (!request_type) {
+					goto _unsupported;
 				}
 			} else {
 
@@ -447,22 +8686,6 @@ void *handleRequest(void *socket) {
 					goto _disconnect;
 				}
 
-				/*
-				 * Split up the header.
-				 */
-				colon[0] = '\0';
-				colon += 2;
-				char * eol = strstr(colon,"\r");
-				if (eol) {
-					eol[0] = '\0';
-					eol[1] = '\0';
-				} else {
-					eol = strstr(colon,"\n");
-					if (eol) {
-						eol[0] = '\0';
-					}
-				}
-
 				/*
 				 * Process the header
 				 * str: colon
@@ -476,7 +8699,21 @@ void *handleRequest(void *socket) {
 					/*
 					 * Content-Length: Length of message (after these headers) in bytes.
 					 */
-					c_length = atol(colon);
+					if (parse_content_length(colon, &c_length) < 0) {
+						generic_response(socket_stream, "400 Bad Request", "Bad request: Malformed Content-Length.");
+						delete_vector(queue);
+						goto _disconnect;
+					}
+				} else if (!strcmp(str, "Expect")) {
+					/*
+					 * Expect: the client holds its body until we say so.
+					 */
+					if (strcasecmp(colon, "100-continue")) {
+						generic_response(socket_stream, "417 Expectation Failed", "Expectation failed: Only 100-continue is supported.");
+						delete_vector(queue);
+						goto _disconnect;
+					}
+					expect_continue = !request->internal && !strcmp(http_version, "HTTP/1.1");
 				} else if (!strcmp(str, "Content-Type")) {
 					/*
 					 * Content-Type: MIME-type of the message.
@@ -497,6 +8734,16 @@ void *handleRequest(void *socket) {
 					 * Referer page
 					 */
 					c_referer = colon;
+				} else if (!strcmp(str, "Accept-Encoding")) {
+					c_encoding = colon;
+				} else if (!strcmp(str, "Range")) {
+					fr.range = colon;
+				} else if (!strcmp(str, "If-Range")) {
+					fr.if_range = colon;
+				} else if (!strcmp(str, "If-None-Match")) {
+					fr.if_none_match = colon;
+				} else if (!strcmp(str, "If-Modified-Since")) {
+					fr.if_modified_since = colon;
 				}
 			}
 		}
@@ -525,37 +8772,120 @@ _unsupported:
 			delete_vector(queue);
 			goto _disconnect;
 		}
+#if ENABLE_TIMING
+		static const char * method_names[] = { "-", "GET", "POST", "HEAD" };
+		timing.method  = method_names[request_type];
+		timing.path    = filename;
+		timing.query   = querystring;
+		timing.version = http_version;
+#endif
+#if ENABLE_CAPTURE
+		if (capture_fd >= 0) {
+			capture_request(request, queue, request_type, filename, querystring, http_version, c_length);
+		}
+#endif
+
+		/*
+		 * Path prefix rules look at the path we would serve,
+		 * not at however the client chose to spell it.
+		 */
+		char * match_path = path_normalize(&request->arena, filename);
+		if (!match_path) {
+			generic_response(socket_stream, "400 Bad Request", "Bad request: Malformed escape in path.");
+			delete_vector(queue);
+			goto _disconnect;
+		}
+
+		if (c_length > body_limit(match_path)) {
+			/*
+			 * Refuse the body before the client sends it,
+			 * or before we read any of it.
+			 */
+			STAT_ADD(too_large, 1);
+			response_close = 1;
+			header_block_t hb;
+			header_begin(&hb, FRAGMENT(STATUS_LINE("413 Content Too Large")));
+			header_content_length(&hb, 0);
+			header_end(&hb);
+			send_response(socket_stream, &hb, NULL, 0);
+			delete_vector(queue);
+			goto _disconnect;
+		}
 
 		/*
 		 * Get some important information on the requested file
 		 * _filename: the local file name, relative to `.`
 		 */
-		_filename = calloc(sizeof(char) * (strlen(PAGES_DIRECTORY) + strlen(filename) + 2), 1);
-		strcat(_filename, PAGES_DIRECTORY);
-		strcat(_filename, filename);
-		if (strstr(_filename, "%")) {
+#if ENABLE_STATUS
+		if (!strcmp(filename, STATUS_PATH) && status_allowed(request)) {
+			status_page(socket_stream, request_type == 3);
+			goto _next;
+		}
+#endif
+#if ENABLE_PROFILER
+		if (profile_enabled && !strcmp(filename, PROFILE_PATH) && status_allowed(request)) {
+			profile_page(socket_stream, querystring, request_type == 3);
+			goto _next;
+		}
+#endif
+
+#if ENABLE_PROXY
+		struct proxy_route * route = proxy_match(match_path);
+		if (route) {
 			/*
-			 * Convert from URL encoded string.
+			 * Forwarded to an upstream server.
 			 */
-			char * buf = malloc(strlen(_filename) + 1);
-			char * pstr = _filename;
-			char * pbuf = buf;
-			while (*pstr) {
-				if (*pstr == '%') {
-					if (pstr[1] && pstr[2]) {
-						*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-						pstr += 2;
-					}
-				} else if (*pstr == '+') { 
-					*pbuf++ = ' ';
-				} else {
-					*pbuf++ = *pstr;
-				}
-				pstr++;
+#if ENABLE_SCHED
+			if (sched_enter(SCHED_PROXY, &sched_held, &sched_start) < 0) {
+				sched_refuse(socket_stream, c_length);
+				goto _next;
+			}
+#endif
+			if (expect_continue && c_length && send_continue(request, socket_stream) < 0) {
+				delete_vector(queue);
+				goto _disconnect;
+			}
+			body_read = 1;
+			if (proxy_request(request, socket_stream, route, queue, request_type, filename,
+						querystring, http_version, c_length, io_buf) < 0) {
+				delete_vector(queue);
+				goto _disconnect;
+			}
+			goto _next;
+		}
+#endif
+
+#if ENABLE_MODULES
+		struct module_mount * mount = module_match(match_path);
+		if (mount) {
+			/*
+			 * Handled in-process by a module.
+			 */
+#if ENABLE_SCHED
+			if (sched_enter(SCHED_MODULE, &sched_held, &sched_start) < 0) {
+				sched_refuse(socket_stream, c_length);
+				goto _next;
+			}
+#endif
+			body_read = 1;
+			if (module_call(request, socket_stream, mount, queue, request_type, filename,
+						querystring, http_version, c_length, expect_continue)) {
+				delete_vector(queue);
+				goto _disconnect;
 			}
-			*pbuf = '\0';
-			free(_filename);
-			_filename = buf;
+			goto _next;
+		}
+#endif
+
+		_filename = arena_alloc(&request->arena, strlen(PAGES_DIRECTORY) + strlen(filename) + 2);
+		_filename[0] = '\0';
+		strcat(_filename, PAGES_DIRECTORY);
+		strcat(_filename, filename);
+		_filename = url_decode(&request->arena, _filename);
+		if (!_filename) {
+			generic_response(socket_stream, "400 Bad Request", "Bad request: Malformed escape in path.");
+			delete_vector(queue);
+			goto _disconnect;
 		}
 
 		/*
@@ -565,45 +8895,64 @@ _unsupported:
 		 * that there is a / before any user-supplied directory, so contains("/../") or endswith("/..")
 		 * should be an appropriate restriction on user-supplied paths.
 		 */
-		if (strstr(_filename, "/../") || (strstr(_filename, "/..") == _filename + strlen(_filename) - 3)) {
+		if (path_escapes(_filename)) {
 			generic_response(socket_stream, "400 Bad Request", "Bad request");
-			free(_filename);
 			delete_vector(queue);
 			goto _disconnect;
 		}
 
-		/*
-		 * ext: the file extension, or NULL if it lacks one
-		 */
-		ext = filename + 1;
-		while (strstr(ext+1,".")) {
-			ext = strstr(ext+1,".");
-		}
-		if (ext == filename + 1) {
+#if ENABLE_IMAGE
+		if (image_map && image_find(_filename + strlen(PAGES_DIRECTORY))) {
 			/*
-			 * Either we didn't find a dot,
-			 * or that dot is at the front.
-			 * If the dot is at the front, it is not an extension,
-			 * but rather an extension-less hidden file.
+			 * Packed, so no need to look at the filesystem.
 			 */
-			ext = NULL;
+#if ENABLE_SCHED
+			if (sched_enter(SCHED_STATIC, &sched_held, &sched_start) < 0) {
+				sched_refuse(socket_stream, c_length);
+				goto _next;
+			}
+#endif
+			image_serve(&request->out, socket_stream, _filename + strlen(PAGES_DIRECTORY),
+					c_encoding, &fr, request_type == 3);
+			goto _next;
 		}
+#endif
+
+		/*
+		 * ext: the file extension, or NULL if it lacks one
+		 */
+		ext = file_extension(filename);
 
 		/*
 		 * Check if it's a directory (reliably)
 		 */
 		struct stat stats;
-		if (stat(_filename, &stats) == 0 && S_ISDIR(stats.st_mode)) {
+		int stat_ok = stat(_filename, &stats) == 0;
+#if ENABLE_TIMING
+		timing_mark(PHASE_FS);
+#endif
+		if (stat_ok && S_ISDIR(stats.st_mode)) {
 			if (_filename[strlen(_filename)-1] != '/') {
 				/*
 				 * Request for a directory without a trailing /.
 				 * Throw a 'moved permanently' and redirect the client
 				 * to the directory /with/ the /.
 				 */
-				fprintf(socket_stream, "HTTP/1.1 301 Moved Permanently\r\n");
-				fprintf(socket_stream, "Server: " VERSION_STRING "\r\n");
-				fprintf(socket_stream, "Location: %s/\r\n", filename);
-				fprintf(socket_stream, "Content-Length: 0\r\n\r\n");
+#if ENABLE_SCHED
+				if (sched_enter(SCHED_STATIC, &sched_held, &sched_start) < 0) {
+					sched_refuse(socket_stream, c_length);
+					goto _next;
+				}
+#endif
+				header_block_t hb;
+				header_begin(&hb, FRAGMENT(STATUS_LINE("301 Moved Permanently")));
+				if (header_add(&hb, FRAGMENT("Location: ")) ||
+					header_add(&hb, filename, strlen(filename)) ||
+					header_add(&hb, FRAGMENT("/\r\nContent-Length: 0\r\n\r\n"))) {
+					generic_response(socket_stream, "414 Request-URI Too Long", "Request-URI too long.");
+				} else {
+					send_response(socket_stream, &hb, NULL, 0);
+				}
 			} else {
 
 #if ENABLE_DEFAULTS
@@ -629,95 +8978,98 @@ _unsupported:
 						/*
 						 * This index exists, use it instead of the directory listing.
 						 */
-						_filename = realloc(_filename, strlen(index_php)+1);
+						_filename = arena_strdup(&request->arena, index_php);
 						stats = extra_stats;
-						memcpy(_filename, index_php, strlen(index_php)+1);
-						ext = _filename;
-						while (strstr(ext+1,".")) {
-							ext = strstr(ext+1,".");
-						}
+						ext = file_extension(_filename);
+#if ENABLE_TIMING
+						timing_mark(PHASE_INDEX);
+#endif
 						goto _use_file;
 					}
 					++index;
 				}
+#if ENABLE_TIMING
+				timing_mark(PHASE_INDEX);
+#endif
 #endif
 
 				/*
 				 * This is a directory, and we were requested properly.
 				 * A default file was not found, so display a listing.
 				 */
-				struct dirent **files = {0};
-				int filecount = -1;
-				filecount = scandir(_filename, &files, 0, alphasort);
-
-				/*
-				 * Prepare to print directory listing.
-				 */
-				fprintf(socket_stream, "HTTP/1.1 200 OK\r\n");
-				fprintf(socket_stream, "Server: " VERSION_STRING "\r\n");
-				fprintf(socket_stream, "Content-Type: text/html\r\n");
-
-				/*
-				 * Allocate some memory for the HTML
-				 */
-				char * listing = malloc(1024);
-				listing[0] = '\0';
-				strcat(listing, "<!doctype html><html><head><title>Directory Listing</title></head><body>");
-				int i = 0;
-				for (i = 0; i < filecount; ++i) {
-					/*
-					 * Get the full name relative the server so we can stat
-					 * this entry to see if it's a directory.
-					 */
-					char _fullname[strlen(_filename) + 1 + strlen(files[i]->d_name) + 1];
-					sprintf(_fullname, "%s/%s", _filename, files[i]->d_name);
-					if (stat(_fullname, &stats) == 0 && S_ISDIR(stats.st_mode)) {
-						/*
-						 * Ignore directories.
-						 */
-						free(files[i]);
-						continue;
-					}
-
-					/*
-					 * Append a link to the file.
-					 */
-					char _file[2 * strlen(files[i]->d_name) + 64];
-					sprintf(_file, "<a href=\"%s\">%s</a><br>\n", files[i]->d_name, files[i]->d_name);
-					listing = realloc(listing, strlen(listing) + strlen(_file) + 1);
-					strcat(listing, _file);
-					free(files[i]);
+#if ENABLE_SCHED
+				if (sched_enter(SCHED_LISTING, &sched_held, &sched_start) < 0) {
+					sched_refuse(socket_stream, c_length);
+					goto _next;
+				}
+#endif
+				size_t page_offset, page_limit;
+				if (listing_page_query(querystring, &page_offset, &page_limit)) {
+					listing_page(request, socket_stream, _filename, &stats, page_offset, page_limit, request_type == 3);
+				} else if (listing_send(request, socket_stream, _filename, http_version, request_type == 3)) {
+					delete_vector(queue);
+					goto _disconnect;
 				}
-				free(files);
-
-				/*
-				 * Close up our HTML
-				 */
-				listing = realloc(listing, strlen(listing) + 64);
-				strcat(listing,"</body></html>");
-
-				/*
-				 * Send out the listing.
-				 */
-				fprintf(socket_stream, "Content-Length: %zu\r\n", (sizeof(char) * strlen(listing)));
-				fprintf(socket_stream, "\r\n");
-				fprintf(socket_stream, "%s", listing);
-				free(listing);
 			}
 		} else {
 _use_file:
 			;
+#if ENABLE_SCHED
+			/*
+			 * Scripts take a CGI worker further down, once we know
+			 * the response isn't already cached.
+			 */
+#if ENABLE_CGI
+			if (!stat_ok || !(stats.st_mode & S_IXOTH))
+#endif
+			{
+				if (sched_enter(SCHED_STATIC, &sched_held, &sched_start) < 0) {
+					sched_refuse(socket_stream, c_length);
+					goto _next;
+				}
+			}
+#endif
+#if ENABLE_IO_URING
+			if (use_uring && stat_ok && !(stats.st_mode & S_IXOTH) && stats.st_size <= FLAT_BUFFER) {
+				/*
+				 * Small flat file, serve it through the connection's
+				 * ring. If it won't open, the path below deals with
+				 * the 404; larger files go there for sendfile.
+				 */
+				if (!request->ring) {
+					request->ring = uring_pool_get();
+				}
+				if (request->ring && uring_send_file(request->ring, &request->out, socket_stream, _filename, ext,
+							&fr, request_type == 3) == 0) {
+					goto _next;
+				}
+			}
+#endif
 			/*
 			 * Open the requested file.
 			 */
-			FILE * content = fopen(_filename, "rb");
-			if (!content) {
+			header_block_t hb;
+			const char * status = STATUS_LINE("200 OK");
+			struct file_request * conditions = &fr;
+			int content = open(_filename, O_RDONLY);
+			if (content < 0) {
 				/*
 				 * Could not open file - 404. (Perhaps 403)
 				 */
-				content = fopen(PAGES_DIRECTORY "/404.htm", "rb");
+#if ENABLE_SCHED
+				if (sched_held < 0) {
+					/*
+					 * A script that has gone away.
+					 */
+					if (sched_enter(SCHED_STATIC, &sched_held, &sched_start) < 0) {
+						sched_refuse(socket_stream, c_length);
+						goto _next;
+					}
+				}
+#endif
+				content = open(PAGES_DIRECTORY "/404.htm", O_RDONLY);
 
-				if (!content) {
+				if (content < 0) {
 					/*
 					 * If the expected default 404 page was not found
 					 * return the generic one and move to the next response.
@@ -730,10 +9082,9 @@ _use_file:
 				 * Replace the internal filenames with the 404 page
 				 * and continue to load it.
 				 */
-				fprintf(socket_stream, "HTTP/1.1 404 File Not Found\r\n");
-				_filename = realloc(_filename, strlen(PAGES_DIRECTORY "/404.htm") + 1);
-				_filename[0] = '\0';
-				strcat(_filename, PAGES_DIRECTORY "/404.htm");
+				status = STATUS_LINE("404 File Not Found");
+				conditions = NULL;
+				_filename = arena_strdup(&request->arena, PAGES_DIRECTORY "/404.htm");
 				ext = strstr(_filename, ".");
 			} else {
 				/*
@@ -745,17 +9096,117 @@ _use_file:
 					 * CGI Executable
 					 * Close the file
 					 */
-					fclose(content);
+					close(content);
+
+#if ENABLE_PEERS
+					struct upstream * cache_owner = NULL; /* Server to ask for the response first */
+#endif
+#if ENABLE_MICROCACHE
+					if (request->revalidate) {
+						/*
+						 * Internal refresh of a stale cache entry.
+						 */
+						cache_fill = request->revalidate;
+						request->revalidate = NULL;
+					} else if (request_type == 1 || request_type == 3) {
+						char * key = arena_alloc(&request->arena, strlen(_filename) + (querystring ? strlen(querystring) : 0) + 2);
+						sprintf(key, "%s?%s", _filename, querystring ? querystring : "");
+						struct cache_entry * cached = NULL;
+						struct cache_entry * refresh = NULL;
+#if ENABLE_PEERS
+						size_t peer_len;
+						int from_peer = request_header(queue, FRAGMENT(PEER_HEADER), &peer_len) != NULL;
+						if (from_peer) {
+							STAT_ADD(peer_served, 1);
+						}
+#endif
+						int found = cache_lookup(key, queue, request_type == 1, &cached, &refresh);
+						if (found == CACHE_HIT) {
+#if ENABLE_SCHED
+							/*
+							 * Served like a file; the entry and any refresh
+							 * are seen to even if we turn the client away.
+							 */
+							if (sched_enter(SCHED_STATIC, &sched_held, &sched_start) < 0) {
+								sched_refuse(socket_stream, c_length);
+							} else
+#endif
+							cache_serve(socket_stream, cached, request_type == 3);
+							cache_release(cached);
+							if (refresh) {
+								cache_refresh(refresh, queue, request, filename, querystring);
+							}
+							goto _next;
+						} else if (found == CACHE_FILL) {
+							cache_fill = cached;
+#if ENABLE_PEERS
+							if (!from_peer && !c_length) {
+								cache_owner = peer_owner(key);
+							}
+#endif
+						}
+					}
+#endif
+
+					/*
+					 * Wait our turn, or give up.
+					 */
+					struct cgi_script * slot = NULL;
+#if ENABLE_SCHED
+					int acquired = sched_enter(SCHED_CGI, &sched_held, &sched_start);
+#else
+					int acquired = 0;
+#endif
+#if ENABLE_PEERS
+					if (acquired == 0 && cache_owner && peer_fetch(request, socket_stream, cache_owner,
+								cache_fill, queue, filename, querystring, io_buf) == 0) {
+						/*
+						 * Someone else's key, and they had it.
+						 */
+						cache_fill = NULL;
+						goto _next;
+					}
+#endif
+					if (acquired == 0) {
+						acquired = cgi_acquire(_filename, &slot);
+					}
+#if ENABLE_TIMING
+					timing_mark(PHASE_QUEUE);
+#endif
+					if (acquired < 0) {
+						header_begin(&hb, FRAGMENT(STATUS_LINE("503 Service Unavailable")));
+						header_add(&hb, FRAGMENT("Retry-After: 1\r\n"));
+						if (c_length > 0) {
+							/*
+							 * We won't be reading the body.
+							 */
+							header_add(&hb, FRAGMENT("Connection: close\r\n"));
+						}
+						header_content_length(&hb, 0);
+						header_end(&hb);
+						send_response(socket_stream, &hb, NULL, 0);
+						if (c_length > 0) {
+							delete_vector(queue);
+							goto _disconnect;
+						}
+						goto _next;
+					}
+					if (expect_continue && c_length && send_continue(request, socket_stream) < 0) {
+						cgi_release(slot);
+						delete_vector(queue);
+						goto _disconnect;
+					}
+					body_read = 1;
 
 					/*
 					 * Prepare pipes.
 					 */
 					int cgi_pipe_r[2];
 					int cgi_pipe_w[2];
-					if (pipe(cgi_pipe_r) < 0) {
+					if (pipe2(cgi_pipe_r, O_CLOEXEC) < 0) {
 						fprintf(stderr, "Failed to create read pipe!\n");
 					}
-					if (pipe(cgi_pipe_w) < 0) {
+					if (pipe2(cgi_pipe_w, O_CLOEXEC) < 0) {
 						fprintf(stderr, "Failed to create write pipe!\n");
 					}
 
@@ -764,12 +9215,35 @@ _use_file:
 					 */
 					pid_t _pid = 0;
 					_pid = fork();
+					if (_pid < 0) {
+						close(cgi_pipe_r[0]);
+						close(cgi_pipe_r[1]);
+						close(cgi_pipe_w[0]);
+						close(cgi_pipe_w[1]);
+						cgi_release(slot);
+						generic_response(socket_stream, "500 Internal Server Error", "Failed to execute CGI script.");
+						goto _next;
+					}
 					if (_pid == 0) {
 						/*
 						 * Set pipes
 						 */
 						dup2(cgi_pipe_r[0],STDIN_FILENO);
 						dup2(cgi_pipe_w[1],STDOUT_FILENO);
+						/*
+						 * Holding our own ends would keep the script from
+						 * ever seeing the end of its input.
+						 */
+						close(cgi_pipe_r[0]);
+						close(cgi_pipe_r[1]);
+						close(cgi_pipe_w[0]);
+						close(cgi_pipe_w[1]);
+#if ENABLE_SCHED
+						/*
+						 * Scripts get the CPU when requests don't need it.
+						 */
+						setpriority(PRIO_PROCESS, 0, getpriority(PRIO_PROCESS, 0) + SCHED_CGI_NICE);
+#endif
 						/*
 						 * This is actually cheating on my pipe.
 						 */
@@ -826,8 +9300,13 @@ _use_file:
 						setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
 						setenv("SERVER_PROTOCOL", http_version, 1);
 						char port_string[20];
-						sprintf(port_string, "%d", port);
+						sprintf(port_string, "%d", request->listener ? request->listener->port : port);
 						setenv("SERVER_PORT", port_string, 1);
+#if ENABLE_TLS
+						if (request->listener && request->listener->tls) {
+							setenv("HTTPS", "on", 1);
+						}
+#endif
 						if (request_type == 1) {
 							setenv("REQUEST_METHOD", "GET", 1);
 						} else if (request_type == 2) {
@@ -857,13 +9336,15 @@ _use_file:
 						if (c_type) {
 							setenv("CONTENT_TYPE", c_type, 1);
 						}
-						struct hostent * client;
-						client = gethostbyaddr((const char *)&request->address.sin_addr.s_addr,
-								sizeof(request->address.sin_addr.s_addr), AF_INET);
-						if (client != NULL) {
-							setenv("REMOTE_HOST", client->h_name, 1);
+						if (request->address.sin_family == AF_INET) {
+							struct hostent * client;
+							client = gethostbyaddr((const char *)&request->address.sin_addr.s_addr,
+									sizeof(request->address.sin_addr.s_addr), AF_INET);
+							if (client != NULL) {
+								setenv("REMOTE_HOST", client->h_name, 1);
+							}
 						}
-						setenv("REMOTE_ADDR", inet_ntoa(request->address.sin_addr), 1);
+						setenv("REMOTE_ADDR", request->peer, 1);
 						if (c_cookie) {
 							setenv("HTTP_COOKIE", c_cookie, 1);
 						}
@@ -892,7 +9373,6 @@ _use_file:
 						 * Clean the crap from the original process.
 						 */
 						delete_vector(queue);
-						free(dir);
 						free(_last_unaccepted);
 						pthread_detach(request->thread);
 						free(request);
@@ -912,169 +9392,325 @@ _use_file:
 					cgi_w->pid = _pid;
 					cgi_w->fd  = cgi_pipe_w[1];
 					cgi_w->fd2 = cgi_pipe_r[0];
+					cgi_w->script = slot;
 					pthread_t _waitthread;
 					pthread_create(&_waitthread, NULL, wait_pid, (void *)(cgi_w));
 
-					/*
-					 * Open our end of the pipes.
-					 * We map cgi_pipe for reading the output from the CGI application.
-					 * cgi_pipe_post is mapped to the stdin for the CGI application
-					 * and we pipe our POST data (if there is any) here.
-					 */
-					FILE * cgi_pipe = fdopen(cgi_pipe_w[0], "r");
-					FILE * cgi_pipe_post = fdopen(cgi_pipe_r[1], "w");
+					/*
+					 * Relay the request body to the script and its output
+					 * to the client at the same time. Output is read ahead
+					 * into the connection's queue, so the script can finish
+					 * (and give up its slot) as soon as what it wrote fits
+					 * in OUTPUT_LIMIT; past that we stop reading and it
+					 * waits on the pipe until the client catches up.
+					 */
+					int cgi_out = cgi_pipe_w[0];
+					int cgi_in  = cgi_pipe_r[1];
+					fcntl(cgi_in, F_SETFL, O_NONBLOCK);
+#if ENABLE_TIMING
+					timing_mark(PHASE_FORK);
+#endif
+					struct outq * out = &request->out;
+					char * post = line_buf;         /* Request body on its way to the script */
+					size_t post_len = 0, post_sent = 0;
+					unsigned long posted = 0;       /* Request body read from the client */
+					char * buf = io_buf;            /* Script output we haven't dealt with */
+					size_t have = 0;
+					int headers_done = 0;           /* 1 when just finished, 2 after */
+					int garbage = 0;
+					int cgi_eof = 0;
+					int cgi_error = 0;
+					int enc_mode = 0;
+					unsigned int j = 0;
+					header_block_t hb;
+					header_begin(&hb, FRAGMENT(STATUS_LINE("200 OK")));
+#if ENABLE_XSENDFILE
+					size_t header_base = hb.len;
+					int headers_sent = 0;           /* Some of the script's headers went out */
+					char * handoff = NULL;          /* File named by X-Sendfile or X-Accel-Redirect */
+					int handoff_redirect = 0;
+#endif
+					while (!cgi_eof) {
+						if (cgi_in >= 0 && post_sent == post_len) {
+							/*
+							 * Read the next piece of the request body.
+							 */
+							post_len = post_sent = 0;
+							if (posted < c_length && !feof(socket_stream)) {
+								size_t diff = c_length - posted > CGI_POST ? CGI_POST : c_length - posted;
+								post_len = fread(post, 1, diff, socket_stream);
+								posted += post_len;
+							}
+							if (!post_len) {
+								/*
+								 * That was all of it.
+								 */
+								close(cgi_in);
+								cgi_in = -1;
+#if ENABLE_TIMING
+								if (c_length > 0) {
+									timing_mark(PHASE_READ);
+								}
+#endif
+							}
+						}
+
+						/*
+						 * A stream without a descriptor reads and writes
+						 * through one stdio buffer, so nothing goes out
+						 * until the request body is all in. Until then the
+						 * script's output is taken past OUTPUT_LIMIT, or a
+						 * script that answers as it reads would stop
+						 * reading once its pipe filled up; after that each
+						 * flush writes the whole queue anyway.
+						 */
+						int stdio_only = fileno(socket_stream) < 0;
+
+						struct pollfd waiting[3];
+						int count = 0, in_slot = -1, out_slot = -1;
+						if (cgi_in >= 0) {
+							in_slot = count;
+							waiting[count].fd = cgi_in;
+							waiting[count++].events = POLLOUT;
+						}
+						if (out->len < OUTPUT_LIMIT || stdio_only) {
+							out_slot = count;
+							waiting[count].fd = cgi_out;
+							waiting[count++].events = POLLIN;
+						}
+						if (out->len && fileno(socket_stream) >= 0) {
+							waiting[count].fd = fileno(socket_stream);
+							waiting[count++].events = POLLOUT;
+						}
+						if (poll(waiting, count, -1) < 0) {
+							continue;
+						}
+
+						if (in_slot >= 0 && waiting[in_slot].revents) {
+							ssize_t written = write(cgi_in, post + post_sent, post_len - post_sent);
+							if (written > 0) {
+								post_sent += written;
+							} else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+								/*
+								 * The script won't take the rest; it is
+								 * still read (and dropped) further down.
+								 */
+								close(cgi_in);
+								cgi_in = -1;
+							}
+						}
+
+						if (out_slot >= 0 && waiting[out_slot].revents) {
+							ssize_t r = read(cgi_out, buf + have, CGI_BUFFER - 1 - have);
+							if (r > 0) {
+								have += r;
+							} else if (r == 0 || errno != EINTR) {
+								cgi_eof = 1;
+								if (r < 0) {
+									cgi_error = 1;
+									perror("[warn] Error on read");
+								}
+							}
+						}
 
-					if (c_length > 0) {
 						/*
-						 * Write the POST data to the application.
+						 * Pass on header lines until the blank line.
 						 */
-						size_t total_read = 0;
-						char buf[CGI_POST];
-						while ((total_read < c_length) && (!feof(socket_stream))) {
-							size_t diff = c_length - total_read;
-							if (diff > CGI_POST) {
+						size_t used = 0;
+						while (!headers_done) {
+							char * in = buf + used;
+							char * nl = memchr(in, '\n', have - used);
+							if (!nl) {
+								if (cgi_eof) {
+									fprintf(stderr,"[warn] Sadness: Pipe closed during headers.\n");
+									headers_done = 1;
+								} else if (have - used >= CGI_BUFFER - 3) {
+									fprintf(stderr, "[warn] Garbage trying to read header line from CGI [%zu]\n", have - used);
+									garbage = 1;
+									headers_done = 1;
+								}
+								break;
+							}
+							size_t len = nl + 1 - in;
+							if (len == 1 || (len == 2 && in[0] == '\r')) {
 								/*
-								 * If there's more than our buffer left,
-								 * obviously, only read enough for the buffer.
+								 * Done reading headers.
 								 */
-								diff = CGI_POST;
+								used += len;
+								headers_done = 1;
+								break;
 							}
-							size_t read;
-							read = fread(buf, 1, diff, socket_stream);
-							total_read += read;
-							/*
-							 * Write to the CGI pipe
-							 */
-							fwrite(buf, 1, read, cgi_pipe_post);
+							*nl = '\0';
+							garbage = !strstr(in, ": ") && nl[-1] != '\r';
+							*nl = '\n';
+							if (garbage) {
+								fprintf(stderr, "[warn] Garbage trying to read header line from CGI [%zu]\n", len);
+								headers_done = 1;
+								break;
+							}
+#if ENABLE_XSENDFILE
+							if (!strncasecmp(in, "X-Sendfile:", 11) || !strncasecmp(in, "X-Accel-Redirect:", 17)) {
+								/*
+								 * The script wants us to send a file for it.
+								 */
+								handoff_redirect = (in[2] == 'A' || in[2] == 'a');
+								handoff = store_line(&request->arena, in);
+								handoff = handoff ? split_header(handoff) : NULL;
+								used += len;
+								++j;
+								continue;
+							}
+							if (header_add(&hb, in, len) < 0) {
+								headers_sent = 1;
+								header_add_flush(socket_stream, &hb, in, len);
+							}
+#else
+							header_add_flush(socket_stream, &hb, in, len);
+#endif
+#if ENABLE_MICROCACHE
+							if (cache_fill) {
+								cache_capture(cache_fill, 0, in, len);
+							}
+#endif
+							used += len;
+							++j;
+						}
+						if (used) {
+							memmove(buf, buf + used, have - used);
+							have -= used;
 						}
-					}
-					if (cgi_pipe_post) {
-						/*
-						 * If we need to, close the pipe.
-						 */
-						fclose(cgi_pipe_post);
-					}
 
-					/*
-					 * Read the headers from the CGI application.
-					 */
-					char buf[CGI_BUFFER];
-					if (!cgi_pipe) {
-						generic_response(socket_stream, "500 Internal Server Error", "Failed to execute CGI script.");
-						pthread_detach(_waitthread);
-						goto _next;
-					}
-					fprintf(socket_stream, "HTTP/1.1 200 OK\r\n");
-					fprintf(socket_stream, "Server: " VERSION_STRING "\r\n");
-					unsigned int j = 0;
-					while (!feof(cgi_pipe)) {
-						/*
-						 * Read until we are out of headers.
-						 */
-						char * in = fgets(buf, CGI_BUFFER - 2, cgi_pipe);
-						if (!in) {
-							fprintf(stderr,"[warn] Read nothing [%d on %p %d %d]\n", ferror(cgi_pipe), (void *)cgi_pipe, cgi_pipe_w[1], _pid);
-							perror("[warn] Specifically");
-							buf[0] = '\0';
-							break;
+						if (headers_done == 1) {
+							headers_done = 2;
+							if (j < 1) {
+								fprintf(stderr,"[warn] CGI script did not give us headers.\n");
+							}
+#if ENABLE_TIMING
+							timing_mark(PHASE_CGI);
+#endif
+#if ENABLE_XSENDFILE
+							if (handoff && !headers_sent) {
+								/*
+								 * Whatever else the script writes is dropped.
+								 */
+								break;
+							} else if (handoff) {
+								fprintf(stderr, "[warn] CGI script sent X-Sendfile after too many headers to honour it.\n");
+								handoff = NULL;
+							}
+#endif
+							if (request_type == 3) {
+								/*
+								 * On a HEAD request, we're done here.
+								 */
+								header_end(&hb);
+								send_response(socket_stream, &hb, NULL, 0);
+								break;
+							}
+#if ENABLE_TIMING
+							char timing_line[256];
+							size_t timing_len = timing_header(timing_line, sizeof(timing_line));
+							if (timing_len) {
+								header_add_flush(socket_stream, &hb, timing_line, timing_len);
+							}
+#endif
+							if (!strcmp(http_version, "HTTP/1.1")) {
+								/*
+								 * Set Transfer-Encoding to chunked so we can send
+								 * pieces as soon as we get them and not have
+								 * to read all of the output at once.
+								 */
+								header_add_flush(socket_stream, &hb, FRAGMENT("Transfer-Encoding: chunked\r\n\r\n"));
+							} else {
+								/*
+								 * Not HTTP/1.1
+								 * Use Connection: Close
+								 */
+								header_add_flush(socket_stream, &hb, FRAGMENT("Connection: close\r\n\r\n"));
+								enc_mode = 1;
+							}
+							if (garbage) {
+								/*
+								 * Sometimes, shit gets borked.
+								 */
+								fprintf(stderr, "[warn] Trying to dump remaining content.\n");
+							}
 						}
-						if (!strcmp(in, "\r\n") || !strcmp(in, "\n")) {
+
+						if (headers_done && have) {
 							/*
-							 * Done reading headers.
+							 * Queue output as chunks. The headers ride
+							 * along with the first one.
 							 */
-							buf[0] = '\0';
-							break;
+							outq_chunk(out, &hb, enc_mode, buf, have);
+#if ENABLE_MICROCACHE
+							if (cache_fill) {
+								cache_capture(cache_fill, 1, buf, have);
+							}
+#endif
+							have = 0;
 						}
-						if (!strstr(in, ": ") && !strstr(in, "\r\n")) {
-							/*
-							 * Line was too long or is garbage?
-							 */
-							fprintf(stderr, "[warn] Garbage trying to read header line from CGI [%zu]\n", strlen(buf));
+						if (stdio_only && cgi_in >= 0) {
+							continue;
+						}
+						if (outq_flush(out, socket_stream, OUTPUT_LIMIT) < 0) {
 							break;
 						}
-						fwrite(in, 1, strlen(in), socket_stream);
-						++j;
-					}
-					if (j < 1) {
-						fprintf(stderr,"[warn] CGI script did not give us headers.\n");
-					}
-					if (feof(cgi_pipe)) {
-						fprintf(stderr,"[warn] Sadness: Pipe closed during headers.\n");
-					}
-
-					if (request_type == 3) {
-						/*
-						 * On a HEAD request, we're done here.
-						 */
-						fprintf(socket_stream, "\r\n");
-						pthread_detach(_waitthread);
-						goto _next;
-					}
-
-					int enc_mode = 0;
-					if (!strcmp(http_version, "HTTP/1.1")) {
-						/*
-						 * Set Transfer-Encoding to chunked so we can send
-						 * pieces as soon as we get them and not have
-						 * to read all of the output at once.
-						 */
-						fprintf(socket_stream, "Transfer-Encoding: chunked\r\n");
-					} else {
-						/*
-						 * Not HTTP/1.1
-						 * Use Connection: Close
-						 */
-						fprintf(socket_stream, "Connection: close\r\n\r\n");
-						enc_mode = 1;
 					}
 
 					/*
-					 * Sometimes, shit gets borked.
+					 * Release memory for the waiting thread. Closing
+					 * our end of its output unsticks a script we have
+					 * stopped listening to.
 					 */
-					if (strlen(buf) > 0) {
-						fprintf(stderr, "[warn] Trying to dump remaining content.\n");
-						fprintf(socket_stream, "\r\n%zX\r\n", strlen(buf));
-						fwrite(buf, 1, strlen(buf), socket_stream);
+					if (cgi_in >= 0) {
+						close(cgi_in);
+					}
+					close(cgi_out);
+					pthread_detach(_waitthread);
+					if (out->failed) {
+						delete_vector(queue);
+						goto _disconnect;
 					}
 
 					/*
-					 * Read output from CGI script and send as chunks.
+					 * Read whatever is left of the request body.
 					 */
-					while (!feof(cgi_pipe)) {
-						size_t read = -1;
-						read = fread(buf, 1, CGI_BUFFER - 1, cgi_pipe);
-						if (read < 1) {
-							/*
-							 * Read nothing, we are done (or something broke)
-							 */
-							fprintf(stderr, "[warn] Read nothing on content without eof.\n");
-							perror("[warn] Error on read");
+					while (posted < c_length && !feof(socket_stream)) {
+						size_t diff = c_length - posted > CGI_POST ? CGI_POST : c_length - posted;
+						size_t read = fread(post, 1, diff, socket_stream);
+						if (!read) {
 							break;
 						}
-						if (enc_mode == 0) {
-							/*
-							 * Length of this chunk.
-							 */
-							fprintf(socket_stream, "\r\n%zX\r\n", read);
-						}
-						fwrite(buf, 1, read, socket_stream);
+						posted += read;
 					}
-					if (enc_mode == 0) {
+#if ENABLE_XSENDFILE
+					if (handoff) {
 						/*
-						 * We end `chunked` encoding with a 0-length block
+						 * The script's output is not cached; a fill
+						 * left open is abandoned at _next.
 						 */
-						fprintf(socket_stream, "\r\n0\r\n\r\n");
+						sendfile_serve(request, socket_stream, handoff, handoff_redirect,
+								hb.data + header_base, hb.len - header_base, &fr, request_type == 3);
+						goto _next;
 					}
-
-					/*
-					 * Release memory for the waiting thread.
-					 */
-					pthread_detach(_waitthread);
-					if (cgi_pipe) {
+#endif
+					if (request_type == 3) {
+						goto _next;
+					}
+#if ENABLE_MICROCACHE
+					if (cache_fill) {
+						cache_finish(cache_fill, !cgi_error, queue);
+						cache_fill = NULL;
+					}
+#endif
+					if (enc_mode == 0) {
 						/*
-						 * If we need to, close this pipe as well.
+						 * We end `chunked` encoding with a 0-length block
 						 */
-						fclose(cgi_pipe);
+						outq_chunk(out, &hb, enc_mode, NULL, 0);
+					} else if (hb.len) {
+						outq_append(out, hb.data, hb.len);
 					}
 
 					/*
@@ -1096,134 +9732,557 @@ _use_file:
 					}
 				}
 #endif
-
-				/*
-				 * Flat file: Status OK.
-				 */
-				fprintf(socket_stream, "HTTP/1.1 200 OK\r\n");
 			}
 
 			/*
-			 * Server software header
+			 * Determine the MIME type for the file.
 			 */
-			fprintf(socket_stream, "Server: " VERSION_STRING "\r\n");
+			size_t mime_len;
+			const char * mime = mime_header(ext, &mime_len);
 
 			/*
-			 * Determine the MIME type for the file.
+			 * Queue it behind the headers. Whatever the client doesn't
+			 * take right away is delivered after we let go of it.
 			 */
-			if (ext) {
-				if (!strcmp(ext,".htm") || !strcmp(ext,".html")) {
-					fprintf(socket_stream, "Content-Type: text/html\r\n");
-				} else if (!strcmp(ext,".css")) {
-					fprintf(socket_stream, "Content-Type: text/css\r\n");
-				} else if (!strcmp(ext,".png")) {
-					fprintf(socket_stream, "Content-Type: image/png\r\n");
-				} else if (!strcmp(ext,".jpg")) {
-					fprintf(socket_stream, "Content-Type: image/jpeg\r\n");
-				} else if (!strcmp(ext,".gif")) {
-					fprintf(socket_stream, "Content-Type: image/gif\r\n");
-				} else if (!strcmp(ext,".pdf")) {
-					fprintf(socket_stream, "Content-Type: application/pdf\r\n");
-				} else if (!strcmp(ext,".manifest")) {
-					fprintf(socket_stream, "Content-Type: text/cache-manifest\r\n");
-				} else {
-					fprintf(socket_stream, "Content-Type: text/unknown\r\n");
-				}
-			} else {
-				fprintf(socket_stream, "Content-Type: text/unknown\r\n");
-			}
+			struct stat content_stats;
+			fstat(content, &content_stats);
+			send_file(&request->out, socket_stream, content, &content_stats, status, strlen(status),
+					mime, mime_len, conditions, request_type == 3);
+		}
 
-			if (request_type == 3) {
-				/*
-				 * On a HEAD request, stop here,
-				 * we only needed the headers.
-				 */
-				fprintf(socket_stream, "\r\n");
-				fclose(content);
-				goto _next;
-			}
+_next:
+		/*
+		 * Clean up.
+		 */
+		outq_flush(&request->out, socket_stream, OUTPUT_LIMIT);
+		fflush(socket_stream);
+#if ENABLE_MICROCACHE
+		if (cache_fill) {
+			/*
+			 * The script never got to run (or finish).
+			 */
+			cache_finish(cache_fill, 0, NULL);
+			cache_fill = NULL;
+		}
+#endif
+#if ENABLE_SCHED
+		sched_leave(&sched_held, sched_start);
+#endif
+		delete_vector(queue);
+#if ENABLE_TIMING
+		timing_finish(request->peer);
+#endif
+		STAT_ADD(requests, 1);
+		STAT_ADD(request_heap, thread_heap_calls - heap_calls);
+#if ENABLE_CAPTURE
+		capture_write(request);
+#endif
+		if (c_length && !body_read) {
+			/*
+			 * Nothing read the request body, and we can't
+			 * tell where it ends and the next request starts.
+			 */
+			goto _disconnect;
+		}
 
+		if (request->out.len) {
 			/*
-			 * Determine the length of the response.
+			 * The client hasn't taken the whole response yet.
+			 * Let the parking thread wait for it, or wait here.
 			 */
-			fseek(content, 0L, SEEK_END);
-			long size = ftell(content);
-			fseek(content, 0L, SEEK_SET);
+			if (park_connection(request, socket_stream, stdio_buf, 0) == 0) {
+				io_buffer_put(line_buf);
+				io_buffer_put(io_buf);
+				return NULL;
+			}
+			outq_flush(&request->out, socket_stream, 0);
+		}
+		if (request->out.failed) {
+			break;
+		}
+	}
+
+_disconnect:
+#if ENABLE_SCHED
+	sched_leave(&sched_held, sched_start);
+#endif
+#if ENABLE_CAPTURE
+	capture_write(request);
+#endif
+	/*
+	 * Deliver what is still queued before we close.
+	 */
+	if (request->out.len && socket_stream) {
+		if (park_connection(request, socket_stream, stdio_buf, 1) == 0) {
+			io_buffer_put(line_buf);
+			io_buffer_put(io_buf);
+			return NULL;
+		}
+		outq_flush(&request->out, socket_stream, 0);
+	}
+
+_close:
+	/*
+	 * Disconnect.
+	 */
+#if ENABLE_TIMING
+	timing_finish(request->peer);
+#endif
+	if (!request->internal) {
+		active_remove(request);
+	}
+#if ENABLE_TLS
+	if (request->ssl) {
+		/*
+		 * Kernel TLS: say goodbye properly before the socket goes.
+		 */
+		if (socket_stream) {
+			fflush(socket_stream);
+		}
+		SSL_shutdown(request->ssl);
+	}
+#endif
+	if (socket_stream) {
+		fclose(socket_stream);
+	}
+	io_buffer_put(stdio_buf);
+	io_buffer_put(line_buf);
+	io_buffer_put(io_buf);
+	outq_clear(&request->out);
+	shutdown(request->fd, 2);
+#if ENABLE_TLS
+	if (request->ssl) {
+		SSL_free(request->ssl);
+	}
+#endif
+#if ENABLE_IO_URING
+	if (request->ring) {
+		uring_pool_put(request->ring);
+	}
+#endif
+#if ENABLE_ADMIT
+	if (!request->internal && !(request->listener && request->listener->proxy)) {
+		admit_release(&request->address);
+	}
+#endif
+#if ENABLE_MICROCACHE
+	if (cache_fill) {
+		cache_finish(cache_fill, 0, NULL);
+	}
+	if (request->revalidate) {
+		cache_finish(request->revalidate, 0, NULL);
+	}
+#endif
+
+	/*
+	 * Clean up the thread
+	 */
+	if (request->thread) {
+		pthread_detach(request->thread);
+	}
+	request_put(request);
+
+	/*
+	 * pthread_exit is implicit when we return...
+	 */
+	return NULL;
+}
+
+/*
+ * Listening sockets handed down by the process we replaced.
+ */
+struct inherited {
+	int                fd;
+	int                port;
+	int                tls;
+	int                used;
+} inherited[MAX_LISTENERS];
+int inherited_count = 0;
+int upgrade_ready_fd = -1;
+
+void inherit_listeners(void) {
+	const char * env = getenv(UPGRADE_ENV);
+	while (env && *env && inherited_count < MAX_LISTENERS) {
+		struct inherited * i = &inherited[inherited_count];
+		if (sscanf(env, "%d:%d:%d", &i->fd, &i->port, &i->tls) == 3) {
+			i->used = 0;
+			inherited_count++;
+		}
+		env = strchr(env, ',');
+		if (env) {
+			env++;
+		}
+	}
+	unsetenv(UPGRADE_ENV);
+	const char * ready = getenv(UPGRADE_READY_ENV);
+	if (ready) {
+		upgrade_ready_fd = atoi(ready);
+		fcntl(upgrade_ready_fd, F_SETFD, FD_CLOEXEC);
+		unsetenv(UPGRADE_READY_ENV);
+	}
+}
+
+/*
+ * Tell the process we replaced that we are accepting now.
+ */
+void upgrade_ready(void) {
+	if (upgrade_ready_fd < 0) {
+		return;
+	}
+	if (write(upgrade_ready_fd, "", 1) < 0) {
+		perror("[warn] Failed to tell the old process we are ready");
+	}
+	close(upgrade_ready_fd);
+	upgrade_ready_fd = -1;
+}
+
+int inherited_listener(int port, int tls) {
+	int i;
+	for (i = 0; i < inherited_count; ++i) {
+		if (!inherited[i].used && inherited[i].port == port && inherited[i].tls == tls) {
+			inherited[i].used = 1;
+			return inherited[i].fd;
+		}
+	}
+	return -1;
+}
+
+#if ENABLE_UNIX
+/*
+ * Unix sockets are handed down with a port of -1, and told apart by
+ * the address they are bound to.
+ */
+int inherited_unix_listener(struct sockaddr_un * sun, socklen_t sun_len) {
+	int i;
+	for (i = 0; i < inherited_count; ++i) {
+		struct sockaddr_un bound;
+		socklen_t bound_len = sizeof(bound);
+		if (inherited[i].used || inherited[i].port != -1 ||
+				getsockname(inherited[i].fd, (struct sockaddr *)&bound, &bound_len) < 0) {
+			continue;
+		}
+		if (bound_len == sun_len && !memcmp(&bound, sun, sun_len)) {
+			inherited[i].used = 1;
+			return inherited[i].fd;
+		}
+	}
+	return -1;
+}
+#endif
+
+/*
+ * Close whatever we were handed but don't listen on anymore.
+ */
+void inherited_close_unused(void) {
+	int i;
+	for (i = 0; i < inherited_count; ++i) {
+		if (!inherited[i].used) {
+			close(inherited[i].fd);
+		}
+	}
+}
+
+/*
+ * Start the new process. Returns 0 once it is accepting.
+ */
+int upgrade_exec(void) {
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) < 0) {
+		return -1;
+	}
+	char ready_env[sizeof(UPGRADE_READY_ENV) + 16];
+	sprintf(ready_env, UPGRADE_READY_ENV "=%d", ready[1]);
+	char listener_env[sizeof(UPGRADE_ENV) + MAX_LISTENERS * 40];
+	size_t len = sprintf(listener_env, UPGRADE_ENV "=");
+	int l;
+	for (l = 0; l < listener_count; ++l) {
+		len += sprintf(listener_env + len, "%s%d:%d:%d", l ? "," : "",
+				listeners[l].fd, listeners[l].port, listeners[l].tls);
+	}
+
+	/*
+	 * The environment has to be ready before we fork;
+	 * the child may only make async-signal-safe calls.
+	 */
+	extern char ** environ;
+	size_t count = 0;
+	while (environ[count]) {
+		count++;
+	}
+	char ** envp = malloc((count + 3) * sizeof(char *));
+	size_t e = 0;
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) &&
+			strncmp(environ[i], UPGRADE_READY_ENV "=", sizeof(UPGRADE_READY_ENV))) {
+			envp[e++] = environ[i];
+		}
+	}
+	envp[e++] = listener_env;
+	envp[e++] = ready_env;
+	envp[e] = NULL;
+
+	/*
+	 * The child reports a failed exec over this pipe;
+	 * a successful one just closes it.
+	 */
+	int status[2];
+	if (pipe2(status, O_CLOEXEC) < 0) {
+		close(ready[0]);
+		close(ready[1]);
+		free(envp);
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		sigset_t none;
+		sigemptyset(&none);
+		pthread_sigmask(SIG_SETMASK, &none, NULL);
+		int fd;
+#ifdef SYS_close_range
+		if (syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) < 0)
+#endif
+		{
+			for (fd = 3; fd < 65536; ++fd) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+			}
+		}
+		for (l = 0; l < listener_count; ++l) {
+			fcntl(listeners[l].fd, F_SETFD, 0);
+		}
+		fcntl(ready[1], F_SETFD, 0);
+		execve(exec_path, exec_argv, envp);
+		int err = errno;
+		if (write(status[1], &err, sizeof(err)) < 0) {
+			_exit(127);
+		}
+		_exit(127);
+	}
+	close(status[1]);
+	close(ready[1]);
+	free(envp);
+	if (pid < 0) {
+		close(status[0]);
+		close(ready[0]);
+		return -1;
+	}
+	int err = 0;
+	ssize_t r;
+	do {
+		r = read(status[0], &err, sizeof(err));
+	} while (r < 0 && errno == EINTR);
+	close(status[0]);
+	if (r > 0) {
+		close(ready[0]);
+		waitpid(pid, NULL, 0);
+		fprintf(stderr, "[warn] Could not start %s: %s\n", exec_path, strerror(err));
+		return -1;
+	}
+
+	/*
+	 * It's running; keep serving until it is accepting too. If it
+	 * exits or takes too long instead, we carry on as we were.
+	 */
+	struct pollfd waiting = { ready[0], POLLIN, 0 };
+	char c;
+	do {
+		r = poll(&waiting, 1, UPGRADE_READY * 1000);
+	} while (r < 0 && errno == EINTR);
+	r = r > 0 ? read(ready[0], &c, 1) : -1;
+	close(ready[0]);
+	if (r != 1) {
+		fprintf(stderr, "[warn] %s did not start accepting; staying up.\n", exec_path);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Waits for upgrade signals (they are blocked everywhere else).
+ */
+void *upgrade_thread(void * unused) {
+	(void)unused;
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGHUP);
+	while (1) {
+		int sig;
+		if (sigwait(&signals, &sig) != 0) {
+			continue;
+		}
+		printf("[info] Upgrading: starting %s.\n", exec_path);
+		fflush(stdout);
+		if (upgrade_exec() == 0) {
+			draining = 1;
+			if (write(wake_pipe[1], "", 1) < 0) {
+				perror("[warn] Failed to wake the accept loop");
+			}
+			return NULL;
+		}
+	}
+	return NULL;
+}
 
-			/*
-			 * Send that length.
-			 */
-			fprintf(socket_stream, "Content-Length: %lu\r\n", size);
-			fprintf(socket_stream, "\r\n");
+/*
+ * Hand over: stop accepting and wait for our connections to finish.
+ */
+void drain_and_exit(void) {
+	int l;
+	for (l = 0; l < listener_count; ++l) {
+		close(listeners[l].fd);
+	}
+	pthread_mutex_lock(&active_lock);
+	printf("[info] New process is accepting; draining %d connection(s).\n", active_count);
+	pthread_mutex_unlock(&active_lock);
+	fflush(stdout);
 
+	struct timespec now, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += DRAIN_DEADLINE;
+	while (1) {
+		struct socket_request * request;
+		pthread_mutex_lock(&active_lock);
+		if (!active_count) {
+			pthread_mutex_unlock(&active_lock);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int late = now.tv_sec > deadline.tv_sec ||
+			(now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+		for (request = active_head; request; request = request->active_next) {
 			/*
-			 * Read the file.
+			 * Waiting for a request that should go to the new process instead;
+			 * past the deadline, everyone goes.
 			 */
-			char buffer[FLAT_BUFFER];
-			fflush(stdout);
-			while (!feof(content)) {
+			if (late) {
+				shutdown(request->fd, SHUT_RDWR);
+			} else if (request->idle && now.tv_sec - request->idle_since >= DRAIN_IDLE) {
+				shutdown(request->fd, SHUT_RD);
+			}
+#if ENABLE_HTTP2
+			else if (request->h2 && h2_drain(request->h2) == 1) {
 				/*
-				 * Write out the file as a stream until
-				 * we hit the end of it.
+				 * Told to go away and nothing left in flight.
 				 */
-				size_t read = fread(buffer, 1, FLAT_BUFFER-1, content);
-				fwrite(buffer, 1, read, socket_stream);
+				shutdown(request->fd, SHUT_RD);
 			}
-
-			fprintf(socket_stream, "\r\n");
-
-			/*
-			 * Close the file.
-			 */
-			fclose(content);
+#endif
 		}
-
-_next:
-		/*
-		 * Clean up.
-		 */
-		fflush(socket_stream);
-		free(_filename);
-		delete_vector(queue);
+		pthread_mutex_unlock(&active_lock);
+		if (late) {
+			fprintf(stderr, "[warn] Drain deadline passed, closing the remaining connections.\n");
+			struct timespec grace = { 0, 200000000L };
+			nanosleep(&grace, NULL);
+			break;
+		}
+		struct timespec tick = { 0, 50000000L };
+		nanosleep(&tick, NULL);
 	}
+	printf("[info] Drained.\n");
+	exit(0);
+}
 
-_disconnect:
-	/*
-	 * Disconnect.
-	 */
-	if (socket_stream) {
-		fclose(socket_stream);
+/*
+ * Parse a -L argument: name=value[,name=value...]
+ */
+int listen_configure(const char * spec) {
+	static const char * names[] = { "backlog", "defer", "fastopen", "nodelay", "sndbuf", "rcvbuf", "batch" };
+	int * values[] = {
+		&listen_options.backlog, &listen_options.defer, &listen_options.fastopen, &listen_options.nodelay,
+		&listen_options.sndbuf, &listen_options.rcvbuf, &listen_options.batch
+	};
+	while (*spec) {
+		size_t len = strcspn(spec, ",");
+		const char * equals = memchr(spec, '=', len);
+		if (!equals) {
+			return -1;
+		}
+		unsigned int i;
+		for (i = 0; i < sizeof(names) / sizeof(*names); ++i) {
+			if (strlen(names[i]) == (size_t)(equals - spec) && !strncmp(spec, names[i], equals - spec)) {
+				break;
+			}
+		}
+		char * end;
+		long value = strtol(equals + 1, &end, 10);
+		if (i == sizeof(names) / sizeof(*names) || end != spec + len || value < 0 || value > INT_MAX) {
+			return -1;
+		}
+		*values[i] = (int)value;
+		spec += len;
+		if (*spec == ',') {
+			spec++;
+		}
 	}
-	shutdown(request->fd, 2);
+	if (listen_options.batch < 1) {
+		listen_options.batch = 1;
+	}
+	return 0;
+}
 
-	/*
-	 * Clean up the thread
-	 */
-	if (request->thread) {
-		pthread_detach(request->thread);
+/*
+ * Set up a TCP listener, new or inherited, before it listens (again).
+ * Buffer sizes are inherited by the connections it accepts. With
+ * TCP_DEFER_ACCEPT, we aren't woken for a connection until its
+ * request has arrived.
+ */
+static void listen_tune(int sock) {
+	if (listen_options.sndbuf) {
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &listen_options.sndbuf, sizeof(int));
 	}
-	free(request);
+	if (listen_options.rcvbuf) {
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &listen_options.rcvbuf, sizeof(int));
+	}
+#ifdef TCP_DEFER_ACCEPT
+	setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listen_options.defer, sizeof(int));
+#endif
+#ifdef TCP_FASTOPEN
+	if (listen_options.fastopen) {
+		setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &listen_options.fastopen, sizeof(int));
+	}
+#endif
+}
 
+/*
+ * Start accepting on a listening socket.
+ */
+int add_listener(int sock, int port, int tls, const char * path) {
+	if (listener_count == MAX_LISTENERS) {
+		fprintf(stderr, "Too many listeners (at most %d).\n", MAX_LISTENERS);
+		close(sock);
+		return -1;
+	}
 	/*
-	 * pthread_exit is implicit when we return...
+	 * Keep it out of CGI scripts; an upgrade hands it on explicitly.
+	 * It is non-blocking because during an upgrade two processes poll
+	 * it, and the one that loses the race must not sit in accept().
 	 */
-	return NULL;
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	listeners[listener_count].fd    = sock;
+	listeners[listener_count].port  = port;
+	listeners[listener_count].tls   = tls;
+	listeners[listener_count].proxy = 0;
+	listeners[listener_count].path  = path;
+	listener_count++;
+	return sock;
 }
 
-int main(int argc, char ** argv) {
-	/*
-	 * Determine what port we should run on.
-	 */
-	port = PORT;
-	if (argc > 1) {
-		port = atoi(argv[1]);
+/*
+ * Open a TCP socket listening on a port,
+ * or take over the one our predecessor had open.
+ */
+int open_listener(int port, int tls) {
+	int sock = inherited_listener(port, tls);
+	if (sock >= 0) {
+		printf("[info] Took over the listener on port %d.\n", port);
+		goto _listen;
 	}
-
-	/*
-	 * Initialize the TCP socket
-	 */
 	struct sockaddr_in sin;
-	serversock          = socket(AF_INET, SOCK_STREAM, 0);
+	sock                = socket(AF_INET, SOCK_STREAM, 0);
 	sin.sin_family      = AF_INET;
 	sin.sin_port        = htons(port);
 	sin.sin_addr.s_addr = INADDR_ANY;
@@ -1232,24 +10291,448 @@ int main(int argc, char ** argv) {
 	 * Set reuse for the socket.
 	 */
 	int _true = 1;
-	if (setsockopt(serversock, SOL_SOCKET, SO_REUSEADDR, &_true, sizeof(int)) < 0) {
-		close(serversock);
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &_true, sizeof(int)) < 0) {
+		close(sock);
 		return -1;
 	}
 
 	/*
 	 * Bind the socket.
 	 */
-	if (bind(serversock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+	if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
 		fprintf(stderr,"Failed to bind socket to port %d!\n", port);
+		close(sock);
+		return -1;
+	}
+
+	/*
+	 * Start listening for requests from browsers. An inherited
+	 * listener takes our options too; listening again only changes
+	 * its backlog.
+	 */
+_listen:
+	listen_tune(sock);
+	listen(sock, listen_options.backlog ? listen_options.backlog : SOMAXCONN);
+	return add_listener(sock, port, tls, NULL);
+}
+
+#if ENABLE_UNIX
+/*
+ * Listen on a Unix domain socket, for a proxy on the same host:
+ * -U path[,mode][,proxy]. A path starting with @ is in the abstract
+ * namespace, which has no file (or permissions) at all. An upgrade
+ * hands the socket on like the others; on a fresh start, a socket
+ * file nobody is listening on any more is replaced.
+ */
+int open_unix_listener(const char * spec) {
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path) + 1];
+	const char * comma = strchr(spec, ',');
+	size_t path_len = comma ? (size_t)(comma - spec) : strlen(spec);
+	if (!path_len || path_len >= sizeof(path) - 1) {
+		fprintf(stderr, "Bad Unix socket path '%s'\n", spec);
+		return -1;
+	}
+	memcpy(path, spec, path_len);
+	path[path_len] = '\0';
+	long mode = -1;
+	int proxy = 0;
+	while (comma) {
+		const char * option = comma + 1;
+		comma = strchr(option, ',');
+		size_t len = comma ? (size_t)(comma - option) : strlen(option);
+		char * end;
+		if (len == 5 && !strncmp(option, "proxy", 5)) {
+			proxy = 1;
+		} else if ((mode = strtol(option, &end, 8)) < 0 || mode > 07777 || end != option + len || !len) {
+			fprintf(stderr, "Bad Unix socket option '%.*s', expected an octal mode or 'proxy'\n", (int)len, option);
+			return -1;
+		}
+	}
+#if !ENABLE_PROXY_PROTOCOL
+	if (proxy) {
+		fprintf(stderr, "PROXY protocol support is not built in.\n");
+		return -1;
+	}
+#endif
+
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, path_len);
+	if (path[0] == '@') {
+		sun.sun_path[0] = '\0';
+	}
+	socklen_t sun_len = offsetof(struct sockaddr_un, sun_path) + path_len + (path[0] != '@');
+
+	int sock = inherited_unix_listener(&sun, sun_len);
+	if (sock >= 0) {
+		printf("[info] Took over the listener on %s.\n", path);
+		goto _register;
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	struct stat st;
+	if (path[0] != '@' && !lstat(path, &st) && S_ISSOCK(st.st_mode) &&
+		connect(sock, (struct sockaddr *)&sun, sun_len) < 0 && errno == ECONNREFUSED) {
+		/*
+		 * Left behind by a server that is gone. Anything that isn't
+		 * a socket is left alone, and bind will complain about it.
+		 */
+		unlink(path);
+	}
+	close(sock);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&sun, sun_len) < 0) {
+		fprintf(stderr, "Failed to bind socket to %s: %s\n", path, strerror(errno));
+		if (sock >= 0) {
+			close(sock);
+		}
+		return -1;
+	}
+	if (mode >= 0 && path[0] != '@' && chmod(path, mode) < 0) {
+		perror(path);
+		close(sock);
 		return -1;
 	}
+	listen(sock, UNIX_BACKLOG);
+
+_register:
+	add_listener(sock, -1, 0, strdup(path));
+	listeners[listener_count - 1].proxy = proxy;
+	return sock;
+}
+#endif
+
+#if ENABLE_IO_URING
+/*
+ * Accept connections with a multishot accept, handing off everything
+ * each wakeup brings in. Returns 1 when it is time to drain for an
+ * upgrade, or 0 if the ring could not be set up or the kernel turned
+ * the accept down, in which case the caller falls back to the plain
+ * accept loop.
+ */
+int uring_accept_loop(void) {
+	struct uring ring;
+	struct io_uring_sqe * sqe;
+	struct io_uring_cqe cqe;
+	int armed[MAX_LISTENERS] = {0};
+	int fds[MAX_LISTENERS];
+	unsigned long accepted = 0;
+	int l;
+
+	if (uring_init(&ring, URING_ENTRIES) < 0) {
+		return 0;
+	}
+	for (l = 0; l < listener_count; ++l) {
+		fds[l] = listeners[l].fd;
+	}
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds, listener_count) < 0) {
+		uring_free(&ring);
+		return 0;
+	}
+	printf("[info] Accepting through io_uring.\n");
+
+	/*
+	 * The upgrade thread wakes us through the pipe.
+	 */
+	sqe = uring_get_sqe(&ring, IORING_OP_POLL_ADD, MAX_LISTENERS);
+	sqe->fd = wake_pipe[0];
+	sqe->poll32_events = POLLIN;
+
+	while (1) {
+		for (l = 0; l < listener_count; ++l) {
+			if (!armed[l]) {
+				/*
+				 * One multishot accept per listener, tagged with its index.
+				 */
+				sqe = uring_get_sqe(&ring, IORING_OP_ACCEPT, l);
+				sqe->fd = l;
+				sqe->flags = IOSQE_FIXED_FILE;
+				sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+				sqe->accept_flags = SOCK_CLOEXEC;
+				armed[l] = 1;
+			}
+		}
+		if (uring_submit(&ring, 1) < 0) {
+			perror("[warn] io_uring_enter");
+			continue;
+		}
+		while (uring_next_cqe(&ring, &cqe)) {
+			if (cqe.user_data == MAX_LISTENERS) {
+				uring_free(&ring);
+				return 1;
+			}
+			if (!(cqe.flags & IORING_CQE_F_MORE)) {
+				/*
+				 * The multishot accept ended; rearm it.
+				 */
+				armed[cqe.user_data] = 0;
+			}
+			if (cqe.res < 0) {
+				if (!accepted && cqe.res == -EINVAL) {
+					/*
+					 * No multishot accept on this kernel.
+					 */
+					uring_free(&ring);
+					return 0;
+				}
+				continue;
+			}
+			accepted++;
+
+			/*
+			 * The peer address is filled in by the handler
+			 * thread, since multishot accepts can't return it.
+			 */
+			struct socket_request * incoming = request_get();
+			incoming->fd = cqe.res;
+			incoming->listener = &listeners[cqe.user_data];
+#if ENABLE_ADMIT
+			/*
+			 * ...unless we need it here to check the client's limits.
+			 */
+			incoming->addr_len = sizeof(incoming->address);
+			getpeername(incoming->fd, (struct sockaddr *)&incoming->address, &incoming->addr_len);
+			if (!incoming->listener->proxy && !admit_connection(&incoming->address)) {
+				admit_refuse(incoming->fd);
+				request_put(incoming);
+				continue;
+			}
+#endif
+			incoming->idle = 0;
+			active_add(incoming);
+			pthread_create(&(incoming->thread), NULL, handleRequest, (void *)(incoming));
+		}
+	}
+}
+#endif
+
+/*
+ * bench.c includes this file with NO_MAIN defined to get at
+ * the request parsing functions.
+ */
+#ifndef NO_MAIN
+int main(int argc, char ** argv) {
+	/*
+	 * Determine what port we should run on.
+	 */
+	port = PORT;
+	int opt;
+	int l;
+
+	/*
+	 * Remember how we were started, for upgrades, and keep upgrade
+	 * signals away from every thread but the one that waits for them.
+	 */
+	exec_argv = argv;
+	ssize_t exec_len = readlink("/proc/self/exe", exec_path, sizeof(exec_path) - 1);
+	if (exec_len > 0) {
+		exec_path[exec_len] = '\0';
+	} else if (!realpath(argv[0], exec_path)) {
+		strcpy(exec_path, argv[0]);
+	}
+	sigset_t upgrade_signals;
+	sigemptyset(&upgrade_signals);
+	sigaddset(&upgrade_signals, SIGUSR2);
+	sigaddset(&upgrade_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &upgrade_signals, NULL);
+	inherit_listeners();
+#if ENABLE_TLS
+	int tls_port = 0;
+#endif
+#if ENABLE_XSENDFILE
+	sendfile_add_root(PAGES_DIRECTORY);
+#endif
+#if ENABLE_UNIX
+	const char * unix_specs[MAX_LISTENERS];
+	int unix_count = 0;
+#endif
+#if ENABLE_PROXY_PROTOCOL
+	int proxy_tcp = 0;
+#endif
+	while ((opt = getopt(argc, argv, "us:c:k:x:tl:X:b:i:m:R:U:PpC:L:A:")) != -1) {
+		switch (opt) {
+#if ENABLE_IO_URING
+			case 'u':
+				use_uring = 1;
+				break;
+#endif
+#if ENABLE_TLS
+			case 's':
+				tls_port = atoi(optarg);
+				break;
+			case 'c':
+				tls_cert = optarg;
+				break;
+			case 'k':
+				tls_key = optarg;
+				break;
+#endif
+#if ENABLE_PROXY
+			case 'x':
+				if (proxy_add_route(optarg) < 0) {
+					fprintf(stderr, "Bad proxy route '%s', expected /prefix=host:port[,host:port...]\n", optarg);
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_TIMING
+			case 't':
+				server_timing = 1;
+				break;
+			case 'l':
+				access_log = fopen(optarg, "ae");
+				if (!access_log) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_XSENDFILE
+			case 'X':
+				if (sendfile_add_root(optarg) < 0) {
+					fprintf(stderr, "Can't allow X-Sendfile from '%s' (missing, or more than %d directories)\n", optarg, SENDFILE_ROOTS);
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_IMAGE
+			case 'i':
+				if (image_load(optarg) < 0) {
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_MODULES
+			case 'm':
+				if (module_load_config(optarg) < 0) {
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_CAPTURE
+			case 'R':
+				if (capture_open(optarg) < 0) {
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_UNIX
+			case 'U':
+				if (unix_count == MAX_LISTENERS) {
+					fprintf(stderr, "Too many Unix sockets (at most %d).\n", MAX_LISTENERS);
+					return 1;
+				}
+				unix_specs[unix_count++] = optarg;
+				break;
+#endif
+#if ENABLE_PROXY_PROTOCOL
+			case 'P':
+				proxy_tcp = 1;
+				break;
+#endif
+#if ENABLE_PROFILER
+			case 'p':
+				if (profile_init() < 0) {
+					perror("[warn] Can't set up the profiler");
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_PEERS
+			case 'C':
+				if (peer_configure(optarg) < 0) {
+					fprintf(stderr, "Bad cluster '%s', expected self-host:port,host:port[,host:port...] (at most %d)\n", optarg, PEER_NODES);
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_ADMIT
+			case 'A':
+				if (admit_configure(optarg) < 0) {
+					fprintf(stderr, "Bad client limits '%s', expected name=value[,name=value...] for connections, rate or burst\n", optarg);
+					return 1;
+				}
+				break;
+#endif
+			case 'L':
+				if (listen_configure(optarg) < 0) {
+					fprintf(stderr, "Bad listener options '%s', expected name=value[,name=value...] for backlog, defer, fastopen, nodelay, sndbuf, rcvbuf or batch\n", optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if (body_limit_add(optarg) < 0) {
+					fprintf(stderr, "Bad body limit '%s', expected /prefix=bytes[k|m|g]\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-u] [-s https-port -c cert.pem -k key.pem] [-x /prefix=host:port,...] [-t] [-l access.log] [-X dir] [-b /prefix=bytes] [-i docroot.img] [-m modules.conf] [-R capture.log] [-U path[,mode][,proxy]] [-P] [-p] [-C self-host:port,host:port,...] [-L name=value,...] [-A name=value,...] [port]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc) {
+		port = atoi(argv[optind]);
+	}
 
 	/*
-	 * Start listening for requests from browsers.
+	 * Initialize the TCP socket; port 0 means
+	 * we only listen on Unix sockets.
 	 */
-	listen(serversock, 50);
-	printf("[info] Listening on port %d.\n", port);
+	serversock = -1;
+	if (port) {
+		serversock = open_listener(port, 0);
+		if (serversock < 0) {
+			return -1;
+		}
+	}
+#if ENABLE_UNIX
+	int u;
+	for (u = 0; u < unix_count; ++u) {
+		if (open_unix_listener(unix_specs[u]) < 0) {
+			return -1;
+		}
+		printf("[info] Listening on %s%s.\n", listeners[listener_count - 1].path,
+				listeners[listener_count - 1].proxy ? " (PROXY protocol)" : "");
+	}
+#endif
+	if (!listener_count) {
+		fprintf(stderr, "Nothing to listen on.\n");
+		return -1;
+	}
+#if ENABLE_TLS
+	if (tls_port) {
+		if (!tls_cert || !tls_key) {
+			fprintf(stderr, "HTTPS needs a certificate (-c) and key (-k).\n");
+			return -1;
+		}
+		if (tls_init() < 0) {
+			fprintf(stderr, "Failed to load the TLS certificate or key.\n");
+			return -1;
+		}
+		if (open_listener(tls_port, 1) < 0) {
+			return -1;
+		}
+		printf("[info] Listening for HTTPS on port %d.\n", tls_port);
+	}
+#endif
+#if ENABLE_PROXY_PROTOCOL
+	if (proxy_tcp) {
+		for (l = 0; l < listener_count; ++l) {
+			if (!listeners[l].path) {
+				listeners[l].proxy = 1;
+			}
+		}
+	}
+#endif
+	inherited_close_unused();
+	if (port) {
+		printf("[info] Listening on port %d%s.\n", port, serversock >= 0 && listeners[0].proxy ? " (PROXY protocol)" : "");
+	}
 	printf("[info] Serving out of '" PAGES_DIRECTORY "'.\n");
 	printf("[info] Server version string is " VERSION_STRING ".\n");
 
@@ -1262,6 +10745,42 @@ int main(int argc, char ** argv) {
 #if ENABLE_DEFAULTS
 	printf("[extn] Default indexes are enabled.\n");
 #endif
+#if ENABLE_TLS
+	printf("[extn] HTTPS support is enabled.\n");
+#endif
+#if ENABLE_PROXY
+	int r;
+	for (r = 0; r < proxy_route_count; ++r) {
+		printf("[extn] Forwarding %s to %d upstream(s).\n", proxy_routes[r].prefix, proxy_routes[r].count);
+	}
+#endif
+#if ENABLE_PEERS
+	if (peer_count) {
+		printf("[extn] Sharing the CGI cache with %d other server(s).\n", peer_count - 1);
+	}
+#endif
+
+	/*
+	 * Start the clock that keeps our Date header current.
+	 */
+	pthread_t clock_thread;
+#if ENABLE_HTTP2
+	hpack_init();
+#endif
+#if ENABLE_ADMIT
+	admit_init();
+#endif
+#if ENABLE_SCHED
+	sched_init();
+#endif
+	update_http_date();
+	pthread_create(&clock_thread, NULL, clock_tick, NULL);
+#if ENABLE_PROXY
+	if (proxy_upstream_count) {
+		pthread_t health_thread;
+		pthread_create(&health_thread, NULL, proxy_health, NULL);
+	}
+#endif
 
 	/*
 	 * Use our shutdown handler.
@@ -1273,23 +10792,89 @@ int main(int argc, char ** argv) {
 	 */
 	signal(SIGPIPE, SIG_IGN);
 
+	/*
+	 * Wait for upgrade requests.
+	 */
+	if (pipe2(wake_pipe, O_CLOEXEC) == 0) {
+		pthread_t upgrader;
+		pthread_create(&upgrader, NULL, upgrade_thread, NULL);
+	}
+	upgrade_ready();
+
 	/*
 	 * Start accepting connections
 	 */
+#if ENABLE_IO_URING
+	if (use_uring) {
+		if (uring_accept_loop()) {
+			drain_and_exit();
+		}
+		fprintf(stderr, "[warn] io_uring is not available, falling back to threads.\n");
+		use_uring = 0;
+	}
+#endif
+	struct pollfd waiting[MAX_LISTENERS + 1];
+	for (l = 0; l < listener_count; ++l) {
+		waiting[l].fd = listeners[l].fd;
+		waiting[l].events = POLLIN;
+	}
+	waiting[listener_count].fd = wake_pipe[0];
+	waiting[listener_count].events = POLLIN;
 	while (1) {
-		/*
-		 * Accept an incoming connection and pass it on to a new thread.
-		 */
-		unsigned int c_len;
-		struct socket_request * incoming = calloc(sizeof(struct socket_request),1);
-		c_len = sizeof(incoming->address);
-		_last_unaccepted = (void *)incoming;
-		incoming->fd = accept(serversock, (struct sockaddr *) &(incoming->address), &c_len);
-		_last_unaccepted = NULL;
-		pthread_create(&(incoming->thread), NULL, handleRequest, (void *)(incoming));
+		if (poll(waiting, listener_count + 1, -1) < 0) {
+			continue;
+		}
+		if (waiting[listener_count].revents) {
+			drain_and_exit();
+		}
+		for (l = 0; l < listener_count; ++l) {
+			if (!(waiting[l].revents & POLLIN)) {
+				continue;
+			}
+			STAT_ADD(accept_wakeups, 1);
+			/*
+			 * Accept incoming connections, as many as are waiting
+			 * up to the batch size, and pass each on to a new thread.
+			 * The listener is non-blocking, so we stop when they
+			 * run out.
+			 */
+			int batch;
+			for (batch = 0; batch < listen_options.batch; ++batch) {
+				socklen_t c_len;
+				struct socket_request * incoming = request_get();
+				c_len = sizeof(incoming->address);
+				_last_unaccepted = (void *)incoming;
+#ifdef SOCK_CLOEXEC
+				incoming->fd = accept4(listeners[l].fd, (struct sockaddr *) &(incoming->address), &c_len, SOCK_CLOEXEC);
+#else
+				incoming->fd = accept(listeners[l].fd, (struct sockaddr *) &(incoming->address), &c_len);
+				if (incoming->fd >= 0) {
+					fcntl(incoming->fd, F_SETFD, FD_CLOEXEC);
+				}
+#endif
+				incoming->addr_len = c_len;
+				incoming->listener = &listeners[l];
+				_last_unaccepted = NULL;
+				if (incoming->fd < 0) {
+					request_put(incoming);
+					break;
+				}
+#if ENABLE_ADMIT
+				if (!incoming->listener->proxy && !admit_connection(&incoming->address)) {
+					admit_refuse(incoming->fd);
+					request_put(incoming);
+					continue;
+				}
+#endif
+				incoming->idle = 0;
+				active_add(incoming);
+				pthread_create(&(incoming->thread), NULL, handleRequest, (void *)(incoming));
+			}
+		}
 	}
 
 	/*
 	 * We will clean up when we receive a SIGINT.
 	 */
 }
+#endif
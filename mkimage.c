@@ -0,0 +1,282 @@
+/*
+ * Pack a docroot into an image for cgiserver -i.
+ *
+ * Builds the server without its main() to share its MIME types,
+ * validators and index rules, then walks a docroot and writes every
+ * flat file into one image: a sorted table of request paths, the
+ * headers and validators for each, and page-aligned bodies. A file
+ * with a gzipped copy next to it (style.css and style.css.gz) is
+ * served gzipped to clients that take it. Directories get an entry
+ * for their default index, if it isn't a script. CGI scripts,
+ * listings and anything missing are left to the live docroot.
+ *
+ *     make mkimage && ./mkimage pages docroot.img
+ *     ./cgiserver -i docroot.img
+ *
+ * The image is written next to its final name and renamed into
+ * place, so a running server never sees it change under its map.
+ */
+
+#define NO_MAIN 1
+#include "cgiserver.c"
+
+/*
+ * A file (or a directory's index) to pack.
+ */
+struct item {
+	char *      path;       /* Request path under the docroot */
+	char *      disk;       /* Where it is now */
+	struct stat st;
+	int         body_of;    /* Item whose body this is (itself, for files; -1 before sorting) */
+	int         alias;      /* A directory, served with its index's body */
+	int         gzip;       /* Item holding the gzipped copy, or -1 */
+	uint64_t    body;       /* Offset of the body in the image */
+};
+
+static struct item * items = NULL;
+static int item_count = 0;
+static int item_size = 0;
+
+static int add_item(const char * path, const char * disk, const struct stat * st) {
+	if (item_count == item_size) {
+		item_size = item_size ? item_size * 2 : 256;
+		items = realloc(items, sizeof(struct item) * item_size);
+	}
+	struct item * item = &items[item_count];
+	item->path = strdup(path);
+	item->disk = strdup(disk);
+	item->st = *st;
+	item->body_of = -1;
+	item->alias = 0;
+	item->gzip = -1;
+	return item_count++;
+}
+
+static int compare_items(const void * a, const void * b) {
+	return strcmp(((const struct item *)a)->path, ((const struct item *)b)->path);
+}
+
+/*
+ * Look up a path once the items are sorted.
+ */
+static int find_item(const char * path) {
+	struct item key;
+	key.path = (char *)path;
+	struct item * found = bsearch(&key, items, item_count, sizeof(struct item), compare_items);
+	return found ? found - items : -1;
+}
+
+/*
+ * Collect the flat files under disk, and the index for disk itself
+ * as the server would pick it.
+ */
+static void walk(const char * disk, const char * path) {
+	DIR * dir = opendir(disk);
+	if (!dir) {
+		perror(disk);
+		exit(1);
+	}
+	struct dirent * ent;
+	char child_disk[PATH_MAX];
+	char child_path[PATH_MAX];
+	struct stat st;
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+			continue;
+		}
+		snprintf(child_disk, sizeof(child_disk), "%s/%s", disk, ent->d_name);
+		snprintf(child_path, sizeof(child_path), "%s%s", path, ent->d_name);
+		if (stat(child_disk, &st) < 0) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			strcat(child_path, "/");
+			walk(child_disk, child_path);
+		} else if (S_ISREG(st.st_mode) && !(st.st_mode & S_IXOTH)) {
+			add_item(child_path, child_disk, &st);
+		}
+	}
+	closedir(dir);
+
+	char *       index_defaults[] = INDEX_DEFAULTS;
+	unsigned int index_executes[] = INDEX_EXECUTES;
+	unsigned int index;
+	for (index = 0; index_defaults[index] != (char *)0; ++index) {
+		snprintf(child_disk, sizeof(child_disk), "%s/%s", disk, index_defaults[index]);
+		if (stat(child_disk, &st) == 0 && (st.st_mode & S_IXOTH) == index_executes[index]) {
+			if (!index_executes[index]) {
+				snprintf(child_path, sizeof(child_path), "%s%s", path, index_defaults[index]);
+				int alias = add_item(path, child_disk, &st);
+				items[alias].alias = 1;
+				items[alias].disk = strdup(child_path);
+			}
+			break;
+		}
+	}
+}
+
+static void put(FILE * out, const void * data, size_t len, uint64_t * at) {
+	if (fwrite(data, 1, len, out) != len) {
+		perror("write");
+		exit(1);
+	}
+	*at += len;
+}
+
+static void pad(FILE * out, uint64_t align, uint64_t * at) {
+	static const char zeros[IMAGE_ALIGN];
+	put(out, zeros, (align - *at % align) % align, at);
+}
+
+/*
+ * The strings for one item: path, headers, Last-Modified, and an
+ * ETag for each variant. Each is NUL-terminated.
+ */
+static size_t item_strings(struct item * item, char * out, struct image_entry * e, uint64_t base) {
+	size_t len = 0, mime_len;
+	char etag[48], modified[48];
+	size_t etag_len, modified_len;
+
+	e->path = base + len;
+	len += sprintf(out + len, "%s", item->path) + 1;
+
+	const char * name = strrchr(item->disk, '/');
+	const char * mime = mime_header(file_extension((char *)(name ? name : item->disk)), &mime_len);
+	e->headers = base + len;
+	memcpy(out + len, mime, mime_len);
+	e->headers_len = mime_len;
+	if (item->gzip >= 0) {
+		e->headers_len += sprintf(out + len + mime_len, "Vary: Accept-Encoding\r\n");
+	}
+	len += e->headers_len + 1;
+
+	file_validators(&item->st, etag, &etag_len, modified, &modified_len);
+	e->modified = base + len;
+	e->modified_len = modified_len;
+	len += sprintf(out + len, "%s", modified) + 1;
+	e->etag[0] = base + len;
+	e->etag_len[0] = etag_len;
+	len += sprintf(out + len, "%s", etag) + 1;
+	e->etag[1] = base + len;
+	e->etag_len[1] = 0;
+	if (item->gzip >= 0) {
+		/*
+		 * The gzipped copy is a different representation, so
+		 * it gets its own tag.
+		 */
+		etag[etag_len - 1] = '\0';
+		e->etag_len[1] = sprintf(out + len, "%s-gz\"", etag);
+		len += e->etag_len[1];
+	}
+	len += 1;
+	return len;
+}
+
+static void copy_body(FILE * out, const char * disk, size_t size, uint64_t * at) {
+	int fd = open(disk, O_RDONLY);
+	if (fd < 0) {
+		perror(disk);
+		exit(1);
+	}
+	char buf[IO_BUFFER];
+	size_t done = 0;
+	while (done < size) {
+		ssize_t r = read(fd, buf, sizeof(buf) < size - done ? sizeof(buf) : size - done);
+		if (r <= 0) {
+			fprintf(stderr, "%s changed while we were reading it\n", disk);
+			exit(1);
+		}
+		put(out, buf, r, at);
+		done += r;
+	}
+	close(fd);
+}
+
+int main(int argc, char ** argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s docroot image\n", argv[0]);
+		return 1;
+	}
+	const char * docroot = argv[1];
+	walk(docroot, "/");
+	qsort(items, item_count, sizeof(struct item), compare_items);
+
+	/*
+	 * Point directory entries at their index's body, and files at
+	 * their gzipped copies.
+	 */
+	int i;
+	char name[PATH_MAX + 4];
+	for (i = 0; i < item_count; ++i) {
+		items[i].body_of = items[i].alias ? find_item(items[i].disk) : i;
+	}
+	for (i = 0; i < item_count; ++i) {
+		struct item * file = &items[items[i].body_of];
+		snprintf(name, sizeof(name), "%s.gz", file->path);
+		items[i].gzip = find_item(name);
+	}
+
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+	FILE * out = fopen(tmp, "w");
+	if (!out) {
+		perror(tmp);
+		return 1;
+	}
+
+	/*
+	 * Header, a table we fill in once we know where things went,
+	 * strings, then bodies.
+	 */
+	struct image_header header;
+	memcpy(header.magic, IMAGE_MAGIC, 8);
+	header.count = item_count;
+	header.entry_size = sizeof(struct image_entry);
+	header.entries = sizeof(struct image_header);
+	struct image_entry * entries = calloc(item_count ? item_count : 1, sizeof(struct image_entry));
+	uint64_t at = 0;
+	put(out, &header, sizeof(header), &at);
+	put(out, entries, sizeof(struct image_entry) * item_count, &at);
+
+	char * strings = malloc(HEADER_BLOCK + PATH_MAX);
+	for (i = 0; i < item_count; ++i) {
+		size_t len = item_strings(&items[i], strings, &entries[i], at);
+		put(out, strings, len, &at);
+	}
+	free(strings);
+
+	uint64_t total = 0;
+	for (i = 0; i < item_count; ++i) {
+		if (items[i].body_of != i) {
+			continue;
+		}
+		pad(out, IMAGE_ALIGN, &at);
+		items[i].body = at;
+		copy_body(out, items[i].disk, items[i].st.st_size, &at);
+		total += items[i].st.st_size;
+	}
+	for (i = 0; i < item_count; ++i) {
+		struct item * file = &items[items[i].body_of];
+		entries[i].body[0] = file->body;
+		entries[i].size[0] = file->st.st_size;
+		if (items[i].gzip >= 0) {
+			entries[i].body[1] = items[items[i].gzip].body;
+			entries[i].size[1] = items[items[i].gzip].st.st_size;
+		}
+	}
+
+	if (fseek(out, header.entries, SEEK_SET) < 0) {
+		perror(tmp);
+		return 1;
+	}
+	uint64_t unused = 0;
+	put(out, entries, sizeof(struct image_entry) * item_count, &unused);
+	if (fclose(out) != 0 || rename(tmp, argv[2]) < 0) {
+		perror(argv[2]);
+		unlink(tmp);
+		return 1;
+	}
+	printf("%d entries, %llu bytes of files, %llu byte image\n", item_count,
+			(unsigned long long)total, (unsigned long long)at);
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Handler modules for cgiserver.
+ *
+ * A module is a shared object that answers requests for one or more
+ * path prefixes inside the server process, without a fork or a pipe.
+ * It exports a `struct cgiserver_module` named `cgiserver_module`:
+ *
+ *     #include "module.h"
+ *
+ *     static int hello(void * state, struct cgiserver_request * req,
+ *             struct cgiserver_response * res) {
+ *         res->begin(res, "200 OK", "Content-Type: text/plain\r\n", 6);
+ *         return res->write(res, "hello\n", 6);
+ *     }
+ *
+ *     struct cgiserver_module cgiserver_module = {
+ *         CGISERVER_MODULE_ABI, "hello", NULL, hello
+ *     };
+ *
+ *     cc -shared -fPIC -o hello.so hello.c
+ *
+ * and is mounted with a line in the file given to -m:
+ *
+ *     /hello ./hello.so optional-argument
+ *
+ * handle is called from many threads at once. Everything it is given
+ * is only good until it returns.
+ */
+#ifndef CGISERVER_MODULE_H
+#define CGISERVER_MODULE_H
+
+#include <stddef.h>
+
+/*
+ * Bumped whenever anything below changes shape; the server won't
+ * load a module built against a different one.
+ */
+#define CGISERVER_MODULE_ABI 1
+
+struct cgiserver_header {
+	const char * name;
+	const char * value;
+};
+
+struct cgiserver_request {
+	const char * method;         /* "GET", "POST" or "HEAD" */
+	const char * path;           /* As requested, still URL-encoded */
+	const char * query;          /* Query string, or NULL */
+	const char * version;        /* "HTTP/1.1" or "HTTP/1.0" */
+	const char * remote_addr;    /* Client address */
+	const char * prefix;         /* The prefix the module was mounted on */
+	const struct cgiserver_header * headers;
+	size_t       header_count;
+	unsigned long content_length;
+
+	/*
+	 * Read up to len bytes of the request body. Returns the number
+	 * read, 0 at the end of the body, or -1 if the client is gone.
+	 * Whatever isn't read is discarded after handle returns.
+	 */
+	long (*read_body)(struct cgiserver_request * req, void * buf, size_t len);
+
+	void * server;               /* The server's own */
+};
+
+struct cgiserver_response {
+	/*
+	 * Start the response. status is a code and reason ("200 OK"),
+	 * headers are complete lines ("Name: value\r\n"), or NULL. A
+	 * content_length of -1 streams a body of unknown length.
+	 */
+	int (*begin)(struct cgiserver_response * res, const char * status, const char * headers, long content_length);
+
+	/*
+	 * Send part of the body. May wait for a slow client.
+	 */
+	int (*write)(struct cgiserver_response * res, const void * data, size_t len);
+
+	/*
+	 * Send len bytes of an open file from offset, without copying
+	 * it through the module. The server closes fd when it is done.
+	 */
+	int (*send_file)(struct cgiserver_response * res, int fd, size_t offset, size_t len);
+
+	void * server;               /* The server's own */
+};
+
+/*
+ * All of these return 0 on success and -1 on failure. If handle
+ * fails before calling begin, the client gets a 500.
+ */
+struct cgiserver_module {
+	int          abi;            /* CGISERVER_MODULE_ABI */
+	const char * name;
+
+	/*
+	 * Called once per mount at startup, before any requests; may be
+	 * NULL. Whatever it puts in *state is passed to handle.
+	 */
+	int (*init)(const char * prefix, const char * argument, void ** state);
+
+	int (*handle)(void * state, struct cgiserver_request * req, struct cgiserver_response * res);
+};
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * Replay a capture log (cgiserver -R) against a server.
+ *
+ * Builds the server without its main() to share the log format.
+ * Each captured connection gets a connection of its own, opened when
+ * the original was (scaled by the speed), and sends its requests in
+ * order at their original times. Request bodies were not captured;
+ * a body of the same length is sent in their place.
+ *
+ *     make replay && ./replay capture.log 127.0.0.1:8080
+ *     ./replay -s 10 capture.log 127.0.0.1:8080     (ten times as fast)
+ *     ./replay -s 0 capture.log 127.0.0.1:8080      (as fast as it goes)
+ *
+ * Reports the latency distribution and any responses whose status
+ * differs from the captured one.
+ */
+
+#define NO_MAIN 1
+#include "cgiserver.c"
+
+#define REPLAY_CONNECTIONS 256   /* Connections open at once, by default (-c) */
+#define REPLAY_BUFFER      16384
+#define REPLAY_MISMATCHES  10    /* Mismatches listed in the report */
+
+/*
+ * A captured request.
+ */
+struct replay_request {
+	const struct capture_record * record;
+	const char *                  text;
+	unsigned long                 latency;  /* Microseconds, once replayed */
+	int                           status;   /* What we got, or -1 */
+};
+
+/*
+ * A captured connection: its requests, in order.
+ */
+struct replay_connection {
+	struct replay_request ** requests;
+	size_t                   count;
+	size_t                   size;
+};
+
+static struct replay_request * requests = NULL;
+static size_t request_count = 0;
+static struct replay_connection * connections = NULL;
+static size_t connection_count = 0;
+
+static struct addrinfo * target = NULL;
+static double speed = 1.0;
+static struct timespec replay_start;
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slots_free = PTHREAD_COND_INITIALIZER;
+static int slots = REPLAY_CONNECTIONS;
+
+static unsigned long replay_errors = 0;
+
+/*
+ * Wait until a captured time comes around again, at our speed.
+ */
+static void replay_wait(uint64_t usec) {
+	if (speed <= 0) {
+		return;
+	}
+	uint64_t at = usec / speed;
+	struct timespec when = replay_start;
+	when.tv_sec += at / 1000000;
+	when.tv_nsec += (at % 1000000) * 1000;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR);
+}
+
+static unsigned long replay_usec(struct timespec * from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000000UL + (now.tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * Buffered reads from a connection to the server.
+ */
+struct replay_reader {
+	int    fd;
+	size_t pos;
+	size_t len;
+	char   buf[REPLAY_BUFFER];
+};
+
+static int reader_fill(struct replay_reader * r) {
+	if (r->pos < r->len) {
+		return 0;
+	}
+	ssize_t got = recv(r->fd, r->buf, sizeof(r->buf), 0);
+	if (got <= 0) {
+		return -1;
+	}
+	r->pos = 0;
+	r->len = got;
+	return 0;
+}
+
+/*
+ * A line, without its line ending; NULL if the connection closed.
+ */
+static char * reader_line(struct replay_reader * r, char * line, size_t size) {
+	size_t len = 0;
+	while (1) {
+		if (reader_fill(r) < 0) {
+			return NULL;
+		}
+		char c = r->buf[r->pos++];
+		if (c == '\n') {
+			break;
+		}
+		if (len + 1 < size) {
+			line[len++] = c;
+		}
+	}
+	if (len && line[len - 1] == '\r') {
+		len--;
+	}
+	line[len] = '\0';
+	return line;
+}
+
+/*
+ * Skip len bytes, or everything up to the close for a len of -1.
+ */
+static int reader_skip(struct replay_reader * r, long len) {
+	while (len) {
+		if (reader_fill(r) < 0) {
+			return len < 0 ? 0 : -1;
+		}
+		size_t take = r->len - r->pos;
+		if (len > 0 && (size_t)len < take) {
+			take = len;
+		}
+		r->pos += take;
+		if (len > 0) {
+			len -= take;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read one response. Returns its status, or -1; sets *close if the
+ * server is done with the connection.
+ */
+static int read_response(struct replay_reader * r, int head, int * close) {
+	char line[HEADER_SIZE];
+	int status;
+	long length;
+	int chunked;
+	do {
+		if (!reader_line(r, line, sizeof(line)) || sscanf(line, "HTTP/%*s %d", &status) != 1) {
+			return -1;
+		}
+		length = -1;
+		chunked = 0;
+		*close = !strncmp(line, "HTTP/1.0", 8);
+		while (reader_line(r, line, sizeof(line)) && line[0]) {
+			if (!strncasecmp(line, "Content-Length:", 15)) {
+				length = atol(line + 15);
+			} else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked")) {
+				chunked = 1;
+			} else if (!strncasecmp(line, "Connection:", 11) && strstr(line, "close")) {
+				*close = 1;
+			}
+		}
+	} while (status >= 100 && status < 200);
+
+	if (head || status == 204 || status == 304) {
+		return status;
+	}
+	if (chunked) {
+		while (1) {
+			if (!reader_line(r, line, sizeof(line))) {
+				return -1;
+			}
+			long size = strtol(line, NULL, 16);
+			if (!size) {
+				break;
+			}
+			if (reader_skip(r, size + 2) < 0) {
+				return -1;
+			}
+		}
+		while (reader_line(r, line, sizeof(line)) && line[0]);
+		return status;
+	}
+	if (length < 0) {
+		*close = 1;
+	}
+	return reader_skip(r, length) < 0 ? -1 : status;
+}
+
+static int replay_connect(void) {
+	int fd = socket(target->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, target->ai_addr, target->ai_addrlen) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int send_all(int fd, const char * data, size_t len) {
+	while (len) {
+		ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+static void * replay_thread(void * arg) {
+	struct replay_connection * conn = arg;
+	struct replay_reader * r = malloc(sizeof(struct replay_reader));
+	static const char zeros[REPLAY_BUFFER];
+	size_t i;
+	r->fd = -1;
+	for (i = 0; i < conn->count; ++i) {
+		struct replay_request * req = conn->requests[i];
+		replay_wait(req->record->usec);
+		struct timespec sent;
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		if (r->fd < 0) {
+			r->fd = replay_connect();
+			r->pos = r->len = 0;
+		}
+		int ok = r->fd >= 0 && send_all(r->fd, req->text, req->record->len) == 0;
+		unsigned long body = req->record->body;
+		while (ok && body) {
+			size_t piece = body > sizeof(zeros) ? sizeof(zeros) : body;
+			ok = send_all(r->fd, zeros, piece) == 0;
+			body -= piece;
+		}
+		int close_after = 1;
+		req->status = ok ? read_response(r, !strncmp(req->text, "HEAD ", 5), &close_after) : -1;
+		req->latency = replay_usec(&sent);
+		if (req->status < 0) {
+			__atomic_add_fetch(&replay_errors, 1, __ATOMIC_RELAXED);
+		}
+		if (close_after && r->fd >= 0) {
+			close(r->fd);
+			r->fd = -1;
+		}
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+	free(r);
+	pthread_mutex_lock(&slots_lock);
+	slots++;
+	pthread_cond_signal(&slots_free);
+	pthread_mutex_unlock(&slots_lock);
+	return NULL;
+}
+
+static int compare_latency(const void * a, const void * b) {
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int compare_start(const void * a, const void * b) {
+	uint64_t x = ((const struct replay_connection *)a)->requests[0]->record->usec;
+	uint64_t y = ((const struct replay_connection *)b)->requests[0]->record->usec;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Read the log and sort its requests into connections.
+ */
+static int load_log(const char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char * log = malloc(size > 0 ? size : 1);
+	if (size < (long)sizeof(struct capture_header) || fread(log, 1, size, f) != (size_t)size ||
+			memcmp(log, CAPTURE_MAGIC, 8)) {
+		fprintf(stderr, "%s is not a capture log.\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	size_t at = sizeof(struct capture_header), request_size = 0;
+	uint32_t max_conn = 0;
+	while (at + sizeof(struct capture_record) <= (size_t)size) {
+		const struct capture_record * record = (const struct capture_record *)(log + at);
+		if (at + sizeof(struct capture_record) + record->len > (size_t)size) {
+			fprintf(stderr, "%s is cut short; replaying what is there.\n", path);
+			break;
+		}
+		if (request_count == request_size) {
+			request_size = request_size ? request_size * 2 : 1024;
+			requests = realloc(requests, request_size * sizeof(struct replay_request));
+		}
+		requests[request_count].record = record;
+		requests[request_count].text = log + at + sizeof(struct capture_record);
+		requests[request_count].status = -1;
+		request_count++;
+		if (record->conn > max_conn) {
+			max_conn = record->conn;
+		}
+		at += sizeof(struct capture_record) + record->len;
+		at = (at + 7) & ~(size_t)7;
+	}
+
+	/*
+	 * Records were written as requests finished, which within a
+	 * connection is the order they came in.
+	 */
+	struct replay_connection * by_id = calloc(max_conn + 1, sizeof(struct replay_connection));
+	size_t i;
+	for (i = 0; i < request_count; ++i) {
+		struct replay_connection * conn = &by_id[requests[i].record->conn];
+		if (conn->count == conn->size) {
+			conn->size = conn->size ? conn->size * 2 : 8;
+			conn->requests = realloc(conn->requests, conn->size * sizeof(struct replay_request *));
+		}
+		conn->requests[conn->count++] = &requests[i];
+	}
+	connections = malloc((max_conn + 1) * sizeof(struct replay_connection));
+	for (i = 0; i <= max_conn; ++i) {
+		if (by_id[i].count) {
+			connections[connection_count++] = by_id[i];
+		}
+	}
+	free(by_id);
+	qsort(connections, connection_count, sizeof(struct replay_connection), compare_start);
+	return 0;
+}
+
+static void report(double elapsed) {
+	unsigned long * latencies = malloc((request_count ? request_count : 1) * sizeof(unsigned long));
+	size_t i, done = 0, mismatches = 0;
+	for (i = 0; i < request_count; ++i) {
+		struct replay_request * req = &requests[i];
+		if (req->status < 0) {
+			continue;
+		}
+		latencies[done++] = req->latency;
+		if (req->record->status && req->status != req->record->status) {
+			if (mismatches++ < REPLAY_MISMATCHES) {
+				const char * end = strstr(req->text, "\r\n");
+				printf("mismatch: %.*s: captured %d, got %d\n", (int)(end - req->text), req->text,
+						req->record->status, req->status);
+			}
+		}
+	}
+	qsort(latencies, done, sizeof(unsigned long), compare_latency);
+	printf("%zu requests on %zu connections in %.2f s (%.0f/s)\n", request_count, connection_count,
+			elapsed, elapsed > 0 ? done / elapsed : 0.0);
+	printf("%lu failed, %zu status mismatches\n", replay_errors, mismatches);
+	if (done) {
+		static const double points[] = { 0.5, 0.9, 0.99, 0.999 };
+		printf("latency (ms):");
+		for (i = 0; i < sizeof(points) / sizeof(*points); ++i) {
+			printf(" p%g %.3f", points[i] * 100, latencies[(size_t)(points[i] * (done - 1))] / 1000.0);
+		}
+		printf(" max %.3f\n", latencies[done - 1] / 1000.0);
+	}
+	free(latencies);
+}
+
+int main(int argc, char ** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+		switch (opt) {
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'c':
+				slots = atoi(optarg);
+				break;
+			default:
+				goto _usage;
+		}
+	}
+	if (argc - optind != 2 || slots < 1) {
+_usage:
+		fprintf(stderr, "usage: %s [-s speed, 0 for flat out] [-c connections] capture.log host:port\n", argv[0]);
+		return 1;
+	}
+	char * host = argv[optind + 1];
+	char * colon = strrchr(host, ':');
+	if (!colon) {
+		goto _usage;
+	}
+	*colon = '\0';
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, colon + 1, &hints, &target) != 0) {
+		fprintf(stderr, "Can't resolve %s\n", host);
+		return 1;
+	}
+	if (load_log(argv[optind]) < 0) {
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_t * threads = malloc((connection_count ? connection_count : 1) * sizeof(pthread_t));
+	clock_gettime(CLOCK_MONOTONIC, &replay_start);
+	size_t i;
+	for (i = 0; i < connection_count; ++i) {
+		replay_wait(connections[i].requests[0]->record->usec);
+		pthread_mutex_lock(&slots_lock);
+		while (!slots) {
+			pthread_cond_wait(&slots_free, &slots_lock);
+		}
+		slots--;
+		pthread_mutex_unlock(&slots_lock);
+		pthread_create(&threads[i], NULL, replay_thread, &connections[i]);
+	}
+	for (i = 0; i < connection_count; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	report(replay_usec(&replay_start) / 1e6);
+	return 0;
+}